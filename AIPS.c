@@ -1,28 +1,123 @@
 /* Archenoth IPS AIPS (Pronounced "Apes") */
 
 #include "AIPS.h"
+#include "CRC.h"
 #include "IPS.h"
 #include "UPS.h"
+#include "BPS.h"
+#include "MAP.h"
+#include "STATS.h"
+#include "BATCH.h"
+#include "CHAIN.h"
+#include "FORMAT.h"
+#include "IO.h"
+#include "DECODE.h"
+#include "STREAM.h"
+#include "SHA.h"
+#include "CACHE.h"
+#include "ROMS.h"
+
+#include <sys/stat.h>
+
+/**
+ * Removes the patch file we were creating, when it couldn't be made,
+ * so a failed run doesn't leave an empty patch behind.
+ *
+ * @param struct pStruct *params A pointer to a parameter struct with
+ * the new patch, if there is one.
+ */
+static void dropCreated(pStruct *params) {
+  if(!(params->flags & ARG_CREATE) || !params->patchPath ||
+     strcmp(params->patchPath, "-") == 0) {
+    return;
+  }
+
+  if(params->patchFile) {
+    fclose(params->patchFile);
+    params->patchFile = NULL;
+  }
+  remove(params->patchPath);
+}
 
 int main(int argc, char *argv[]) {
-  pStruct params = {NULL, 0, NULL, NULL};
+  pStruct params;
+  struct stats stats;
+  unsigned long long start;
 
   int i;
+
+  memset(&params, 0, sizeof(params));
+  /* Counting is cheap enough to always do; --stats only prints it. */
+  statsUse(&stats);
   for(i = 1; i < argc; i++) {
     if(!parseArg(argv[i], &params)) {
+      dropCreated(&params);
       return 1;
     }
   }
 
+  if(params.flags & ARG_ASYNC) {
+    ioEnable(1);
+    if((params.flags & ARG_VERBOSE) && ioEnabled()) {
+      printf("Using %s for file transfers.\n", ioEnabled() == IO_URING ?
+             "io_uring" : "a thread pool");
+    }
+  }
+
   /* Help screen */
   if(params.flags & ARG_HELP) {
     printf("Archenoth IPS help.\n\n"
-           "Invocation: %s <options> <IPS FIle> <ROM File>\n\n"
+           "Invocation: %s <options> <IPS FIle> <ROM File>\n"
+           "Creating a patch: %s <options> <New IPS/IPS32/UPS/BPS File> <Original ROM>"
+           " <Modified ROM>\n"
+           "Either file can be - to read it from stdin. (Patches, or with IPS,"
+           " the ROM,\nwhich is then written to stdout unless --output is"
+           " given)\n"
+           "Patches and ROMs can be gzip, zip or zstd compressed. (Compressed"
+           " ROMs need\n--output)\n"
+           "Chaining patches: %s --chain <options> <Patch> <Patch...> <ROM>\n\n"
            "Options:\n"
            "-h, -help, -?, --help\tShows this help screen.\n"
            "-version\t\tPrints out version information.\n"
-           "-v, -verbose\t\tShow verbose output. (Can be used twice.)\n",
-           argv[0]);
+           "-v, -verbose\t\tShow verbose output. (Can be used twice.)\n"
+           "--scan=<directory>\tList every patch under a directory, and"
+           " what\n\t\t\tkind it is.\n"
+           "--batch[=<file>]\tPatch every \"<patch> <ROM> [<output>]\" line"
+           " in a\n\t\t\tmanifest file, or stdin.\n"
+           "--jobs=<count>\t\tNumber of batch threads. (Default: one per"
+           " core)\n"
+           "--crc-threads=<count>\tThreads to checksum big files with."
+           " (Default: one\n\t\t\tper core)\n"
+           "--verify, --dry-run\tCheck that a patch fits a file, and print"
+           " the size\n\t\t\tand CRC the patched file would have, without"
+           "\n\t\t\twriting anything.\n"
+           "--output=<file>\t\tPatch a copy of the ROM instead of the ROM"
+           " itself.\n"
+           "--copier-header\t\tIf the ROM has a 512 byte copier header, (It's"
+           "\n\t\t\t512 bytes over a whole kilobyte) patch what comes"
+           "\n\t\t\tafter it, and leave the header alone.\n"
+           "--async\t\t\tRead files with io_uring (Or a thread pool), with"
+           "\n\t\t\tseveral reads in flight at once.\n"
+           "--index\t\t\tSave (And reuse) the parsed index of an IPS patch"
+           "\n\t\t\tnext to it.\n"
+           "--cache=<directory>\tKeep parsed patches in a cache, filed under"
+           " their\n\t\t\tcontents, so the same patch under any name is"
+           " only\n\t\t\tparsed once.\n"
+           "--cache-results\t\tAlso cache patched files, so applying a"
+           " patch to a\n\t\t\tfile it's been applied to before just"
+           " copies the\n\t\t\tresult.\n"
+           "--cache-size=<MB>[,<MB>]\n\t\t\tHow much the cache can hold"
+           " on disk, (Default:\n\t\t\t1024) and in memory. (Default:"
+           " 64)\n"
+           "--roms=<file>\t\tPick the ROM a UPS or BPS patch is for out of"
+           " this\n\t\t\tindex when none is given. (Needs --output)\n"
+           "--index-roms=<directory>\n\t\t\tIndex every ROM under a"
+           " directory into the --roms\n\t\t\tfile, by size and CRC.\n"
+           "--chain\t\t\tApply every patch that follows, in order, and only"
+           "\n\t\t\twrite the ROM once they all succeed.\n"
+           "--stats=<json|csv>\tPrint phase times and counters to stderr"
+           " at the\n\t\t\tend. (Or for every job, in batch mode)\n",
+           argv[0], argv[0], argv[0]);
 
     return 0;
   }
@@ -33,16 +128,86 @@ int main(int argc, char *argv[]) {
    */
   if(params.flags & ARG_VERSION) {
     printf("Archenoth IPS version %s\n", VERSION);
+  } else if(params.flags & ARG_SCAN) {
+    return !formatScan(&params);
+  } else if(params.flags & ARG_INDEX_ROMS) {
+    return !romsBuild(&params);
+  } else if(params.flags & ARG_BATCH) {
+    int result = batchRun(&params);
+
+    cacheClose();
+    return !result;
+  } else if(params.flags & ARG_CHAIN) {
+    int result = 0;
+
+    if(params.romFile == NULL || params.chainLength == 0) {
+      fprintf(stderr, "Chaining needs at least one patch and a file to"
+              " patch.\nTry %s -h\n", argv[0]);
+    } else if((params.flags & ARG_CREATE) || params.targetFile != NULL) {
+      AIPSError(ERR_MEDIUM, "Every patch in a chain has to already exist,"
+                " and there can only be one ROM.");
+    } else if(params.flags & ARG_VERIFY) {
+      AIPSError(ERR_MEDIUM, "Chains can't be checked; check each patch on"
+                " its own.");
+    } else if(params.flags & ARG_HEADER) {
+      AIPSError(ERR_MEDIUM, "Chains can't leave copier headers alone;"
+                " apply each patch on its own.");
+    } else if(useOutput(&params)) {
+      result = chainRun(&params);
+    }
+
+    chainClose(&params);
+    start = statsClock();
+    if(params.romFile) {
+      fclose(params.romFile);
+    }
+    if(params.targetFile) {
+      fclose(params.targetFile);
+    }
+    statsPhase(STATS_FLUSH, start);
+
+    if(params.stats) {
+      statsPrint(stderr, params.stats, &stats, "chain", result, 1);
+    }
+    return !result;
+  } else if(params.romFile == NULL && params.patchFile != NULL &&
+            !(params.flags & ARG_CREATE) && romsEnabled() &&
+            !romsFind(&params)) {
+    /* romsFind has already said why */
+    fclose(params.patchFile);
   } else if(params.romFile == NULL || params.patchFile == NULL) {
     fprintf(stderr, "File to patch and patch file are both required.\n"
             "Try %s -h\n", argv[0]);
-  } else {
-    int result = params.patchFunction(&params);
+  } else if((params.flags & ARG_CREATE) && params.targetFile == NULL) {
+    fprintf(stderr, "Creating a patch needs the original and the"
+            " modified file.\nTry %s -h\n", argv[0]);
+  } else if(!(params.flags & ARG_CREATE) && params.targetFile != NULL) {
+    AIPSError(ERR_MEDIUM, "Hunh? Dual ROM files?");
+  } else if((params.flags & ARG_CREATE) && params.outputFile != NULL) {
+    AIPSError(ERR_MEDIUM, "The new patch is already the output file.");
+  } else if(useOutput(&params)) {
+    int result = cachePatch(&params);
+    cacheClose();
+    streamClose(params.stream);
     fclose(params.patchFile);
+    params.patchFile = NULL;
+    start = statsClock();
     fclose(params.romFile);
-    return result;
+    if(params.targetFile) {
+      fclose(params.targetFile);
+    }
+    statsPhase(STATS_FLUSH, start);
+
+    if(params.stats) {
+      statsPrint(stderr, params.stats, &stats, params.patchPath, result, 1);
+    }
+    if(!result) {
+      dropCreated(&params);
+    }
+    return !result;
   }
 
+  dropCreated(&params);
   return 1;
 }
 
@@ -61,7 +226,7 @@ int main(int argc, char *argv[]) {
  * @return 1 on success, 0 on errors.
  */
 int parseArg(char *argument, pStruct *params){
-  if(argument[0] == '-') {
+  if(argument[0] == '-' && argument[1] != '\0') {
     if(strcmp(argument, "--version") == 0){
       /* Version */
       params->flags = params->flags | ARG_VERSION;
@@ -75,6 +240,78 @@ int parseArg(char *argument, pStruct *params){
       } else {
         params->flags |= ARG_VERBOSE;
       }
+    } else if(strcmp(argument, "--chain") == 0) {
+      /* Every patch after this one goes on the chain */
+      params->flags |= ARG_CHAIN;
+    } else if(strcmp(argument, "--async") == 0) {
+      /* Read files with several reads in flight */
+      params->flags |= ARG_ASYNC;
+    } else if(strcmp(argument, "--verify") == 0 ||
+              strcmp(argument, "--dry-run") == 0) {
+      /* Check patches against their files without writing anything */
+      params->flags |= ARG_VERIFY;
+    } else if(strcmp(argument, "--index") == 0) {
+      /* Keep IPS patch indexes in sidecar files */
+      params->flags |= ARG_INDEX;
+    } else if(strncmp(argument, "--cache=", 8) == 0) {
+      /* Content-addressed cache of parsed patches */
+      if(!cacheOpen(argument + 8)) {
+        return 0;
+      }
+    } else if(strcmp(argument, "--cache-results") == 0) {
+      /* And of patched files */
+      params->flags |= ARG_CACHE_RESULTS;
+    } else if(strncmp(argument, "--cache-size=", 13) == 0) {
+      char *end;
+      unsigned long disk = strtoul(argument + 13, &end, 10);
+      unsigned long memory = (unsigned long)(CACHE_MEMORY_LIMIT >> 20);
+
+      if(*end == ',') {
+        memory = strtoul(end + 1, &end, 10);
+      }
+      if(disk == 0 || *end != '\0') {
+        return AIPSError(ERR_MEDIUM, "Bad cache size: %s\n", argument + 13);
+      }
+      cacheLimits((size_t)disk << 20, (size_t)memory << 20);
+    } else if(strcmp(argument, "--copier-header") == 0) {
+      /* Leave SNES copier headers out of patching */
+      params->flags |= ARG_HEADER;
+    } else if(strncmp(argument, "--roms=", 7) == 0) {
+      /* Index to find ROMs for patches in */
+      romsOpen(argument + 7);
+    } else if(strncmp(argument, "--index-roms=", 13) == 0) {
+      params->flags |= ARG_INDEX_ROMS;
+      params->scanPath = argument + 13;
+    } else if(strncmp(argument, "--output=", 9) == 0) {
+      params->outputFile = argument + 9;
+    } else if(strncmp(argument, "--scan=", 7) == 0) {
+      /* Classify every file under a directory */
+      params->flags |= ARG_SCAN;
+      params->scanPath = argument + 7;
+    } else if(strcmp(argument, "--batch") == 0) {
+      /* Batch mode, reading the manifest from stdin */
+      params->flags |= ARG_BATCH;
+      params->batchFile = "-";
+    } else if(strncmp(argument, "--batch=", 8) == 0) {
+      params->flags |= ARG_BATCH;
+      params->batchFile = argument + 8;
+    } else if(strncmp(argument, "--stats=", 8) == 0) {
+      /* Counters and phase times, printed to stderr at the end */
+      if(!(params->stats = statsFormat(argument + 8))) {
+        return AIPSError(ERR_MEDIUM, "Unknown stats format: %s\n",
+                         argument + 8);
+      }
+    } else if(strncmp(argument, "--crc-threads=", 14) == 0) {
+      /* Threads to checksum big files with */
+      if(atoi(argument + 14) <= 0) {
+        return AIPSError(ERR_MEDIUM, "Bad number of threads: %s\n",
+                         argument + 14);
+      }
+      crcThreads(atoi(argument + 14));
+    } else if(strncmp(argument, "--jobs=", 7) == 0) {
+      if((params->jobs = atoi(argument + 7)) <= 0) {
+        return AIPSError(ERR_MEDIUM, "Bad number of jobs: %s\n", argument + 7);
+      }
     } else {
       return AIPSError(ERR_MEDIUM, "Unrecognized argument: %s\n", argument);
     }
@@ -84,6 +321,64 @@ int parseArg(char *argument, pStruct *params){
   return 1;
 }
 
+/**
+ * Checks whether a file argument is a pipe, (Or anything else that
+ * isn't a regular file) like stdin usually is.
+ *
+ * @param char *argument The file argument.
+ *
+ * @return int 1 if it's a pipe, 0 otherwise.
+ */
+static int isPipe(char *argument) {
+  struct stat info;
+
+  if(strcmp(argument, "-") == 0) {
+    return fstat(fileno(stdin), &info) == 0 && !S_ISREG(info.st_mode);
+  }
+
+  return stat(argument, &info) == 0 && !S_ISREG(info.st_mode);
+}
+
+/**
+ * Checks whether this build can unpack a file argument, if it's
+ * compressed at all.
+ *
+ * @param char *argument The file argument.
+ *
+ * @return int 1 if it can, (Or it isn't compressed) 0 otherwise.
+ */
+static int canDecode(char *argument) {
+  FILE *file;
+  int type;
+
+  if(isPipe(argument) ||
+     !(file = strcmp(argument, "-") == 0 ? stdin : fopen(argument, "rb"))) {
+    return 1;
+  }
+
+  type = decodeType(file);
+  if(file != stdin) {
+    fclose(file);
+  }
+
+  return decodeSupported(type);
+}
+
+/**
+ * Says which library a compressed file needs, for when it isn't
+ * built in.
+ *
+ * @param const char *name The file's name.
+ * @param int type Its DECODE_ type.
+ *
+ * @return int 0, for returning from the caller.
+ */
+static int unsupportedError(const char *name, int type) {
+  return AIPSError(ERR_MEDIUM, "%s: %s support isn't built in. (Rebuild with"
+                   " %s=1)", name, type == DECODE_ZSTD ? "zstd" : "zlib",
+                   type == DECODE_ZSTD ? "ZSTD" : "ZLIB");
+}
+
 /**
  * Filename parsing function
  *
@@ -99,65 +394,75 @@ int parseArg(char *argument, pStruct *params){
  * @return Returns 1 on success, or 0 on failure.
  */
 int fileArgument(char *argument, pStruct *params) {
-  FILE *file;
+  unsigned long long start = statsClock();
+  FILE *file = openIfPatch(argument, params);
 
-  if((file = openIfPatch(argument, params))){
-    if(params->patchFile == NULL) {
+  statsPhase(STATS_DETECT, start);
+  if(file){
+    if(params->flags & ARG_CHAIN) {
+      return chainAdd(params, file);
+    } else if(params->patchFile == NULL) {
       /* TODO check size of file, if 0 set as create patch file */
+      params->patchPath = argument;
       return !!(params->patchFile = file);
     } else {
       return AIPSError(ERR_MEDIUM, "You totally just gave me two patch files.");
     }
+  } else if(!params->patchFile &&
+            ((!(params->flags & ARG_CHAIN) && isPipe(argument)) ||
+             !canDecode(argument))) {
+    /* openIfPatch already read it, and said why it's no good */
+    return 0;
   } else {
     if(params->romFile == NULL) {
-      return !!(params->romFile = useFile(argument, params, "rb+"));
+      /*
+       * With an output file, a check, or a patch to create, the ROM
+       * itself is only ever read
+       */
+      params->romFile = useFile(argument, params, params->outputFile ||
+                                (params->flags & (ARG_VERIFY | ARG_CREATE)) ?
+                                "rb" : "rb+");
+      if(!params->romFile) {
+        return AIPSError(ERR_MEDIUM, "Couldn't open %s.", argument);
+      }
+      return 1;
+    } else if(params->targetFile == NULL) {
+      /* Only good for creating patches; main checks that. */
+      if(!(params->targetFile = useFile(argument, params, "rb"))) {
+        return AIPSError(ERR_MEDIUM, "Couldn't open %s.", argument);
+      }
+      return 1;
     } else {
-      return AIPSError(ERR_MEDIUM, "Hunh? Dual ROM files?");
+      return AIPSError(ERR_MEDIUM, "Hunh? Triple ROM files?");
     }
   }
 }
 
 /**
- * Using the enabled functions, this function will probe the passed-in
- * file handle, and see if it can figure out what kind of patch it's
- * looking at, and set the correct function to patch it in the passed
- * in pStruct.
+ * Picks the function to handle a patch with: the format's checker in
+ * verify mode, and otherwise the one that applies it from a file or a
+ * stream.
  *
- * @param FILE* file: A pointer to the file you wish to probe.
- * @param pStruct* params: A pointer to the pStruct you wish to set
- * the correct patching function to patch the returned file with.
+ * @param const struct patchFormat *format The format of the patch, or
+ * NULL if it isn't one.
+ * @param pStruct *params The parameter struct to set the function in.
+ * @param int streamed Nonzero if the patch is read through a stream.
  *
- * @return FILE*: A patchable file if we found a patching function, or
- * NULL if nothing is found.
+ * @return int 1 if there's a function for this patch, 0 otherwise.
  */
-FILE* headerProbe(FILE* file, pStruct *params){
-  int (*function[])(FILE *argFile, int verbose) = {
-    IPSCheckPatch,
-    UPSCheckPatch
-  };
-
-  int (*patchFunction[])(pStruct *params) = {
-    IPSPatchFile,
-    UPSPatchFile
-  };
-
-  int i;
-  for(i = 0; i < (int)(sizeof(function)/sizeof(function[0])); i++) {
-    if(function[i](file, (params->flags & ARG_VERBOSE))){
-      params->patchFunction = patchFunction[i];
-      return file;
-    } else {
-      rewind(file); /* So that the next check will happen from the beginning. */
-    }
+static int usePatch(const struct patchFormat *format, pStruct *params,
+                    int streamed) {
+  if(!format) {
+    return 0;
   }
 
-  /* This file is obviously not a valid patch at this point in time... */
-  fclose(file);
-  if(params->flags & ARG_VERBOSE) {
-    printf("This looks like the ROM file to patch..?\n");
+  if(params->flags & ARG_VERIFY) {
+    params->patchFunction = format->verify ? formatVerify : NULL;
+  } else {
+    params->patchFunction = streamed ? format->stream : format->patch;
   }
 
-  return NULL;
+  return params->patchFunction != NULL;
 }
 
 /**
@@ -183,42 +488,261 @@ FILE* headerProbe(FILE* file, pStruct *params){
  * be written) and NULL otherwise.
  */
 FILE* openIfPatch(char *filename, pStruct *params) {
+  const struct patchFormat *format;
+  struct stat info;
+  int type;
   FILE *file;
 
   if(!(file = useFile(filename, params, "rb"))){
-    return useFile(filename, params, "wb+");
+    /* Chains and checks only read patches, so there's nothing to create */
+    if(!(params->flags & (ARG_CHAIN | ARG_VERIFY)) &&
+       (file = useFile(filename, params, "wb+"))) {
+      params->flags |= ARG_CREATE;
+      params->patchFunction = &IPSCreatePatch;
+
+      if((format = formatByExtension(filename)) && format->create) {
+        params->patchFunction = format->create;
+      }
+    }
+    return file;
   }
 
-  /*
-   * Least amount of work... Just check the filename to determine type
-   * of check.
-   */
-  if(strlen(filename) > 4) {
-    char *extension = filename + (strlen(filename) - 4);
+  /* Pipes can only be read once, so they're read through a stream */
+  if(fstat(fileno(file), &info) == 0 && !S_ISREG(info.st_mode)) {
+    struct patchStream *stream;
 
-    /* Quick IPS check */
-    if(strcasecmp(extension, ".ips") == 0) {
-      if(IPSCheckPatch(file, (params->flags & ARG_VERBOSE))) {
-        params->patchFunction = &IPSPatchFile;
-        return file;
+    /* Once we have a patch, a pipe can only be the ROM. */
+    if(params->patchFile || (params->flags & ARG_CHAIN) ||
+       !(stream = streamOpen(file, NULL))) {
+      if(file != stdin) {
+        fclose(file);
+      }
+      return NULL;
+    }
+
+    format = formatMatch(stream->buffer, stream->end, (size_t)-1);
+    if(usePatch(format, params, 1)) {
+      if(params->flags & ARG_VERBOSE) {
+        printf("Streaming a %s patch...\n", format->name);
+      }
+      params->stream = stream;
+      return file;
+    }
+
+    streamClose(stream);
+    if(file != stdin) {
+      fclose(file);
+    }
+    /* What we read of it is gone, so it can't be the ROM either. */
+    if(format) {
+      AIPSError(ERR_MEDIUM, "%s patches can't be read from a pipe.",
+                format->name);
+    } else {
+      AIPSError(ERR_MEDIUM, "%s doesn't look like a patch. (A pipe can only"
+                " be the ROM if it comes after the patch)", filename);
+    }
+    return NULL;
+  }
+
+  /* Compressed patches are unpacked as they're read */
+  if(!params->patchFile && (type = decodeType(file)) != DECODE_NONE) {
+    struct decoder *decoder;
+    struct patchStream *stream;
+
+    /* If we can't unpack it, it can't be the ROM either. */
+    if(!decodeSupported(type)) {
+      if(file != stdin) {
+        fclose(file);
       }
+      unsupportedError(filename, type);
+      return NULL;
     }
 
-    /* Quick UPS check */
-    if(strcasecmp(extension, ".ups") == 0) {
-      if(UPSCheckPatch(file, (params->flags & ARG_VERBOSE))) {
-        params->patchFunction = &UPSPatchFile;
+    decoder = decodeOpen(file, 1, NULL);
+    if(decoder && (stream = streamOpen(file, decoder))) {
+      format = formatMatch(stream->buffer, stream->end, (size_t)-1);
+      if(usePatch(format, params, 1)) {
+        if(params->flags & ARG_VERBOSE) {
+          printf("Unpacking a compressed %s patch...\n", format->name);
+        }
+
+        /* Chains unpack each patch when they get to it. */
+        if(params->flags & ARG_CHAIN) {
+          streamClose(stream);
+        } else {
+          params->stream = stream;
+        }
         return file;
       }
+
+      streamClose(stream);
+      if(format) {
+        AIPSError(ERR_MINOR, "%s holds a %s patch, which we can't apply.",
+                  filename, format->name);
+      }
     }
+    rewind(file);
   }
 
-  /* Hoomy. Guess we gotta check the headers of the files themselves. */
-  return headerProbe(file, params);
+  /* One read of the start of the file tells us what it is. */
+  if((format = formatSniff(file, NULL))) {
+    if(usePatch(format, params, 0)) {
+      if(params->flags & ARG_VERBOSE) {
+        printf("This appears to be a valid %s patch...\n", format->name);
+      }
+      return file;
+    }
+
+    AIPSError(ERR_MINOR, "%s looks like a %s patch, which we can't apply.",
+              filename, format->name);
+  }
+
+  /* This file is obviously not a valid patch at this point in time... */
+  fclose(file);
+  if(params->flags & ARG_VERBOSE) {
+    printf("This looks like the ROM file to patch..?\n");
+  }
+
+  return NULL;
 }
 
 
 
+/**
+ * Unpacks a compressed ROM into the output file, which is then
+ * patched in its place.
+ *
+ * For archives, the file picked is the one the patch says it applies
+ * to, if the patch has a checksum for it and the archive has a file
+ * with that checksum. Otherwise, it's the largest file in the archive
+ * that isn't a patch.
+ *
+ * @param struct pStruct *params A pointer to a parameter struct with
+ * the compressed ROM, the patch, and the output file.
+ *
+ * @return int 1 if the unpacked ROM is ready to patch, 0 otherwise.
+ */
+static int useDecoded(pStruct *params) {
+  struct decoder *decoder;
+  unsigned int crc;
+  int known = 0, type;
+  FILE *output;
+
+  if(params->outputFile == NULL) {
+    return AIPSError(ERR_MEDIUM, "Compressed files can only be patched into"
+                     " a new file. (Use --output)");
+  }
+
+  if(params->patchFile && !params->stream) {
+    known = formatSourceCRC(params->patchFile, &crc);
+  }
+
+  if(!decodeSupported(type = decodeType(params->romFile))) {
+    return unsupportedError("The file to patch", type);
+  }
+
+  if(!(decoder = decodeOpen(params->romFile, 0, known ? &crc : NULL))) {
+    return AIPSError(ERR_MEDIUM, "Couldn't find anything to patch in the"
+                     " compressed file.");
+  }
+
+  if(params->flags & ARG_VERBOSE) {
+    printf("Unpacking the file to patch to: %s\n", params->outputFile);
+  }
+
+  if(!(output = fopen(params->outputFile, "wb+"))) {
+    decodeClose(decoder);
+    return AIPSError(ERR_MEDIUM, "Couldn't open %s.", params->outputFile);
+  }
+
+  if(!decodeTo(decoder, output)) {
+    decodeClose(decoder);
+    fclose(output);
+    return AIPSError(ERR_MEDIUM, "The compressed file seems to be damaged.");
+  }
+
+  decodeClose(decoder);
+  fclose(params->romFile);
+  params->romFile = output;
+  rewind(output);
+  return 1;
+}
+
+/**
+ * Checks whether a path names a file that's already open.
+ *
+ * @param FILE *file The open file, or NULL.
+ * @param const char *path The path to check.
+ *
+ * @return int 1 if they're the same file, 0 otherwise.
+ */
+static int isSameFile(FILE *file, const char *path) {
+  struct stat opened, named;
+
+  return file && fstat(fileno(file), &opened) == 0 &&
+         stat(path, &named) == 0 && opened.st_dev == named.st_dev &&
+         opened.st_ino == named.st_ino;
+}
+
+/**
+ * Switches the file to patch over to a copy of it, if an output file
+ * was asked for.
+ *
+ * The copy is made with copyFile, so on filesystems that can clone
+ * files, the only new blocks are the ones the patch ends up changing.
+ *
+ * @param struct pStruct *params A pointer to a parameter struct with
+ * the ROM, and possibly an output file to copy it to.
+ *
+ * @return int 1 if the ROM (Or its copy) is ready to patch, 0 if the
+ * copy couldn't be made.
+ */
+int useOutput(pStruct *params) {
+  unsigned long long start;
+  struct stat info;
+  FILE *copy;
+
+  /* Checks don't write anything, so the file is only ever read */
+  if(params->flags & ARG_VERIFY) {
+    return 1;
+  }
+
+  /* The output is emptied before anything's copied into it. */
+  if(params->outputFile && (isSameFile(params->romFile, params->outputFile) ||
+                            isSameFile(params->patchFile,
+                                       params->outputFile))) {
+    return AIPSError(ERR_MEDIUM, "The output file can't be the patch or the"
+                     " file to patch. (Leave out --output to patch it in"
+                     " place)");
+  }
+
+  /* Compressed ROMs are unpacked into the output file. */
+  if(!(params->flags & ARG_CREATE) &&
+     fstat(fileno(params->romFile), &info) == 0 && S_ISREG(info.st_mode) &&
+     decodeType(params->romFile) != DECODE_NONE) {
+    return useDecoded(params);
+  }
+
+  if(params->outputFile == NULL) {
+    return 1;
+  }
+
+  if(params->flags & ARG_VERBOSE) {
+    printf("Copying the file to patch to: %s\n", params->outputFile);
+  }
+
+  start = statsClock();
+  copy = copyFile(params->romFile, params->outputFile);
+  statsPhase(STATS_FLUSH, start);
+  fclose(params->romFile);
+  if(!(params->romFile = copy)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't copy the file to patch to %s.",
+                     params->outputFile);
+  }
+
+  return 1;
+}
+
 /**
  * Opens a file with a debug and error handling wrapper.
  *
@@ -229,7 +753,7 @@ FILE* openIfPatch(char *filename, pStruct *params) {
  * mode that you wish to use to open the file with.
  *
  * @param char *argument A string of the path to the file you are
- * looking to open.
+ * looking to open, or "-" for stdin.
  * @param struct pStruct *params A struct containing a valid flags
  * variable to determine the options for opening the file and function
  * operation.
@@ -242,7 +766,7 @@ FILE* openIfPatch(char *filename, pStruct *params) {
  * when it does not.
  */
 FILE *useFile(char *argument, pStruct *params, char *mode) {
-  FILE *argFile = fopen(argument, mode);
+  FILE *argFile = strcmp(argument, "-") == 0 ? stdin : fopen(argument, mode);
 
   if((params->flags & ARG_VERBOSE)){
     if(argFile == NULL) {
@@ -16,6 +16,16 @@
 #define ARG_VERBOSE (1 << 2)
 #define ARG_VERYVERBOSE (1 << 3)
 #define ARG_OVERWRITE (1 << 4)
+#define ARG_CREATE (1 << 5)
+#define ARG_BATCH (1 << 6)
+#define ARG_CHAIN (1 << 7)
+#define ARG_INDEX (1 << 8)
+#define ARG_SCAN (1 << 9)
+#define ARG_ASYNC (1 << 10)
+#define ARG_VERIFY (1 << 11)
+#define ARG_CACHE_RESULTS (1 << 12)
+#define ARG_INDEX_ROMS (1 << 13)
+#define ARG_HEADER (1 << 14)
 
 /* Error level definition */
 #define ERR_MINOR 0
@@ -29,13 +39,46 @@
  * http://zerosoft.zophar.net/ips.php
  */
 #define BYTE3_TO_UINT(bp) \
-  (((unsigned int)(bp)[0] << 16) & 0x00FF0000) | \
-  (((unsigned int)(bp)[1] << 8) & 0x0000FF00) |	 \
-  ((unsigned int)(bp)[2] & 0x000000FF)
+  ((((unsigned int)(bp)[0] << 16) & 0x00FF0000) | \
+   (((unsigned int)(bp)[1] << 8) & 0x0000FF00) |	 \
+   ((unsigned int)(bp)[2] & 0x000000FF))
+
+#define BYTE4_TO_UINT(bp) \
+  (((unsigned int)(bp)[0] << 24) | \
+   ((unsigned int)(bp)[1] << 16) | \
+   ((unsigned int)(bp)[2] << 8) | \
+   (unsigned int)(bp)[3])
 
 #define BYTE2_TO_UINT(bp) \
-  (((unsigned int)(bp)[0] << 8) & 0xFF00) | \
-  ((unsigned int) (bp)[1] & 0x00FF)
+  ((((unsigned int)(bp)[0] << 8) & 0xFF00) | \
+   ((unsigned int) (bp)[1] & 0x00FF))
+
+#define UINT_TO_BYTE3(bp, value) \
+  ((bp)[0] = (unsigned char)((value) >> 16), \
+   (bp)[1] = (unsigned char)((value) >> 8), \
+   (bp)[2] = (unsigned char)(value))
+
+#define UINT_TO_BYTE4(bp, value) \
+  ((bp)[0] = (unsigned char)((value) >> 24), \
+   (bp)[1] = (unsigned char)((value) >> 16), \
+   (bp)[2] = (unsigned char)((value) >> 8), \
+   (bp)[3] = (unsigned char)(value))
+
+#define UINT_TO_BYTE2(bp, value) \
+  ((bp)[0] = (unsigned char)((value) >> 8), \
+   (bp)[1] = (unsigned char)(value))
+
+#define BYTE4_TO_UINT_LE(bp) \
+  ((unsigned int)(bp)[0] | \
+   ((unsigned int)(bp)[1] << 8) | \
+   ((unsigned int)(bp)[2] << 16) | \
+   ((unsigned int)(bp)[3] << 24))
+
+#define UINT_TO_BYTE4_LE(bp, value) \
+  ((bp)[0] = (unsigned char)(value), \
+   (bp)[1] = (unsigned char)((value) >> 8), \
+   (bp)[2] = (unsigned char)((value) >> 16), \
+   (bp)[3] = (unsigned char)((value) >> 24))
 
 /* Parameter Struct */
 typedef struct pStruct pStruct;
@@ -44,6 +87,27 @@ struct pStruct {
   int flags;
   FILE *romFile;
   FILE *patchFile;
+  char *patchPath;
+  FILE *targetFile;
+  char *batchFile;
+  int jobs;
+  FILE **patchChain;
+  int chainLength;
+  char *outputFile;
+  char *scanPath;
+  struct patchStream *stream;
+  int stats;
+};
+
+/*
+ * What checking a patch against a file says the patched file will be,
+ * or if the check failed, whether it was the file that didn't match.
+ */
+struct patchCheck {
+  unsigned long outputSize;
+  unsigned int outputCRC;
+  unsigned long records;
+  int wrongFile;
 };
 
 /* Function definitions */
@@ -53,6 +117,7 @@ int AIPSError(int level, const char *message, ...);
 int patchROM(struct pStruct *params);
 FILE* useFile(char *argument, struct pStruct *params, char *mode);
 FILE* openIfPatch(char *filename, struct pStruct *params);
+int useOutput(struct pStruct *params);
 #endif
 
 /* Testing macro if CFLAGS=-DAIPS_TEST */
@@ -0,0 +1,328 @@
+/* Batch patching functions */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "STATS.h"
+#include "BATCH.h"
+#include "MAP.h"
+#include "SHA.h"
+#include "CACHE.h"
+
+#include <pthread.h>
+#include <time.h>
+
+struct batchPool {
+  struct batchJob *jobs;
+  size_t count;
+  size_t next;
+  size_t patched;
+  size_t failed;
+  int flags;
+  int stats;
+  int printed;
+  pthread_mutex_t lock;
+};
+
+/**
+ * Splits a manifest line into its patch, ROM and output fields.
+ *
+ * Fields are separated by tabs if the line has any (So paths can have
+ * spaces in them), or by any whitespace otherwise.
+ *
+ * @param char *line The line to split. (It is modified in place.)
+ * @param char **fields Where to store pointers to up to three fields.
+ *
+ * @return int The number of fields found.
+ */
+static int batchSplit(char *line, char **fields) {
+  const char *separators = strchr(line, '\t') ? "\t\r\n" : " \t\r\n";
+  int count = 0;
+  char *field;
+
+  for(field = strtok(line, separators); field && count < 3;
+      field = strtok(NULL, separators)) {
+    fields[count++] = field;
+  }
+
+  return field ? 4 : count;
+}
+
+/**
+ * Frees a list of jobs from batchRead.
+ */
+static void batchFree(struct batchJob *jobs, size_t count) {
+  size_t i;
+
+  for(i = 0; i < count; i++) {
+    free(jobs[i].patch);
+  }
+  free(jobs);
+}
+
+/**
+ * Reads every job out of a manifest.
+ *
+ * Each line holds a patch, a ROM, and optionally a file to write the
+ * patched ROM to instead of patching the ROM itself. Blank lines and
+ * lines starting with # are skipped.
+ *
+ * @param FILE *manifest The manifest to read.
+ * @param struct batchJob **jobs Where to store the list of jobs.
+ * @param size_t *count Where to store the number of jobs.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int batchRead(FILE *manifest, struct batchJob **jobs, size_t *count) {
+  size_t capacity = 0, line = 0;
+  char buffer[BATCH_LINE];
+
+  *jobs = NULL;
+  *count = 0;
+  while(fgets(buffer, sizeof(buffer), manifest)) {
+    char *fields[3] = {NULL, NULL, NULL};
+    struct batchJob *job;
+    int found;
+
+    line++;
+    if(buffer[0] == '#' || !(found = batchSplit(buffer, fields))) {
+      continue;
+    }
+
+    if(found < 2 || found > 3) {
+      batchFree(*jobs, *count);
+      return AIPSError(ERR_MEDIUM, "Manifest line %lu needs a patch, a ROM,"
+                       " and optionally an output file.", (unsigned long)line);
+    }
+
+    if(*count == capacity) {
+      struct batchJob *grown;
+
+      capacity = capacity ? capacity * 2 : 64;
+      if(!(grown = (struct batchJob*)realloc(*jobs, capacity *
+                                             sizeof(struct batchJob)))) {
+        batchFree(*jobs, *count);
+        return AIPSError(ERR_MEDIUM, "Out of memory!");
+      }
+      *jobs = grown;
+    }
+
+    /* One allocation holds all three strings */
+    job = &(*jobs)[*count];
+    job->patch = (char*)malloc(strlen(fields[0]) + strlen(fields[1]) +
+                               (fields[2] ? strlen(fields[2]) : 0) + 3);
+    if(!job->patch) {
+      batchFree(*jobs, *count);
+      return AIPSError(ERR_MEDIUM, "Out of memory!");
+    }
+
+    job->rom = job->patch + strlen(fields[0]) + 1;
+    job->output = fields[2] ? job->rom + strlen(fields[1]) + 1 : NULL;
+    strcpy(job->patch, fields[0]);
+    strcpy(job->rom, fields[1]);
+    if(fields[2]) {
+      strcpy(job->output, fields[2]);
+    }
+    job->result = 0;
+    (*count)++;
+  }
+
+  return 1;
+}
+
+/**
+ * Runs a single job from the manifest.
+ *
+ * The job gets its own pStruct with the same flags as the batch, so
+ * it goes through exactly the same detection and patch functions as
+ * a single patch from the command line would.
+ *
+ * @param struct batchJob *job The job to run.
+ * @param int flags The flags to patch with.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int batchPatch(struct batchJob *job, int flags) {
+  pStruct params;
+  unsigned long long start;
+  int result;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = flags & ~ARG_BATCH;
+  params.patchPath = job->patch;
+  params.outputFile = job->output;
+
+  /* openIfPatch would make a new patch out of a missing file */
+  if(access(job->patch, R_OK) != 0) {
+    return AIPSError(ERR_MEDIUM, "%s: No such patch.", job->patch);
+  }
+
+  start = statsClock();
+  params.patchFile = openIfPatch(job->patch, &params);
+  statsPhase(STATS_DETECT, start);
+  if(!params.patchFile) {
+    return AIPSError(ERR_MEDIUM, "%s: Couldn't use this as a patch.",
+                     job->patch);
+  }
+
+  params.romFile = useFile(job->rom, &params, job->output ||
+                           (flags & ARG_VERIFY) ? "rb" : "rb+");
+  if(!params.romFile || !useOutput(&params)) {
+    fclose(params.patchFile);
+    return AIPSError(ERR_MEDIUM, "%s: Couldn't open the file to patch.",
+                     job->output ? job->output : job->rom);
+  }
+
+  result = cachePatch(&params);
+  fclose(params.patchFile);
+  start = statsClock();
+  fclose(params.romFile);
+  statsPhase(STATS_FLUSH, start);
+  return result;
+}
+
+/**
+ * Worker thread body. Takes jobs off the shared list until there are
+ * none left.
+ */
+static void *batchWorker(void *argument) {
+  struct batchPool *pool = (struct batchPool*)argument;
+
+  while(1) {
+    struct batchJob *job;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->next == pool->count) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    job = &pool->jobs[pool->next++];
+    pthread_mutex_unlock(&pool->lock);
+
+    statsUse(&job->stats);
+    job->result = batchPatch(job, pool->flags);
+
+    pthread_mutex_lock(&pool->lock);
+    if(job->result) {
+      pool->patched++;
+    } else {
+      pool->failed++;
+    }
+    printf("[%s] %s -> %s\n", job->result ? "ok" : "failed", job->patch,
+           job->output ? job->output : job->rom);
+    if(pool->stats) {
+      statsPrint(stderr, pool->stats, &job->stats, job->patch, job->result,
+                 !pool->printed++);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    statsUse(NULL);
+  }
+}
+
+/**
+ * Works out how many worker threads to use.
+ */
+static int batchThreads(int requested, size_t jobs) {
+  long threads = requested;
+
+  if(threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(threads <= 0) {
+      threads = 1;
+    }
+  }
+
+  if(threads > BATCH_MAX_THREADS) {
+    threads = BATCH_MAX_THREADS;
+  }
+
+  if((size_t)threads > jobs) {
+    threads = jobs ? (long)jobs : 1;
+  }
+
+  return (int)threads;
+}
+
+/**
+ * Patches everything listed in a manifest, on a pool of worker
+ * threads.
+ *
+ * Prints a status line per job as it finishes, and a summary at the
+ * end.
+ *
+ * @param pStruct *params The parameters, with the manifest path ("-"
+ * for stdin), the number of threads to use (0 for one per core) and
+ * the flags to patch with.
+ *
+ * @return int 1 if every job succeeded, 0 otherwise.
+ */
+int batchRun(struct pStruct *params) {
+  struct batchPool pool;
+  pthread_t threads[BATCH_MAX_THREADS];
+  FILE *manifest = stdin;
+  struct timespec start, end;
+  int count, crcSetting, i;
+
+  if(strcmp(params->batchFile, "-") != 0 &&
+     !(manifest = fopen(params->batchFile, "r"))) {
+    return AIPSError(ERR_MEDIUM, "Couldn't open the manifest: %s",
+                     params->batchFile);
+  }
+
+  i = batchRead(manifest, &pool.jobs, &pool.count);
+  if(manifest != stdin) {
+    fclose(manifest);
+  }
+
+  if(!i) {
+    return 0;
+  }
+
+  if(pool.count == 0) {
+    return AIPSError(ERR_MEDIUM, "There's nothing to patch in the manifest.");
+  }
+
+  pool.next = pool.patched = pool.failed = 0;
+  pool.flags = params->flags;
+  pool.stats = params->stats;
+  pool.printed = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* With more than one job at a time, those already keep the cores busy */
+  count = batchThreads(params->jobs, pool.count);
+  crcSetting = crcThreads(1);
+  if(count == 1) {
+    crcThreads(crcSetting);
+  }
+  for(i = 0; i < count; i++) {
+    if(pthread_create(&threads[i], NULL, batchWorker, &pool) != 0) {
+      break;
+    }
+  }
+
+  if(i == 0) {
+    batchWorker(&pool); /* No threads? We'll just have to do it ourselves. */
+  }
+
+  count = i;
+  for(i = 0; i < count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_mutex_destroy(&pool.lock);
+  crcThreads(crcSetting);
+
+  printf("Batch done: %lu %s, %lu failed, in %.3f seconds on %d"
+         " thread%s.\n", (unsigned long)pool.patched,
+         params->flags & ARG_VERIFY ? "checked" : "patched",
+         (unsigned long)pool.failed,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         count ? count : 1, count == 1 ? "" : "s");
+
+  batchFree(pool.jobs, pool.count);
+
+  return pool.failed == 0;
+}
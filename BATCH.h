@@ -0,0 +1,14 @@
+/* Batch limits */
+#define BATCH_LINE 4096
+#define BATCH_MAX_THREADS 256
+
+struct batchJob {
+  char *patch;
+  char *rom;
+  char *output;
+  int result;
+  struct stats stats;
+};
+
+
+int batchRun(struct pStruct *params);
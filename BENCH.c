@@ -0,0 +1,583 @@
+/* Benchmark harness and synthetic patch generator */
+
+#include "AIPS.h"
+#include "IPS.h"
+#include "BENCH.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static unsigned long long benchSeed = 0x9E3779B97F4A7C15ULL;
+static const char *benchAIPS = "./AIPS";
+static int benchRuns = BENCH_RUNS;
+
+/**
+ * The next number from a xorshift generator, so every run of the
+ * benchmark generates the same files.
+ */
+static unsigned long long benchRandom(void) {
+  benchSeed ^= benchSeed >> 12;
+  benchSeed ^= benchSeed << 25;
+  benchSeed ^= benchSeed >> 27;
+  return benchSeed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Fills a buffer with random bytes.
+ */
+static void benchNoise(unsigned char *data, size_t length) {
+  size_t i;
+
+  for(i = 0; i + 8 <= length; i += 8) {
+    unsigned long long word = benchRandom();
+
+    memcpy(data + i, &word, 8);
+  }
+
+  for(; i < length; i++) {
+    data[i] = (unsigned char)benchRandom();
+  }
+}
+
+/**
+ * Reads a size like 512K, 16M or 1G.
+ *
+ * @param const char *text The size.
+ * @param unsigned long *size Where to store the size in bytes.
+ *
+ * @return int 1 on success, 0 if it can't be read.
+ */
+static int benchSize(const char *text, unsigned long *size) {
+  char *end;
+
+  *size = strtoul(text, &end, 10);
+  switch(*end) {
+    case 'G': case 'g':
+      *size <<= 10;
+      /* Fall through */
+    case 'M': case 'm':
+      *size <<= 10;
+      /* Fall through */
+    case 'K': case 'k':
+      *size <<= 10;
+      end++;
+      break;
+  }
+
+  return end != text && *end == '\0';
+}
+
+/**
+ * Splits a comma separated list of sizes or counts.
+ *
+ * @return int How many values were read, or 0 if any of them is bad.
+ */
+static int benchList(const char *text, unsigned long *values) {
+  char buffer[BENCH_PATH], *item;
+  int count = 0;
+
+  strncpy(buffer, text, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  for(item = strtok(buffer, ","); item && count < BENCH_LIST;
+      item = strtok(NULL, ",")) {
+    if(!benchSize(item, &values[count++])) {
+      return 0;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Writes a whole buffer to a new file.
+ */
+static int benchWrite(const char *path, const unsigned char *data,
+                      size_t length) {
+  FILE *file = fopen(path, "wb");
+  int result;
+
+  if(!file) {
+    return 0;
+  }
+
+  result = fwrite(data, BYTE, length, file) == length;
+  return (fclose(file) == 0) && result;
+}
+
+/**
+ * Generates a case: a random ROM, a copy of it with records' worth of
+ * changes, and an IPS patch between them (If the ROM is small enough
+ * for IPS) written directly, so it has exactly the records asked for.
+ *
+ * Records are spread evenly over the ROM, with their sizes varying
+ * around the record size. The RLE share is the percentage of them
+ * that are runs of a single byte.
+ *
+ * @param struct benchCase *test The case to generate, with its size,
+ * records, record size, RLE share and paths filled in.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int benchGenerate(struct benchCase *test) {
+  unsigned char *rom = (unsigned char*)malloc(test->size);
+  unsigned long slot = test->size / test->records, i;
+  FILE *ips = NULL;
+  int result = 1;
+
+  if(!rom) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  benchNoise(rom, test->size);
+  if(!benchWrite(test->original, rom, test->size)) {
+    free(rom);
+    return AIPSError(ERR_MEDIUM, "Couldn't write %s.", test->original);
+  }
+
+  if(test->size <= BENCH_IPS_LIMIT) {
+    if(!(ips = fopen(test->ips, "wb"))) {
+      free(rom);
+      return AIPSError(ERR_MEDIUM, "Couldn't write %s.", test->ips);
+    }
+    fwrite("PATCH", BYTE, 5, ips);
+  }
+
+  for(i = 0; i < test->records; i++) {
+    unsigned long length = test->recordSize / 2 + 1 +
+                           benchRandom() % test->recordSize;
+    unsigned long offset;
+    int rle = benchRandom() % 100 < test->rle;
+    unsigned char header[8];
+
+    if(length > slot - 1) {
+      length = slot - 1;
+    }
+    if(length > IPS_MAX_SIZE) {
+      length = IPS_MAX_SIZE;
+    }
+
+    offset = i * slot + benchRandom() % (slot - length);
+    if(offset == IPS_EOF_OFFSET) {
+      offset++; /* It would read as the end of the patch */
+    }
+
+    if(rle) {
+      memset(rom + offset, (unsigned char)benchRandom(), length);
+    } else {
+      benchNoise(rom + offset, length);
+    }
+
+    if(ips) {
+      UINT_TO_BYTE3(header, offset);
+      if(rle) {
+        UINT_TO_BYTE2(header + 3, 0);
+        UINT_TO_BYTE2(header + 5, length);
+        header[7] = rom[offset];
+        result &= fwrite(header, BYTE, 8, ips) == 8;
+      } else {
+        UINT_TO_BYTE2(header + 3, length);
+        result &= fwrite(header, BYTE, 5, ips) == 5 &&
+                  fwrite(rom + offset, BYTE, length, ips) == length;
+      }
+    }
+  }
+
+  if(ips) {
+    result &= fwrite("EOF", BYTE, 3, ips) == 3;
+    test->patchSize = (unsigned long)ftell(ips);
+    result &= fclose(ips) == 0;
+  }
+
+  result &= benchWrite(test->modified, rom, test->size);
+  free(rom);
+
+  return result ? 1 : AIPSError(ERR_MEDIUM, "Couldn't write the case files.");
+}
+
+/**
+ * Runs AIPS once with its output thrown away, timing it and taking
+ * how much memory it used.
+ *
+ * @param char **arguments The arguments, starting with AIPS itself.
+ * @param double *seconds Where to store how long it took.
+ * @param long *peakKB Where to store its peak resident set size.
+ *
+ * @return int 1 if AIPS succeeded, 0 otherwise.
+ */
+static int benchExec(char **arguments, double *seconds, long *peakKB) {
+  struct timespec start, end;
+  struct rusage usage;
+  int status;
+  pid_t child;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if((child = fork()) < 0) {
+    return 0;
+  }
+
+  if(child == 0) {
+    int null = open("/dev/null", O_WRONLY);
+
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(arguments[0], arguments);
+    _exit(127);
+  }
+
+  if(wait4(child, &status, 0, &usage) != child) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  *peakKB = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Checks that a file came out the same as the modified ROM.
+ */
+static int benchSame(const char *path, const char *expected) {
+  FILE *a = fopen(path, "rb"), *b = fopen(expected, "rb");
+  unsigned char x[1 << 16], y[1 << 16];
+  size_t read;
+  int result = a && b;
+
+  while(result && (read = fread(x, BYTE, sizeof(x), a)) > 0) {
+    result = fread(y, BYTE, read, b) == read && memcmp(x, y, read) == 0;
+  }
+
+  result = result && fread(y, BYTE, 1, b) == 0;
+  if(a) {
+    fclose(a);
+  }
+  if(b) {
+    fclose(b);
+  }
+  return result;
+}
+
+static int benchCompare(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * The nearest-rank percentile of sorted timings, in milliseconds.
+ */
+static double benchPercentile(const struct benchResult *result, int percent) {
+  int rank = (result->runs * percent + 99) / 100;
+
+  return result->seconds[rank > 0 ? rank - 1 : 0] * 1000;
+}
+
+/**
+ * Times an operation over every run and prints a line for it.
+ *
+ * @param const char *name The name of the operation.
+ * @param const struct benchCase *test The case it's run on.
+ * @param char **arguments The AIPS command line to run.
+ * @param const char *remove A file to delete before each run, or NULL.
+ * @param const char *check A file that has to come out the same as the
+ * modified ROM, or NULL.
+ * @param unsigned long bytes How many bytes each run processes.
+ *
+ * @return int 1 if every run succeeded, 0 otherwise.
+ */
+static int benchTime(const char *name, const struct benchCase *test,
+                     char **arguments, const char *remove, const char *check,
+                     unsigned long bytes) {
+  struct benchResult result;
+  double median;
+  int i;
+
+  result.seconds = (double*)malloc(benchRuns * sizeof(double));
+  result.runs = 0;
+  result.peakKB = 0;
+  if(!result.seconds) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  for(i = 0; i < benchRuns; i++) {
+    long peakKB;
+
+    if(remove) {
+      unlink(remove);
+    }
+
+    if(!benchExec(arguments, &result.seconds[i], &peakKB)) {
+      free(result.seconds);
+      return AIPSError(ERR_MEDIUM, "%s failed on the %luK case.", name,
+                       test->size >> 10);
+    }
+
+    if(i == 0 && check && !benchSame(check, test->modified)) {
+      free(result.seconds);
+      return AIPSError(ERR_MEDIUM, "%s gave the wrong result on the %luK"
+                       " case.", name, test->size >> 10);
+    }
+
+    result.runs++;
+    if(peakKB > result.peakKB) {
+      result.peakKB = peakKB;
+    }
+  }
+
+  qsort(result.seconds, result.runs, sizeof(double), benchCompare);
+  median = benchPercentile(&result, 50) / 1000;
+
+  printf("%-14s %10luK %8lu %4u%% %9.2f %9.2f %9.2f %10.1f %12.0f %9ld\n",
+         name, test->size >> 10, test->records, test->rle,
+         benchPercentile(&result, 50), benchPercentile(&result, 90),
+         benchPercentile(&result, 99), bytes / 1048576.0 / median,
+         test->records / median, result.peakKB);
+
+  free(result.seconds);
+  return 1;
+}
+
+/**
+ * Generates and times one case: creating, detecting, checking and applying its
+ * patches, with both I/O backends for applying.
+ *
+ * @return int 1 if everything succeeded, 0 otherwise.
+ */
+static int benchCase(struct benchCase *test, const char *directory) {
+  char output[BENCH_PATH + 16], created[BENCH_PATH], scan[BENCH_PATH + 16];
+  char *aips = (char*)benchAIPS;
+  int result;
+
+  snprintf(test->original, BENCH_PATH, "%s/original.bin", directory);
+  snprintf(test->modified, BENCH_PATH, "%s/modified.bin", directory);
+  snprintf(test->ips, BENCH_PATH, "%s/patch.ips", directory);
+  snprintf(test->ups, BENCH_PATH, "%s/patch.ups", directory);
+  snprintf(created, BENCH_PATH, "%s/created.ips", directory);
+  snprintf(output, sizeof(output), "--output=%s/output.bin", directory);
+  test->patchSize = 0;
+
+  if(!benchGenerate(test)) {
+    return 0;
+  }
+
+  {
+    char *createUPS[] = {aips, test->ups, test->original, test->modified,
+                         NULL};
+
+    result = benchTime("create-ups", test, createUPS, test->ups, NULL,
+                       test->size);
+  }
+
+  if(result && test->patchSize) {
+    char *createIPS[] = {aips, created, test->original, test->modified, NULL};
+    char *applyIPS[] = {aips, test->ips, test->original, output, NULL};
+    char *asyncIPS[] = {aips, "--async", test->ips, test->original, output,
+                        NULL};
+    char *verifyIPS[] = {aips, "--verify", test->ips, test->original, NULL};
+
+    snprintf(scan, sizeof(scan), "--scan=%s", test->ips);
+    {
+      char *detect[] = {aips, scan, NULL};
+
+      result = benchTime("create-ips", test, createIPS, created, NULL,
+                         test->size) &&
+               benchTime("detect", test, detect, NULL, NULL,
+                         test->patchSize) &&
+               benchTime("verify-ips", test, verifyIPS, NULL, NULL,
+                         test->size) &&
+               benchTime("apply-ips", test, applyIPS, NULL, output + 9,
+                         test->size) &&
+               benchTime("apply-ips-aio", test, asyncIPS, NULL, output + 9,
+                         test->size);
+    }
+  }
+
+  if(result) {
+    char *applyUPS[] = {aips, test->ups, test->original, output, NULL};
+    char *asyncUPS[] = {aips, "--async", test->ups, test->original, output,
+                        NULL};
+    char *verifyUPS[] = {aips, "--verify", test->ups, test->original, NULL};
+
+    result = benchTime("verify-ups", test, verifyUPS, NULL, NULL,
+                       test->size) &&
+             benchTime("apply-ups", test, applyUPS, NULL, output + 9,
+                       test->size) &&
+             benchTime("apply-ups-aio", test, asyncUPS, NULL, output + 9,
+                       test->size);
+  }
+
+  unlink(test->original);
+  unlink(test->modified);
+  unlink(test->ips);
+  unlink(test->ups);
+  unlink(created);
+  unlink(output + 9);
+  return result;
+}
+
+/**
+ * Makes sure a patch created around the IPS end of file marker comes
+ * out right: a run of one byte that ends just at the marker (So the
+ * RLE record before it has a single byte left over) and a change near
+ * the end of the file, past it.
+ *
+ * @return int 1 if the patch was created and applied cleanly, 0
+ * otherwise.
+ */
+static int benchMarker(const char *directory) {
+  char original[BENCH_PATH], modified[BENCH_PATH], ips[BENCH_PATH];
+  char output[BENCH_PATH + 16];
+  unsigned char *rom = (unsigned char*)calloc(BENCH_MARKER_SIZE, 1);
+  char *aips = (char*)benchAIPS;
+  double seconds;
+  long peakKB;
+  int result;
+
+  if(!rom) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  snprintf(original, BENCH_PATH, "%s/marker.bin", directory);
+  snprintf(modified, BENCH_PATH, "%s/marker-modified.bin", directory);
+  snprintf(ips, BENCH_PATH, "%s/marker.ips", directory);
+  snprintf(output, sizeof(output), "--output=%s/marker-output.bin",
+           directory);
+
+  result = benchWrite(original, rom, BENCH_MARKER_SIZE);
+  memset(rom + IPS_EOF_OFFSET - BENCH_MARKER_RUN, 0x77, BENCH_MARKER_RUN);
+  rom[BENCH_MARKER_SIZE - 1] = 1;
+  result = result && benchWrite(modified, rom, BENCH_MARKER_SIZE);
+  free(rom);
+
+  if(result) {
+    char *create[] = {aips, ips, original, modified, NULL};
+    char *apply[] = {aips, ips, original, output, NULL};
+
+    result = benchExec(create, &seconds, &peakKB) &&
+             benchExec(apply, &seconds, &peakKB) &&
+             benchSame(output + 9, modified);
+  }
+
+  unlink(original);
+  unlink(modified);
+  unlink(ips);
+  unlink(output + 9);
+  return result ? 1 : AIPSError(ERR_MEDIUM, "A patch around the IPS end"
+                                " of file marker didn't come out right.");
+}
+
+/**
+ * Error printing, the same as AIPS's. (See AIPS.c)
+ */
+int AIPSError(int level, const char *message, ...) {
+  va_list arguments;
+
+  va_start(arguments, message);
+  fprintf(stderr, "Error: ");
+  vfprintf(stderr, message, arguments);
+  fprintf(stderr, "\n");
+  va_end(arguments);
+
+  if(level == ERR_MAJOR) {
+    exit(1);
+  }
+
+  return level == ERR_MINOR;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long sizes[BENCH_LIST], records[BENCH_LIST], rles[BENCH_LIST];
+  int sizeCount, recordCount = 1, rleCount = 1, i, j, k, result = 1;
+  unsigned long recordSize = BENCH_RECORD_SIZE;
+  char directory[BENCH_PATH / 2];
+  const char *base = "/tmp";
+  int check = 0;
+
+  sizeCount = benchList(BENCH_SIZES, sizes);
+  records[0] = BENCH_RECORDS;
+  rles[0] = BENCH_RLE;
+
+  for(i = 1; i < argc; i++) {
+    int good = 1;
+
+    if(strncmp(argv[i], "--sizes=", 8) == 0) {
+      good = (sizeCount = benchList(argv[i] + 8, sizes)) > 0;
+      for(j = 0; j < sizeCount; j++) {
+        good &= sizes[j] > 0;
+      }
+    } else if(strncmp(argv[i], "--records=", 10) == 0) {
+      good = (recordCount = benchList(argv[i] + 10, records)) > 0;
+      for(j = 0; j < recordCount; j++) {
+        good &= records[j] > 0;
+      }
+    } else if(strncmp(argv[i], "--rle=", 6) == 0) {
+      good = (rleCount = benchList(argv[i] + 6, rles)) > 0;
+      for(j = 0; j < rleCount; j++) {
+        good &= rles[j] <= 100;
+      }
+    } else if(strncmp(argv[i], "--record-size=", 14) == 0) {
+      good = benchSize(argv[i] + 14, &recordSize) && recordSize > 0;
+    } else if(strncmp(argv[i], "--runs=", 7) == 0) {
+      good = (benchRuns = atoi(argv[i] + 7)) > 0;
+    } else if(strncmp(argv[i], "--aips=", 7) == 0) {
+      benchAIPS = argv[i] + 7;
+    } else if(strncmp(argv[i], "--dir=", 6) == 0) {
+      base = argv[i] + 6;
+    } else if(strcmp(argv[i], "--check") == 0) {
+      check = 1;
+    } else {
+      good = 0;
+    }
+
+    if(!good) {
+      printf("Usage: %s [--sizes=1M,16M,...] [--records=1000,...]"
+             " [--rle=25,...]\n"
+             "\t[--record-size=256] [--runs=10] [--aips=./AIPS]"
+             " [--dir=/tmp] [--check]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  snprintf(directory, sizeof(directory), "%s/aips-bench-XXXXXX", base);
+  if(!mkdtemp(directory)) {
+    return !AIPSError(ERR_MEDIUM, "Couldn't make a directory in %s.", base);
+  }
+
+  /* Checking only makes sure patches come out right; nothing's timed */
+  if(check) {
+    result = benchMarker(directory);
+    rmdir(directory);
+    return !result;
+  }
+
+  printf("%-14s %11s %8s %5s %9s %9s %9s %10s %12s %9s\n", "operation",
+         "size", "records", "rle", "p50 ms", "p90 ms", "p99 ms", "MB/s",
+         "records/s", "peak KB");
+
+  for(i = 0; result && i < sizeCount; i++) {
+    for(j = 0; result && j < recordCount; j++) {
+      for(k = 0; result && k < rleCount; k++) {
+        struct benchCase test;
+
+        test.size = sizes[i];
+        test.records = records[j];
+        test.recordSize = recordSize;
+        test.rle = (unsigned int)rles[k];
+        if(test.size / test.records < 2) {
+          result = AIPSError(ERR_MEDIUM, "%lu records don't fit in %lu"
+                             " bytes.", test.records, test.size);
+        } else {
+          result = benchCase(&test, directory);
+        }
+      }
+    }
+  }
+
+  rmdir(directory);
+  return !result;
+}
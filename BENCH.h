@@ -0,0 +1,41 @@
+/* Benchmark defaults */
+#define BENCH_RUNS 10
+#define BENCH_RECORDS 1000
+#define BENCH_RECORD_SIZE 256
+#define BENCH_RLE 25
+#define BENCH_SIZES "1M,16M,64M"
+#define BENCH_LIST 16
+#define BENCH_PATH 4096
+
+/* IPS can't address past 16 MB, so larger cases are UPS only */
+#define BENCH_IPS_LIMIT (1UL << 24)
+
+/* A run of RLE up to the IPS end of file marker, then one more change */
+#define BENCH_MARKER_SIZE (9UL << 19)
+#define BENCH_MARKER_RUN 0x10000
+
+/*
+ * One generated case: a ROM, a modified copy of it, and the patches
+ * between them.
+ */
+struct benchCase {
+  unsigned long size;
+  unsigned long records;
+  unsigned long recordSize;
+  unsigned int rle;
+  unsigned long patchSize;
+  char original[BENCH_PATH];
+  char modified[BENCH_PATH];
+  char ips[BENCH_PATH];
+  char ups[BENCH_PATH];
+};
+
+/*
+ * Timings for every run of one operation, and the most memory any
+ * run of it used.
+ */
+struct benchResult {
+  double *seconds;
+  int runs;
+  long peakKB;
+};
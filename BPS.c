@@ -0,0 +1,685 @@
+/* BPS file-specific functions */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "UPS.h"
+#include "BPS.h"
+#include "MAP.h"
+#include "DIFF.h"
+#include "STREAM.h"
+#include "STATS.h"
+#include "FORMAT.h"
+
+/**
+ * Reads the sizes and checksums out of a BPS patch in memory.
+ *
+ * BPS uses the same variable-length integers as UPS.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param struct bpsHeader *header The struct to fill in.
+ *
+ * @returns int 1 if the patch looks sound, 0 otherwise.
+ */
+int BPSReadHeader(const unsigned char *patch, size_t patchSize,
+                  struct bpsHeader *header) {
+  const unsigned char *footer;
+
+  if(patchSize < 19 || memcmp(patch, "BPS1", 4) != 0) {
+    return 0;
+  }
+
+  header->start = 4;
+  header->end = patchSize - 12;
+
+  if(!readVLEBuffer(patch, header->end, &header->start, &header->sourceSize) ||
+     !readVLEBuffer(patch, header->end, &header->start, &header->targetSize) ||
+     !readVLEBuffer(patch, header->end, &header->start,
+                    &header->metadataSize) ||
+     header->metadataSize > header->end - header->start) {
+    return 0;
+  }
+
+  header->start += header->metadataSize;
+
+  footer = patch + header->end;
+  header->sourceChecksum = BYTE4_TO_UINT_LE(footer);
+  header->targetChecksum = BYTE4_TO_UINT_LE(footer + 4);
+  header->patchChecksum = BYTE4_TO_UINT_LE(footer + 8);
+  return 1;
+}
+
+/**
+ * Moves a relative copy offset along by a signed VLE delta.
+ *
+ * @returns int 1 if the new offset lands inside limit, 0 otherwise.
+ */
+static int BPSReadOffset(const unsigned char *patch, size_t end,
+                         size_t *position, unsigned long *offset,
+                         unsigned long limit) {
+  unsigned long delta;
+
+  if(!readVLEBuffer(patch, end, position, &delta)) {
+    return 0;
+  }
+
+  if(delta & 1) {
+    if((delta >> 1) > *offset) {
+      return 0;
+    }
+    *offset -= delta >> 1;
+  } else {
+    *offset += delta >> 1;
+  }
+
+  return *offset < limit;
+}
+
+/**
+ * Copies length bytes from earlier in the output to the end of it.
+ *
+ * When the copy overlaps itself the bytes in between repeat, so each
+ * pass copies everything repeated so far, doubling the block size
+ * instead of going a byte at a time.
+ */
+static void BPSTargetCopy(unsigned char *out, size_t distance, size_t length) {
+  const unsigned char *from = out - distance;
+
+  if(distance >= length) {
+    memcpy(out, from, length);
+  } else if(distance == 1) {
+    memset(out, *from, length);
+  } else {
+    while(length) {
+      size_t chunk = (size_t)(out - from);
+
+      if(chunk > length) {
+        chunk = length;
+      }
+
+      memcpy(out, from, chunk);
+      out += chunk;
+      length -= chunk;
+    }
+  }
+}
+
+/**
+ * Applies a BPS patch in memory.
+ *
+ * Every action is bounds checked against the patch, the source and
+ * the target before it's carried out.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param const struct bpsHeader *header The header from BPSReadHeader.
+ * @param const unsigned char *source The file to patch, which must be
+ * header->sourceSize bytes long.
+ * @param unsigned char *target Where to build the patched file, which
+ * must have room for header->targetSize bytes, or NULL to only check
+ * the actions.
+ *
+ * @returns int 1 on success, 0 if the patch is damaged.
+ */
+int BPSApplyBuffer(const unsigned char *patch, const struct bpsHeader *header,
+                   const unsigned char *source, unsigned char *target) {
+  size_t position = header->start, output = 0, actions = 0;
+  unsigned long sourceOffset = 0, targetOffset = 0;
+
+  while(position < header->end) {
+    unsigned long data, length;
+
+    actions++;
+    if(!readVLEBuffer(patch, header->end, &position, &data)) {
+      return 0;
+    }
+
+    length = (data >> 2) + 1;
+    if(length > header->targetSize - output) {
+      return 0;
+    }
+
+    switch(data & 3) {
+      case BPS_SOURCE_READ:
+        if(output + length > header->sourceSize) {
+          return 0;
+        }
+        if(target) {
+          memcpy(target + output, source + output, length);
+        }
+        break;
+
+      case BPS_TARGET_READ:
+        if(length > header->end - position) {
+          return 0;
+        }
+        if(target) {
+          memcpy(target + output, patch + position, length);
+        }
+        position += length;
+        break;
+
+      case BPS_SOURCE_COPY:
+        if(!BPSReadOffset(patch, header->end, &position, &sourceOffset,
+                          header->sourceSize) ||
+           length > header->sourceSize - sourceOffset) {
+          return 0;
+        }
+        if(target) {
+          memcpy(target + output, source + sourceOffset, length);
+        }
+        sourceOffset += length;
+        break;
+
+      case BPS_TARGET_COPY:
+        if(!BPSReadOffset(patch, header->end, &position, &targetOffset,
+                          output)) {
+          return 0;
+        }
+        if(target) {
+          BPSTargetCopy(target + output, output - targetOffset, length);
+        }
+        targetOffset += length;
+        break;
+    }
+
+    output += length;
+  }
+
+  STATS_ADD(records, actions);
+  return output == header->targetSize;
+}
+
+/**
+ * Runs BPSApplyBuffer as the apply phase of the stats.
+ */
+static int BPSApplyTimed(const unsigned char *patch,
+                         const struct bpsHeader *header,
+                         const unsigned char *source, unsigned char *target) {
+  unsigned long long start = statsClock();
+  int result = BPSApplyBuffer(patch, header, source, target);
+
+  statsPhase(STATS_APPLY, start);
+  return result;
+}
+
+/**
+ * Patches a file using a BPS patch.
+ *
+ * BPS can copy from anywhere in the original file, so the patched
+ * file is built in memory and only written over the original once
+ * every checksum has been checked. A copier header (See formatHeader)
+ * is left out of the patch, and put back in front of the patched
+ * file.
+ *
+ * @param pStruct *params A paramater structure complete with the
+ * input and output files, as well as any flags wanted during
+ * patching.
+ *
+ * @returns int 1 on a sucessful patch, 0 otherwise.
+ */
+int BPSPatchFile(struct pStruct *params) {
+  struct mappedFile patch, rom;
+  struct bpsHeader header;
+  unsigned char *target = NULL;
+  unsigned long long start;
+  size_t skip;
+  int result;
+
+  if(params->stream) {
+    /* BPS copies from anywhere in the target, so it's read in whole */
+    patch.file = NULL;
+    patch.flags = MAPPED_HEAP;
+    if(!(patch.data = streamReadAll(params->stream, &patch.size))) {
+      return AIPSError(ERR_MEDIUM, "Couldn't read the BPS patch.");
+    }
+  } else if(!mapBegin(&patch, params->patchFile, 0)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't read the BPS patch.");
+  }
+
+  if(!mapWait(&patch)) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the BPS patch.");
+  }
+
+  start = statsClock();
+  result = BPSReadHeader(patch.data, patch.size, &header);
+  statsPhase(STATS_PARSE, start);
+  if(!result) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  }
+
+  if(!mapFile(&rom, params->romFile, MAPPED_WRITE)) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't open the file to patch.");
+  }
+
+  /* A copier header is copied over to the patched file as it is */
+  skip = formatHeader(params, rom.size);
+
+  if(params->flags & ARG_VERBOSE){
+    printf("The BPS patch says:\n"
+           "Input Filesize: %lu bytes\nOutput Filesize: %lu bytes\n"
+           "...And the actual filesize is: %lu bytes\n",
+           header.sourceSize, header.targetSize,
+           (unsigned long)(rom.size - skip));
+  }
+
+  result = 0;
+  if(rom.size - skip != header.sourceSize) {
+    AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  } else if(crcBuffer(0, patch.data, patch.size - 4) != header.patchChecksum) {
+    AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
+  } else if(crcBuffer(0, rom.data + skip, header.sourceSize) !=
+            header.sourceChecksum) {
+    AIPSError(ERR_MEDIUM, "You may have an invalid file."
+              " (Or this patch isn't for this file.)");
+  } else if(!(target = (unsigned char*)malloc(skip + header.targetSize ?
+                                               skip + header.targetSize :
+                                               1))) {
+    AIPSError(ERR_MEDIUM, "Out of memory!");
+  } else if(!BPSApplyTimed(patch.data, &header, rom.data + skip,
+                           target + skip)) {
+    AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  } else if(crcBuffer(0, target + skip, header.targetSize) !=
+            header.targetChecksum) {
+    AIPSError(ERR_MEDIUM, "The patched file didn't come out right!");
+  } else if(!mapResize(&rom, skip + header.targetSize)) {
+    AIPSError(ERR_MEDIUM, "Couldn't resize the file to patch.");
+  } else {
+    memcpy(target, rom.data, skip);
+    mapUpdate(&rom, target);
+    result = 1;
+  }
+
+  free(target);
+  start = statsClock();
+  result = unmapFile(&rom) && result;
+  statsPhase(STATS_FLUSH, start);
+  unmapFile(&patch);
+  return result;
+}
+
+/**
+ * Checks a BPS patch against a file without patching it.
+ *
+ * The patch and file checksums are checked, and every action is
+ * bounds checked without building the patched file. Its CRC is taken
+ * from the patch, which the patch's own CRC covers.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param const unsigned char *rom The file the patch is for.
+ * @param size_t romSize The size of the file in bytes.
+ * @param struct patchCheck *check Where to store the size and CRC of
+ * the patched file.
+ *
+ * @returns int 1 if the patch can be applied to the file, 0 otherwise.
+ */
+int BPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check) {
+  struct bpsHeader header;
+  size_t position;
+
+  if(!BPSReadHeader(patch, patchSize, &header)) {
+    return AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  } else if(crcBuffer(0, patch, patchSize - 4) != header.patchChecksum) {
+    return AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
+  }
+
+  check->wrongFile = 1;
+  if(romSize != header.sourceSize) {
+    return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  } else if(crcBuffer(0, rom, romSize) != header.sourceChecksum) {
+    return AIPSError(ERR_MEDIUM, "You may have an invalid file."
+                     " (Or this patch isn't for this file.)");
+  }
+
+  check->wrongFile = 0;
+  if(!BPSApplyBuffer(patch, &header, rom, NULL)) {
+    return AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  }
+
+  /* Count the actions for the report */
+  check->records = 0;
+  for(position = header.start; position < header.end;) {
+    unsigned long data, offset;
+
+    readVLEBuffer(patch, header.end, &position, &data);
+    if((data & 3) == BPS_TARGET_READ) {
+      position += (data >> 2) + 1;
+    } else if((data & 3) != BPS_SOURCE_READ) {
+      readVLEBuffer(patch, header.end, &position, &offset);
+    }
+    check->records++;
+  }
+
+  check->outputSize = header.targetSize;
+  check->outputCRC = header.targetChecksum;
+  return 1;
+}
+
+/*
+ * Hash chains for finding matches. Each head holds the last position
+ * (Plus one, so 0 is empty) with a given hash, and each chain entry
+ * links a position to the one before it with the same hash.
+ */
+struct bpsMatcher {
+  unsigned int *head;
+  unsigned int *chain;
+};
+
+static unsigned int BPSHash(const unsigned char *data) {
+  unsigned int word = (unsigned int)data[0] | (unsigned int)data[1] << 8 |
+                      (unsigned int)data[2] << 16 | (unsigned int)data[3] << 24;
+
+  return (word * 2654435761U) >> (32 - BPS_HASH_BITS);
+}
+
+static int BPSMatcherOpen(struct bpsMatcher *matcher, size_t size) {
+  matcher->head = (unsigned int*)calloc((size_t)1 << BPS_HASH_BITS,
+                                        sizeof(unsigned int));
+  matcher->chain = (unsigned int*)malloc((size ? size : 1) *
+                                         sizeof(unsigned int));
+
+  return matcher->head && matcher->chain;
+}
+
+static void BPSMatcherClose(struct bpsMatcher *matcher) {
+  free(matcher->head);
+  free(matcher->chain);
+}
+
+static void BPSMatcherAdd(struct bpsMatcher *matcher,
+                          const unsigned char *data, size_t position) {
+  unsigned int hash = BPSHash(data + position);
+
+  matcher->chain[position] = matcher->head[hash];
+  matcher->head[hash] = (unsigned int)position + 1;
+}
+
+/**
+ * Walks a hash chain for the longest match with the target.
+ *
+ * @returns size_t The length of the best match, with its position in
+ * *best.
+ */
+static size_t BPSLongest(const struct bpsMatcher *matcher,
+                         const unsigned char *data, size_t dataSize,
+                         const unsigned char *target, size_t left,
+                         size_t *best) {
+  unsigned int link = matcher->head[BPSHash(target)];
+  size_t longest = 0;
+  int depth;
+
+  for(depth = 0; link && depth < BPS_CHAIN_DEPTH; depth++) {
+    size_t position = link - 1;
+    size_t limit = dataSize - position < left ? dataSize - position : left;
+    size_t length;
+
+    link = matcher->chain[position];
+
+    /* Most candidates are hash collisions or can't beat the best yet */
+    if(limit <= longest || data[position + longest] != target[longest] ||
+       memcmp(data + position, target, BPS_MIN_MATCH) != 0) {
+      continue;
+    }
+
+    length = diffEqual(data + position, target, limit);
+    if(length > longest) {
+      longest = length;
+      *best = position;
+      if(length == left) {
+        break;
+      }
+    }
+  }
+
+  return longest;
+}
+
+/**
+ * Measures how far a match also extends backwards into the pending
+ * literal bytes before it.
+ */
+static size_t BPSExtendBack(const unsigned char *data, size_t position,
+                            const unsigned char *target, size_t output,
+                            size_t pending) {
+  size_t back = 0;
+
+  while(back < pending && back < position &&
+        data[position - back - 1] == target[output - back - 1]) {
+    back++;
+  }
+
+  return back;
+}
+
+/**
+ * Writes a BPS action header.
+ */
+static void BPSWriteAction(struct crcStream *out, int action, size_t length) {
+  writeVLE(out, ((unsigned long)(length - 1) << 2) | action);
+}
+
+/**
+ * Writes a signed offset for a copy action, and moves the relative
+ * offset to the end of the copy.
+ */
+static void BPSWriteOffset(struct crcStream *out, unsigned long *relative,
+                           size_t position, size_t length) {
+  if(position >= *relative) {
+    writeVLE(out, (unsigned long)(position - *relative) << 1);
+  } else {
+    writeVLE(out, ((unsigned long)(*relative - position) << 1) | 1);
+  }
+
+  *relative = position + length;
+}
+
+/**
+ * Creates a BPS patch from an original and a modified file in memory.
+ *
+ * At each point in the modified file, whichever of these covers the
+ * most bytes (For what it costs to encode) is used:
+ * - A SourceRead of bytes that haven't moved,
+ * - A SourceCopy from anywhere in the original, found with hash chains,
+ * - A TargetCopy from earlier in the modified file, also found with
+ *   hash chains, which covers repeating patterns too.
+ * Anything else is gathered up into TargetRead actions.
+ *
+ * @param const unsigned char *source The original file.
+ * @param size_t sourceSize The size of the original file.
+ * @param const unsigned char *target The modified file.
+ * @param size_t targetSize The size of the modified file.
+ * @param struct crcStream *out The stream to write the patch to.
+ *
+ * @returns int 1 on success, 0 if we run out of memory or writing
+ * fails.
+ */
+int BPSCreateBuffer(const unsigned char *source, size_t sourceSize,
+                    const unsigned char *target, size_t targetSize,
+                    struct crcStream *out) {
+  struct bpsMatcher sources = {NULL, NULL}, targets = {NULL, NULL};
+  unsigned long sourceRelative = 0, targetRelative = 0;
+  size_t output = 0, pending = 0, indexed = 0, search = 0, i;
+  unsigned char footer[4];
+
+  if(!BPSMatcherOpen(&sources, sourceSize) ||
+     !BPSMatcherOpen(&targets, targetSize)) {
+    BPSMatcherClose(&sources);
+    BPSMatcherClose(&targets);
+    return 0;
+  }
+
+  for(i = 0; i + BPS_MIN_MATCH <= sourceSize; i++) {
+    BPSMatcherAdd(&sources, source, i);
+  }
+
+  crcStreamWrite(out, (const unsigned char*)"BPS1", 4);
+  writeVLE(out, sourceSize);
+  writeVLE(out, targetSize);
+  writeVLE(out, 0); /* No metadata */
+
+  while(output < targetSize) {
+    size_t left = targetSize - output;
+    size_t readLength = 0, sourceLength = 0, targetLength = 0;
+    size_t sourcePosition = 0, targetPosition = 0, length;
+    size_t sourceBack = 0, targetBack = 0, back = 0;
+    int action = BPS_TARGET_READ;
+
+    if(output < sourceSize) {
+      readLength = diffEqual(source + output, target + output,
+                             sourceSize - output < left ?
+                             sourceSize - output : left);
+    }
+
+    /*
+     * Nothing is going to beat a long run of unmoved bytes. And the
+     * longer we go without finding a match, the less often we look,
+     * so new data doesn't take a full search per byte.
+     */
+    if(left >= BPS_MIN_MATCH && readLength < BPS_GOOD_READ &&
+       output >= search) {
+      sourceLength = BPSLongest(&sources, source, sourceSize,
+                                target + output, left, &sourcePosition);
+      targetLength = BPSLongest(&targets, target, targetSize,
+                                target + output, left, &targetPosition);
+
+      /* Matches may start in literals we skipped looking at */
+      if(sourceLength) {
+        sourceBack = BPSExtendBack(source, sourcePosition,
+                                   target, output, pending);
+        sourceLength += sourceBack;
+        sourcePosition -= sourceBack;
+      }
+      if(targetLength) {
+        targetBack = BPSExtendBack(target, targetPosition,
+                                   target, output, pending);
+        targetLength += targetBack;
+        targetPosition -= targetBack;
+      }
+    }
+
+    /* A copy costs a few more bytes for its offset than a read */
+    length = BPS_MIN_MATCH - 1;
+    if(readLength > length) {
+      action = BPS_SOURCE_READ;
+      length = readLength;
+    }
+    if(sourceLength > length + 2) {
+      action = BPS_SOURCE_COPY;
+      length = sourceLength;
+      back = sourceBack;
+    }
+    if(targetLength > length + 2 ||
+       (action == BPS_SOURCE_COPY && targetLength > length)) {
+      action = BPS_TARGET_COPY;
+      length = targetLength;
+      back = targetBack;
+    }
+
+    output -= back;
+    pending -= back;
+
+    if(action == BPS_TARGET_READ) {
+      length = 1;
+      pending++;
+      if(output >= search) {
+        search = output + 1 + (pending >> BPS_SKIP_SHIFT);
+      }
+    } else {
+      if(pending) {
+        BPSWriteAction(out, BPS_TARGET_READ, pending);
+        crcStreamWrite(out, target + output - pending, pending);
+        pending = 0;
+      }
+
+      BPSWriteAction(out, action, length);
+      if(action == BPS_SOURCE_COPY) {
+        BPSWriteOffset(out, &sourceRelative, sourcePosition, length);
+      } else if(action == BPS_TARGET_COPY) {
+        BPSWriteOffset(out, &targetRelative, targetPosition, length);
+      }
+    }
+
+    output += length;
+    while(indexed < output && indexed + BPS_MIN_MATCH <= targetSize) {
+      BPSMatcherAdd(&targets, target, indexed++);
+    }
+  }
+
+  if(pending) {
+    BPSWriteAction(out, BPS_TARGET_READ, pending);
+    crcStreamWrite(out, target + output - pending, pending);
+  }
+
+  UINT_TO_BYTE4_LE(footer, crcBuffer(0, source, sourceSize));
+  crcStreamWrite(out, footer, 4);
+  UINT_TO_BYTE4_LE(footer, crcBuffer(0, target, targetSize));
+  crcStreamWrite(out, footer, 4);
+  crcStreamFlush(out);
+  UINT_TO_BYTE4_LE(footer, out->crc);
+  crcStreamWrite(out, footer, 4);
+
+  BPSMatcherClose(&sources);
+  BPSMatcherClose(&targets);
+  return crcStreamFlush(out);
+}
+
+/**
+ * Creates a BPS patch from the ROM file (The original) and the target
+ * file (The modified one).
+ *
+ * @param pStruct *params A paramater structure with the original,
+ * modified and patch files.
+ *
+ * @returns int 1 on a sucessful patch, 0 otherwise.
+ */
+int BPSCreatePatch(struct pStruct *params) {
+  struct crcStream *out = (struct crcStream*)malloc(sizeof(struct crcStream));
+  struct mappedFile source, target;
+  int result;
+
+  if(!out) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  /* With --async, both files are read in at the same time */
+  if(!mapBegin(&source, params->romFile, 0)) {
+    free(out);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the original file.");
+  }
+
+  if(!mapBegin(&target, params->targetFile, 0)) {
+    unmapFile(&source);
+    free(out);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the modified file.");
+  }
+
+  if(!mapWait(&source) || !mapWait(&target)) {
+    unmapFile(&target);
+    unmapFile(&source);
+    free(out);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the original and modified"
+                     " files.");
+  }
+
+  rewind(params->patchFile);
+  crcStreamOpen(out, params->patchFile);
+  result = BPSCreateBuffer(source.data, source.size,
+                           target.data, target.size, out);
+  result = fflush(params->patchFile) == 0 && result;
+
+  if(!result) {
+    AIPSError(ERR_MEDIUM, "Couldn't write the BPS patch.");
+  } else if(params->flags & ARG_VERBOSE) {
+    printf("Created a %ld byte BPS patch.\n", ftell(params->patchFile));
+  }
+
+  unmapFile(&target);
+  unmapFile(&source);
+  free(out);
+  return result;
+}
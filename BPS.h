@@ -0,0 +1,36 @@
+/* BPS actions */
+#define BPS_SOURCE_READ 0
+#define BPS_TARGET_READ 1
+#define BPS_SOURCE_COPY 2
+#define BPS_TARGET_COPY 3
+
+/* Match finder settings for patch creation */
+#define BPS_HASH_BITS 20
+#define BPS_CHAIN_DEPTH 32
+#define BPS_MIN_MATCH 4
+#define BPS_GOOD_READ 256
+#define BPS_SKIP_SHIFT 5
+
+struct bpsHeader {
+  unsigned long sourceSize;
+  unsigned long targetSize;
+  unsigned long metadataSize;
+  size_t start;
+  size_t end;
+  unsigned int sourceChecksum;
+  unsigned int targetChecksum;
+  unsigned int patchChecksum;
+};
+
+int BPSReadHeader(const unsigned char *patch, size_t patchSize,
+                  struct bpsHeader *header);
+int BPSApplyBuffer(const unsigned char *patch, const struct bpsHeader *header,
+                   const unsigned char *source, unsigned char *target);
+int BPSPatchFile(struct pStruct *params);
+int BPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check);
+int BPSCreateBuffer(const unsigned char *source, size_t sourceSize,
+                    const unsigned char *target, size_t targetSize,
+                    struct crcStream *out);
+int BPSCreatePatch(struct pStruct *params);
@@ -0,0 +1,593 @@
+/* Content-addressed patch cache */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "SHA.h"
+#include "MAP.h"
+#include "CACHE.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+/* An entry held in memory, most recently used first */
+struct cacheEntry {
+  struct cacheKey key;
+  unsigned char *data;
+  size_t size;
+  struct cacheEntry *next;
+};
+
+/* A file in the cache directory, for trimming it */
+struct cacheFile {
+  char name[CACHE_NAME];
+  size_t size;
+  time_t used;
+};
+
+static struct {
+  const char *directory;
+  size_t diskLimit;
+  size_t memoryLimit;
+  size_t memoryUsed;
+  unsigned long written;
+  struct cacheEntry *entries;
+  pthread_mutex_t lock;
+} cache = {NULL, CACHE_DISK_LIMIT, CACHE_MEMORY_LIMIT, 0, 0, NULL,
+           PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Turns on the cache, keeping its entries in a directory. (Which is
+ * made if it doesn't exist yet)
+ *
+ * @param const char *directory The cache directory, which has to
+ * outlive the cache.
+ *
+ * @return int 1 on success, 0 if the directory can't be used.
+ */
+int cacheOpen(const char *directory) {
+  struct stat info;
+
+  mkdir(directory, 0755);
+  if(stat(directory, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't use %s as a cache directory.",
+                     directory);
+  }
+
+  cache.directory = directory;
+  return 1;
+}
+
+/**
+ * Sets how much the cache can hold on disk and in memory. Past that,
+ * the least recently used entries are dropped.
+ *
+ * @param size_t disk The most the cache directory can hold, in bytes.
+ * @param size_t memory The most kept in memory, in bytes. (0 to keep
+ * nothing in memory)
+ */
+void cacheLimits(size_t disk, size_t memory) {
+  cache.diskLimit = disk;
+  cache.memoryLimit = memory;
+}
+
+/**
+ * @return int Nonzero if the cache has been turned on with cacheOpen.
+ */
+int cacheEnabled(void) {
+  return cache.directory != NULL;
+}
+
+/**
+ * Files an entry under the contents of a patch.
+ *
+ * @param struct cacheKey *key The key to fill in. (With no ROM)
+ * @param int kind What the entry holds. (CACHE_INDEX or CACHE_OUTPUT)
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
+ */
+void cacheKeyPatch(struct cacheKey *key, int kind,
+                   const unsigned char *patch, size_t patchSize) {
+  key->kind = kind;
+  key->patchSize = patchSize;
+  shaBuffer(patch, patchSize, key->patch);
+  key->romSize = 0;
+  memset(key->rom, 0, SHA_DIGEST);
+}
+
+/**
+ * Files an entry under the contents of a patch file, like
+ * cacheKeyPatch, but only hashes the patch the first time.
+ *
+ * The digest is kept in the cache directory, under the file's device
+ * and inode, with its size and when it was last modified and changed.
+ * Nothing can set the change time back, so a rewritten patch is always
+ * hashed again. A digest isn't kept if the file changed this second,
+ * since it could change again without its times moving.
+ *
+ * @param struct cacheKey *key The key to fill in. (With no ROM)
+ * @param int kind What the entry holds. (CACHE_INDEX or CACHE_OUTPUT)
+ * @param FILE *file The patch file, or NULL if there isn't one.
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
+ */
+void cacheKeyFile(struct cacheKey *key, int kind, FILE *file,
+                  const unsigned char *patch, size_t patchSize) {
+  unsigned char sum[CACHE_SUM], stamp[24];
+  char *path, *temporary;
+  unsigned long written;
+  struct stat info;
+  FILE *saved;
+
+  /* Without an inode, (Like on Windows) files can't be told apart */
+  if(!cache.directory || !file || fstat(fileno(file), &info) != 0 ||
+     info.st_ino == 0 || (size_t)info.st_size != patchSize ||
+     !(path = (char*)malloc(strlen(cache.directory) + CACHE_NAME + 2))) {
+    cacheKeyPatch(key, kind, patch, patchSize);
+    return;
+  }
+
+  sprintf(path, "%s/%llx-%llx.sum", cache.directory,
+          (unsigned long long)info.st_dev, (unsigned long long)info.st_ino);
+  UINT_TO_BYTE4_LE(stamp, (unsigned int)patchSize);
+  UINT_TO_BYTE4_LE(stamp + 4, (unsigned int)(patchSize >> 16 >> 16));
+  UINT_TO_BYTE4_LE(stamp + 8, (unsigned int)info.st_mtime);
+  UINT_TO_BYTE4_LE(stamp + 12,
+                   (unsigned int)((unsigned long long)info.st_mtime >> 32));
+  UINT_TO_BYTE4_LE(stamp + 16, (unsigned int)info.st_ctime);
+  UINT_TO_BYTE4_LE(stamp + 20,
+                   (unsigned int)((unsigned long long)info.st_ctime >> 32));
+
+  if((saved = fopen(path, "rb"))) {
+    int found = fread(sum, BYTE, CACHE_SUM, saved) == CACHE_SUM &&
+                memcmp(sum, CACHE_SUM_MAGIC, 8) == 0 &&
+                memcmp(sum + 8, stamp, sizeof(stamp)) == 0;
+
+    fclose(saved);
+    if(found) {
+      key->kind = kind;
+      key->patchSize = patchSize;
+      memcpy(key->patch, sum + 32, SHA_DIGEST);
+      key->romSize = 0;
+      memset(key->rom, 0, SHA_DIGEST);
+      free(path);
+      return;
+    }
+  }
+
+  cacheKeyPatch(key, kind, patch, patchSize);
+  if(info.st_ctime >= time(NULL) || info.st_mtime >= time(NULL) ||
+     !(temporary = (char*)malloc(strlen(path) + 48))) {
+    free(path);
+    return;
+  }
+
+  /* Written aside and renamed into place, like entries (See cachePut) */
+  pthread_mutex_lock(&cache.lock);
+  written = cache.written++;
+  pthread_mutex_unlock(&cache.lock);
+  sprintf(temporary, "%s.%lu.%lu.tmp", path, (unsigned long)getpid(),
+          written);
+  memcpy(sum, CACHE_SUM_MAGIC, 8);
+  memcpy(sum + 8, stamp, sizeof(stamp));
+  memcpy(sum + 32, key->patch, SHA_DIGEST);
+  if((saved = fopen(temporary, "wb"))) {
+    int result = fwrite(sum, BYTE, CACHE_SUM, saved) == CACHE_SUM;
+
+    result = fclose(saved) == 0 && result;
+#ifdef _WIN32
+    remove(path);
+#endif
+    if(!result || rename(temporary, path) != 0) {
+      remove(temporary);
+    }
+  }
+
+  free(temporary);
+  free(path);
+}
+
+static int cacheSame(const struct cacheKey *a, const struct cacheKey *b) {
+  return a->kind == b->kind && a->patchSize == b->patchSize &&
+         memcmp(a->patch, b->patch, SHA_DIGEST) == 0 &&
+         a->romSize == b->romSize &&
+         memcmp(a->rom, b->rom, SHA_DIGEST) == 0;
+}
+
+/**
+ * Works out the path of an entry in the cache directory.
+ *
+ * @return char* The path, (Free it when done) or NULL if we ran out
+ * of memory.
+ */
+static char *cachePath(const struct cacheKey *key) {
+  char *path = (char*)malloc(strlen(cache.directory) + CACHE_NAME + 2);
+  char patch[SHA_HEX + 1], rom[SHA_HEX + 1];
+
+  if(!path) {
+    return NULL;
+  }
+
+  shaHex(key->patch, patch);
+  if(key->kind == CACHE_INDEX) {
+    sprintf(path, "%s/%s.idx", cache.directory, patch);
+  } else {
+    shaHex(key->rom, rom);
+    sprintf(path, "%s/%s-%s.out", cache.directory, patch, rom);
+  }
+
+  return path;
+}
+
+/**
+ * Finds an entry held in memory, and moves it to the front. The lock
+ * must be held.
+ */
+static struct cacheEntry *cacheFind(const struct cacheKey *key) {
+  struct cacheEntry **link, *entry;
+
+  for(link = &cache.entries; (entry = *link); link = &entry->next) {
+    if(cacheSame(&entry->key, key)) {
+      *link = entry->next;
+      entry->next = cache.entries;
+      cache.entries = entry;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Holds a copy of an entry in memory, dropping the least recently
+ * used entries to make room. The lock must be held.
+ */
+static void cacheKeep(const struct cacheKey *key, const unsigned char *data,
+                      size_t size) {
+  struct cacheEntry *entry, **link;
+
+  if(size > cache.memoryLimit || cacheFind(key) ||
+     !(entry = (struct cacheEntry*)malloc(sizeof(struct cacheEntry)))) {
+    return;
+  }
+
+  if(!(entry->data = (unsigned char*)malloc(size ? size : 1))) {
+    free(entry);
+    return;
+  }
+
+  while(cache.entries && cache.memoryUsed + size > cache.memoryLimit) {
+    for(link = &cache.entries; (*link)->next; link = &(*link)->next);
+    cache.memoryUsed -= (*link)->size;
+    free((*link)->data);
+    free(*link);
+    *link = NULL;
+  }
+
+  memcpy(entry->data, data, size);
+  entry->key = *key;
+  entry->size = size;
+  entry->next = cache.entries;
+  cache.entries = entry;
+  cache.memoryUsed += size;
+}
+
+/**
+ * Looks an entry up, in memory first, and then on disk.
+ *
+ * Entries on disk are checked against their key and CRC before
+ * they're used, and are marked as used so they're the last to be
+ * trimmed.
+ *
+ * @param const struct cacheKey *key What to look up.
+ * @param unsigned char **data Where to store a copy of the entry.
+ * (Free it when done)
+ * @param size_t *size Where to store the size of the entry.
+ *
+ * @return int 1 if the entry was found, 0 otherwise.
+ */
+int cacheGet(const struct cacheKey *key, unsigned char **data, size_t *size) {
+  unsigned char header[CACHE_HEADER];
+  struct cacheEntry *entry;
+  struct cacheKey stored;
+  char *path;
+  FILE *file;
+
+  if(!cache.directory) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&cache.lock);
+  if((entry = cacheFind(key)) &&
+     (*data = (unsigned char*)malloc(entry->size ? entry->size : 1))) {
+    memcpy(*data, entry->data, entry->size);
+    *size = entry->size;
+    pthread_mutex_unlock(&cache.lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  if(!(path = cachePath(key))) {
+    return 0;
+  }
+
+  if(!(file = fopen(path, "rb"))) {
+    free(path);
+    return 0;
+  }
+
+  *data = NULL;
+  if(fread(header, BYTE, CACHE_HEADER, file) == CACHE_HEADER &&
+     memcmp(header, CACHE_MAGIC, 8) == 0) {
+    stored.kind = (int)BYTE4_TO_UINT_LE(header + 8);
+    stored.patchSize = (size_t)BYTE4_TO_UINT_LE(header + 16) << 16 << 16 |
+                       BYTE4_TO_UINT_LE(header + 12);
+    memcpy(stored.patch, header + 20, SHA_DIGEST);
+    stored.romSize = (size_t)BYTE4_TO_UINT_LE(header + 56) << 16 << 16 |
+                     BYTE4_TO_UINT_LE(header + 52);
+    memcpy(stored.rom, header + 60, SHA_DIGEST);
+    *size = (size_t)BYTE4_TO_UINT_LE(header + 100) << 16 << 16 |
+            BYTE4_TO_UINT_LE(header + 96);
+
+    if(cacheSame(&stored, key) &&
+       (*data = (unsigned char*)malloc(*size ? *size : 1)) &&
+       (fread(*data, BYTE, *size, file) != *size ||
+        crcBuffer(0, *data, *size) != BYTE4_TO_UINT_LE(header + 92))) {
+      free(*data);
+      *data = NULL;
+    }
+  }
+  fclose(file);
+
+  if(!*data) {
+    free(path);
+    return 0;
+  }
+
+  utime(path, NULL);
+  free(path);
+
+  pthread_mutex_lock(&cache.lock);
+  cacheKeep(key, *data, *size);
+  pthread_mutex_unlock(&cache.lock);
+  return 1;
+}
+
+static int cacheOlder(const void *a, const void *b) {
+  const struct cacheFile *left = (const struct cacheFile*)a;
+  const struct cacheFile *right = (const struct cacheFile*)b;
+
+  return left->used < right->used ? -1 : left->used > right->used;
+}
+
+/**
+ * Drops the least recently used entries from the cache directory
+ * until it fits in its limit.
+ */
+static void cacheTrim(void) {
+  struct cacheFile *files = NULL, *grown;
+  size_t count = 0, capacity = 0, total = 0, i;
+  char *path;
+  struct dirent *item;
+  struct stat info;
+  DIR *directory;
+
+  if(!(directory = opendir(cache.directory)) ||
+     !(path = (char*)malloc(strlen(cache.directory) + CACHE_NAME + 2))) {
+    if(directory) {
+      closedir(directory);
+    }
+    return;
+  }
+
+  while((item = readdir(directory))) {
+    size_t length = strlen(item->d_name);
+
+    if(length < 5 || length >= CACHE_NAME ||
+       (strcmp(item->d_name + length - 4, ".idx") != 0 &&
+        strcmp(item->d_name + length - 4, ".out") != 0 &&
+        strcmp(item->d_name + length - 4, ".sum") != 0)) {
+      continue;
+    }
+
+    sprintf(path, "%s/%s", cache.directory, item->d_name);
+    if(stat(path, &info) != 0) {
+      continue;
+    }
+
+    if(count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      if(!(grown = (struct cacheFile*)realloc(files, capacity *
+                                              sizeof(struct cacheFile)))) {
+        break;
+      }
+      files = grown;
+    }
+
+    strcpy(files[count].name, item->d_name);
+    files[count].size = (size_t)info.st_size;
+    files[count].used = info.st_mtime;
+    total += files[count++].size;
+  }
+  closedir(directory);
+
+  if(total > cache.diskLimit) {
+    qsort(files, count, sizeof(struct cacheFile), cacheOlder);
+    for(i = 0; i < count && total > cache.diskLimit; i++) {
+      sprintf(path, "%s/%s", cache.directory, files[i].name);
+      if(remove(path) == 0) {
+        total -= files[i].size;
+      }
+    }
+  }
+
+  free(files);
+  free(path);
+}
+
+/**
+ * Adds an entry to the cache, in memory and on disk.
+ *
+ * The entry is written to a file of its own first, and then renamed
+ * into place, so other processes sharing the directory never see half
+ * an entry. The directory is then trimmed to its limit.
+ *
+ * @param const struct cacheKey *key What to file the entry under.
+ * @param const unsigned char *data The entry.
+ * @param size_t size The size of the entry in bytes.
+ *
+ * @return int 1 if the entry made it to disk, 0 otherwise.
+ */
+int cachePut(const struct cacheKey *key, const unsigned char *data,
+             size_t size) {
+  unsigned char header[CACHE_HEADER];
+  char *path, *temporary;
+  unsigned long written;
+  FILE *file;
+  int result;
+
+  if(!cache.directory) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&cache.lock);
+  cacheKeep(key, data, size);
+  written = cache.written++;
+  pthread_mutex_unlock(&cache.lock);
+
+  if(size + CACHE_HEADER > cache.diskLimit || !(path = cachePath(key))) {
+    return 0;
+  }
+
+  if(!(temporary = (char*)malloc(strlen(path) + 48))) {
+    free(path);
+    return 0;
+  }
+  sprintf(temporary, "%s.%lu.%lu.tmp", path, (unsigned long)getpid(),
+          written);
+
+  memcpy(header, CACHE_MAGIC, 8);
+  UINT_TO_BYTE4_LE(header + 8, (unsigned int)key->kind);
+  UINT_TO_BYTE4_LE(header + 12, (unsigned int)key->patchSize);
+  UINT_TO_BYTE4_LE(header + 16, (unsigned int)(key->patchSize >> 16 >> 16));
+  memcpy(header + 20, key->patch, SHA_DIGEST);
+  UINT_TO_BYTE4_LE(header + 52, (unsigned int)key->romSize);
+  UINT_TO_BYTE4_LE(header + 56, (unsigned int)(key->romSize >> 16 >> 16));
+  memcpy(header + 60, key->rom, SHA_DIGEST);
+  UINT_TO_BYTE4_LE(header + 92, crcBuffer(0, data, size));
+  UINT_TO_BYTE4_LE(header + 96, (unsigned int)size);
+  UINT_TO_BYTE4_LE(header + 100, (unsigned int)(size >> 16 >> 16));
+
+  result = (file = fopen(temporary, "wb")) != NULL;
+  if(file) {
+    result = fwrite(header, BYTE, CACHE_HEADER, file) == CACHE_HEADER &&
+             fwrite(data, BYTE, size, file) == size;
+    result = fclose(file) == 0 && result;
+  }
+
+#ifdef _WIN32
+  remove(path); /* rename won't replace a file here */
+#endif
+  if(!result || rename(temporary, path) != 0) {
+    remove(temporary);
+    result = 0;
+  }
+
+  free(temporary);
+  free(path);
+  cacheTrim();
+  return result;
+}
+
+/**
+ * Patches a file, through the cache of patched files if
+ * --cache-results is on.
+ *
+ * The file to patch is filed under its own SHA-256 and the patch's. If
+ * the same patch has already been applied to a file just like it,
+ * the result is written straight over it (Only the bytes that differ;
+ * see mapUpdate) and the patch is never applied at all. Otherwise,
+ * the patch is applied as usual, and the result kept for next time.
+ *
+ * Checks, new patches, and anything that can't be mapped (Like
+ * streamed patches) just go to the patch function.
+ *
+ * @param struct pStruct *params The parameter struct, with the patch,
+ * the file to patch and the patch function.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int cachePatch(struct pStruct *params) {
+  struct mappedFile patch, rom;
+  struct cacheKey key;
+  unsigned char *data;
+  size_t size;
+  int result;
+
+  if(!cache.directory || !(params->flags & ARG_CACHE_RESULTS) ||
+     (params->flags & (ARG_CREATE | ARG_VERIFY | ARG_HEADER)) ||
+     params->stream ||
+     !mapFile(&patch, params->patchFile, 0)) {
+    return params->patchFunction(params);
+  }
+
+  cacheKeyFile(&key, CACHE_OUTPUT, params->patchFile, patch.data, patch.size);
+  unmapFile(&patch);
+
+  if(!mapFile(&rom, params->romFile, MAPPED_WRITE)) {
+    return params->patchFunction(params);
+  }
+
+  key.romSize = rom.size;
+  shaBuffer(rom.data, rom.size, key.rom);
+  if(cacheGet(&key, &data, &size)) {
+    if(params->flags & ARG_VERBOSE) {
+      printf("Using the cached result of this patch.\n");
+    }
+
+    if((result = mapResize(&rom, size))) {
+      mapUpdate(&rom, data);
+    }
+    free(data);
+    result = unmapFile(&rom) && result;
+    return result || AIPSError(ERR_MEDIUM, "Couldn't write the cached"
+                               " result to the file.");
+  }
+  unmapFile(&rom);
+
+  if(!params->patchFunction(params)) {
+    return 0;
+  }
+
+  if(mapFile(&rom, params->romFile, 0)) {
+    if(!cachePut(&key, rom.data, rom.size)) {
+      AIPSError(ERR_MINOR, "Couldn't save the patched file to the cache.");
+    }
+    unmapFile(&rom);
+  }
+
+  return 1;
+}
+
+/**
+ * Frees every entry held in memory.
+ */
+void cacheClose(void) {
+  struct cacheEntry *entry;
+
+  pthread_mutex_lock(&cache.lock);
+  while((entry = cache.entries)) {
+    cache.entries = entry->next;
+    free(entry->data);
+    free(entry);
+  }
+  cache.memoryUsed = 0;
+  pthread_mutex_unlock(&cache.lock);
+}
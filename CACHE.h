@@ -0,0 +1,43 @@
+/* Default bounds on the patch cache, in bytes */
+#define CACHE_DISK_LIMIT ((size_t)1 << 30)
+#define CACHE_MEMORY_LIMIT ((size_t)64 << 20)
+
+/* Cache entry files */
+#define CACHE_MAGIC "AIPSCCH2"
+#define CACHE_HEADER 104
+#define CACHE_NAME 160
+
+/* Files remembering the digest of a patch file */
+#define CACHE_SUM_MAGIC "AIPSSUM1"
+#define CACHE_SUM 64
+
+/* What an entry holds */
+#define CACHE_INDEX 1
+#define CACHE_OUTPUT 2
+
+/*
+ * What an entry is filed under: the SHA-256 of the patch, and for a
+ * patched file, the SHA-256 of the file it was patched from. (A CRC
+ * would be easy to forge, and a forged patch could then fill the
+ * cache with results that every user of the real patch gets back)
+ */
+struct cacheKey {
+  int kind;
+  size_t patchSize;
+  unsigned char patch[SHA_DIGEST];
+  size_t romSize;
+  unsigned char rom[SHA_DIGEST];
+};
+
+int cacheOpen(const char *directory);
+void cacheLimits(size_t disk, size_t memory);
+int cacheEnabled(void);
+void cacheKeyPatch(struct cacheKey *key, int kind,
+                   const unsigned char *patch, size_t patchSize);
+void cacheKeyFile(struct cacheKey *key, int kind, FILE *file,
+                  const unsigned char *patch, size_t patchSize);
+int cacheGet(const struct cacheKey *key, unsigned char **data, size_t *size);
+int cachePut(const struct cacheKey *key, const unsigned char *data,
+             size_t size);
+int cachePatch(struct pStruct *params);
+void cacheClose(void);
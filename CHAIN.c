@@ -0,0 +1,313 @@
+/* Patch chaining functions */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "IPS.h"
+#include "UPS.h"
+#include "BPS.h"
+#include "MAP.h"
+#include "DECODE.h"
+#include "STREAM.h"
+#include "STATS.h"
+#include "CHAIN.h"
+
+/**
+ * Adds a patch to the end of the chain.
+ *
+ * @param pStruct *params The parameter struct holding the chain.
+ * @param FILE *patch The patch to add.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int chainAdd(struct pStruct *params, FILE *patch) {
+  FILE **chain = (FILE**)realloc(params->patchChain, (params->chainLength + 1) *
+                                 sizeof(FILE*));
+
+  if(!chain) {
+    fclose(patch);
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  chain[params->chainLength++] = patch;
+  params->patchChain = chain;
+  return 1;
+}
+
+/**
+ * Closes every patch in the chain.
+ *
+ * @param pStruct *params The parameter struct holding the chain.
+ */
+void chainClose(struct pStruct *params) {
+  int i;
+
+  for(i = 0; i < params->chainLength; i++) {
+    fclose(params->patchChain[i]);
+  }
+
+  free(params->patchChain);
+  params->patchChain = NULL;
+  params->chainLength = 0;
+}
+
+/**
+ * Grows (Or shrinks) the image to a new size.
+ *
+ * Any bytes past the old end of the image read as zero, the same as
+ * when a file is grown with mapResize. Room is kept from step to
+ * step, so most patches never have to reallocate.
+ *
+ * @param struct chainImage *image The image to resize.
+ * @param size_t size The new size of the image.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int chainReserve(struct chainImage *image, size_t size) {
+  if(size > image->capacity) {
+    size_t capacity = image->capacity ? image->capacity : 1;
+    unsigned char *data;
+
+    while(capacity < size) {
+      capacity = capacity * 2 > capacity ? capacity * 2 : size;
+    }
+
+    if(!(data = (unsigned char*)realloc(image->data, capacity))) {
+      return 0;
+    }
+
+    image->data = data;
+    image->capacity = capacity;
+  }
+
+  if(size > image->size) {
+    memset(image->data + image->size, 0, size - image->size);
+  }
+
+  image->size = size;
+  return 1;
+}
+
+/**
+ * Applies an IPS patch to the image.
+ */
+static int chainIPS(struct chainImage *image, const unsigned char *patch,
+                    size_t patchSize, struct pStruct *params) {
+  struct ipsIndex index;
+  int result;
+
+  if(!IPSIndexBuild(patch, patchSize, &index)) {
+    return 0;
+  }
+
+  if(!chainReserve(image, index.size > image->size ? index.size :
+                   image->size)) {
+    IPSIndexFree(&index);
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  result = IPSIndexApply(&index, patch, patchSize, image->data, image->size,
+                         params->flags & ARG_VERYVERBOSE);
+  STATS_ADD(records, index.count);
+
+  /* Cutting the image down (Or padding it out) to a truncation size */
+  if(result && index.truncated && !chainReserve(image, index.truncate)) {
+    result = AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  IPSIndexFree(&index);
+  return result;
+}
+
+/**
+ * Applies a UPS patch to the image, checking its CRCs against the
+ * image before and after.
+ */
+static int chainUPS(struct chainImage *image, const unsigned char *patch,
+                    size_t patchSize, struct pStruct *params) {
+  struct upsHeader header;
+  struct upsChecksums actual;
+  size_t sourceSize = image->size, targetSize;
+
+  if(!UPSReadHeader(patch, patchSize, &header)) {
+    return AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  }
+
+  if(sourceSize == header.inputSize) {
+    targetSize = header.outputSize;
+  } else if(sourceSize == header.outputSize) {
+    targetSize = header.inputSize;
+  } else {
+    return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  }
+
+  if(!chainReserve(image, sourceSize > targetSize ? sourceSize : targetSize)) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  if(!UPSApplyBuffer(patch, &header, image->data, sourceSize, targetSize,
+                     &actual)) {
+    return AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  }
+
+  if(!UPSVerifyCRC(params, &header, &actual, sourceSize)) {
+    return 0;
+  }
+
+  image->size = targetSize;
+  return 1;
+}
+
+/**
+ * Applies a BPS patch to the image.
+ *
+ * BPS reads from the old image while it writes the new one, so the
+ * new one is built in the spare buffer and the two are swapped.
+ */
+static int chainBPS(struct chainImage *image, const unsigned char *patch,
+                    size_t patchSize, struct pStruct *params) {
+  struct bpsHeader header;
+  unsigned char *swap;
+  size_t swapCapacity;
+
+  if(!BPSReadHeader(patch, patchSize, &header)) {
+    return AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  }
+
+  if(params->flags & ARG_VERBOSE){
+    printf("The BPS patch says:\n"
+           "Input Filesize: %lu bytes\nOutput Filesize: %lu bytes\n"
+           "...And the actual filesize is: %lu bytes\n",
+           header.sourceSize, header.targetSize, (unsigned long)image->size);
+  }
+
+  if(image->size != header.sourceSize) {
+    return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  } else if(crcBuffer(0, patch, patchSize - 4) != header.patchChecksum) {
+    return AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
+  } else if(crcBuffer(0, image->data, image->size) != header.sourceChecksum) {
+    return AIPSError(ERR_MEDIUM, "You may have an invalid file."
+                     " (Or this patch isn't for this file.)");
+  }
+
+  if(header.targetSize > image->spareCapacity) {
+    free(image->spare);
+    image->spareCapacity = 0;
+    if(!(image->spare = (unsigned char*)malloc(header.targetSize))) {
+      return AIPSError(ERR_MEDIUM, "Out of memory!");
+    }
+    image->spareCapacity = header.targetSize;
+  }
+
+  if(!BPSApplyBuffer(patch, &header, image->data, image->spare)) {
+    return AIPSError(ERR_MEDIUM, "This BPS patch seems to be damaged.");
+  } else if(crcBuffer(0, image->spare, header.targetSize) !=
+            header.targetChecksum) {
+    return AIPSError(ERR_MEDIUM, "The patched file didn't come out right!");
+  }
+
+  swap = image->data;
+  swapCapacity = image->capacity;
+  image->data = image->spare;
+  image->capacity = image->spareCapacity;
+  image->size = header.targetSize;
+  image->spare = swap;
+  image->spareCapacity = swapCapacity;
+  return 1;
+}
+
+/**
+ * Applies one patch in memory to the image, working out what kind of
+ * patch it is from its header.
+ *
+ * @param struct chainImage *image The image to patch.
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param pStruct *params The parameter struct, for the flags.
+ *
+ * @return int 1 on success, 0 otherwise. (The image may be left
+ * half-patched on failure.)
+ */
+int chainStep(struct chainImage *image, const unsigned char *patch,
+              size_t patchSize, struct pStruct *params) {
+  if(IPSOffsetSize(patch, patchSize)) {
+    return chainIPS(image, patch, patchSize, params);
+  } else if(patchSize >= 4 && memcmp(patch, "UPS1", 4) == 0) {
+    return chainUPS(image, patch, patchSize, params);
+  } else if(patchSize >= 4 && memcmp(patch, "BPS1", 4) == 0) {
+    return chainBPS(image, patch, patchSize, params);
+  }
+
+  return AIPSError(ERR_MEDIUM, "This doesn't look like a patch.");
+}
+
+/**
+ * Applies every patch in the chain, in order, to the ROM.
+ *
+ * The ROM is read into memory once, each patch is applied to that
+ * copy, and the ROM is only written once the whole chain has gone
+ * through. If any step fails, the ROM is left alone.
+ *
+ * @param pStruct *params The parameter struct, with the ROM, the
+ * chain of patches, and the flags.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int chainRun(struct pStruct *params) {
+  struct chainImage image = {NULL, 0, 0, NULL, 0};
+  struct mappedFile rom;
+  unsigned long long start;
+  int i, result = 1;
+
+  if(!mapFile(&rom, params->romFile, MAPPED_WRITE)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't open the file to patch.");
+  }
+
+  if(!chainReserve(&image, rom.size)) {
+    unmapFile(&rom);
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  if(rom.size) {
+    memcpy(image.data, rom.data, rom.size);
+  }
+
+  for(i = 0; result && i < params->chainLength; i++) {
+    struct mappedFile patch;
+
+    if(decodeType(params->patchChain[i]) != DECODE_NONE ?
+       !streamUnpack(&patch, params->patchChain[i]) :
+       !mapFile(&patch, params->patchChain[i], 0)) {
+      result = AIPSError(ERR_MEDIUM, "Couldn't read patch %d.", i + 1);
+      break;
+    }
+
+    if(params->flags & ARG_VERBOSE) {
+      printf("Applying patch %d of %d...\n", i + 1, params->chainLength);
+    }
+
+    start = statsClock();
+    result = chainStep(&image, patch.data, patch.size, params);
+    statsPhase(STATS_APPLY, start);
+    if(!result) {
+      result = AIPSError(ERR_MEDIUM, "Patch %d of the chain failed, so the"
+                         " file was left alone.", i + 1);
+    }
+
+    unmapFile(&patch);
+  }
+
+  if(result) {
+    if(!mapResize(&rom, image.size)) {
+      result = AIPSError(ERR_MEDIUM, "Couldn't resize the file to patch.");
+    } else {
+      mapUpdate(&rom, image.data);
+    }
+  }
+
+  free(image.data);
+  free(image.spare);
+  start = statsClock();
+  result = unmapFile(&rom) && result;
+  statsPhase(STATS_FLUSH, start);
+  return result;
+}
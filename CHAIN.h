@@ -0,0 +1,15 @@
+/* The image that patches in a chain are applied to */
+struct chainImage {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  unsigned char *spare;
+  size_t spareCapacity;
+};
+
+int chainAdd(struct pStruct *params, FILE *patch);
+void chainClose(struct pStruct *params);
+int chainReserve(struct chainImage *image, size_t size);
+int chainStep(struct chainImage *image, const unsigned char *patch,
+              size_t patchSize, struct pStruct *params);
+int chainRun(struct pStruct *params);
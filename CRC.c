@@ -1,4 +1,33 @@
 #include "AIPS.h"
+#include "CRC.h"
+#include "MAP.h"
+#include "STATS.h"
+#include "CRCTABLE.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC_PCLMUL
+#include <immintrin.h>
+#endif
+
+/* Read block size for files we can't map */
+#define CRC_BLOCK (1 << 20)
+
+/* Buffers smaller than this aren't worth timing */
+#define CRC_TIMED (1 << 16)
+
+/* Threads for big buffers; 0 for one per core */
+static int crcThreadCount = 0;
+
+/*
+ * A piece of a buffer being checksummed on its own thread.
+ */
+struct crcSlice {
+  const unsigned char *buffer;
+  size_t length;
+  unsigned int crc;
+};
 
 /*
  * Will create a CRC check table from the polynomial passed in as a
@@ -26,33 +55,504 @@ void crcTable(unsigned int *table, unsigned int polynomial){
 }
 
 /*
- * Will generate a CRC value for a file up until the current read
+ * Portable slicing-by-8 kernel. Works on the raw (Non-inverted) CRC
+ * register, eight bytes per step with one lookup in each table.
+ * @param unsigned int crc The running CRC register.
+ * @param const unsigned char *buffer The data to run through.
+ * @param size_t length How many bytes of data there are.
+ * @returns unsigned int The updated CRC register.
+ */
+static unsigned int crcSlice8(unsigned int crc, const unsigned char *buffer,
+                              size_t length){
+  while(length && ((size_t)buffer & 7)){
+    crc = (crc >> 8) ^ crcTables[0][(crc ^ *buffer++) & 0xFF];
+    length--;
+  }
+
+  while(length >= 8){
+    unsigned int one = crc ^ ((unsigned int)buffer[0] |
+                              (unsigned int)buffer[1] << 8 |
+                              (unsigned int)buffer[2] << 16 |
+                              (unsigned int)buffer[3] << 24);
+    unsigned int two = ((unsigned int)buffer[4] |
+                        (unsigned int)buffer[5] << 8 |
+                        (unsigned int)buffer[6] << 16 |
+                        (unsigned int)buffer[7] << 24);
+
+    crc = crcTables[7][one & 0xFF] ^
+          crcTables[6][(one >> 8) & 0xFF] ^
+          crcTables[5][(one >> 16) & 0xFF] ^
+          crcTables[4][one >> 24] ^
+          crcTables[3][two & 0xFF] ^
+          crcTables[2][(two >> 8) & 0xFF] ^
+          crcTables[1][(two >> 16) & 0xFF] ^
+          crcTables[0][two >> 24];
+
+    buffer += 8;
+    length -= 8;
+  }
+
+  while(length--)
+    crc = (crc >> 8) ^ crcTables[0][(crc ^ *buffer++) & 0xFF];
+
+  return crc;
+}
+
+#ifdef CRC_PCLMUL
+/*
+ * Carry-less multiply kernel, folding four 128-bit lanes at a time
+ * as described in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction", with the bit-reflected
+ * constants for 0xedb88320.
+ * @param unsigned int crc The running CRC register.
+ * @param const unsigned char *buffer The data to run through.
+ * @param size_t length How many bytes there are. Must be at least 64
+ * and a multiple of 16.
+ * @returns unsigned int The updated CRC register.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int crcPclmul(unsigned int crc, const unsigned char *buffer,
+                              size_t length){
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buffer + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(buffer + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(buffer + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(buffer + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  buffer += 64;
+  length -= 64;
+
+  /* Fold 512 bits at a time */
+  while(length >= 64){
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)(buffer + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i*)(buffer + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i*)(buffer + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i*)(buffer + 0x30)));
+
+    buffer += 64;
+    length -= 64;
+  }
+
+  /* Fold the four lanes down into one */
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /* Then whatever 128-bit blocks are left */
+  while(length >= 16){
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)buffer));
+    buffer += 16;
+    length -= 16;
+  }
+
+  /* 128 bits down to 64 */
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, low32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+  /* And a Barrett reduction down to the final 32 */
+  x2 = _mm_and_si128(x1, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+
+/*
+ * Runs a buffer through the PCLMUL kernel, passing the odd head and
+ * tail bytes that don't fill a 128-bit block to crcSlice8.
+ */
+static unsigned int crcFolded(unsigned int crc, const unsigned char *buffer,
+                              size_t length){
+  if(length >= 64){
+    size_t folded = length & ~(size_t)15;
+
+    crc = crcPclmul(crc, buffer, folded);
+    buffer += folded;
+    length -= folded;
+  }
+
+  return crcSlice8(crc, buffer, length);
+}
+#endif
+
+/*
+ * Picks the fastest kernel this CPU can run. The choice is made on
+ * the first call and kept from then on.
+ */
+static unsigned int crcDispatch(unsigned int crc, const unsigned char *buffer,
+                                size_t length);
+
+static unsigned int (*crcKernel)(unsigned int crc, const unsigned char *buffer,
+                                 size_t length) = crcDispatch;
+
+static unsigned int crcDispatch(unsigned int crc, const unsigned char *buffer,
+                                size_t length){
+  crcKernel = crcSlice8;
+
+#ifdef CRC_PCLMUL
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    crcKernel = crcFolded;
+#endif
+
+  return crcKernel(crc, buffer, length);
+}
+
+/*
+ * Multiplies a vector by a 32x32 matrix over GF(2).
+ * @param const unsigned int *matrix The matrix, one column per entry.
+ * @param unsigned int vector The vector to multiply.
+ * @returns unsigned int The product.
+ */
+static unsigned int crcMatrixTimes(const unsigned int *matrix,
+                                   unsigned int vector){
+  unsigned int sum = 0;
+
+  while(vector){
+    if(vector & 1)
+      sum ^= *matrix;
+    vector >>= 1;
+    matrix++;
+  }
+
+  return sum;
+}
+
+/*
+ * Squares a 32x32 matrix over GF(2).
+ * @param unsigned int *square Where to put the result.
+ * @param const unsigned int *matrix The matrix to square.
+ */
+static void crcMatrixSquare(unsigned int *square, const unsigned int *matrix){
+  int i;
+
+  for(i = 0; i < 32; i++)
+    square[i] = crcMatrixTimes(matrix, matrix[i]);
+}
+
+/*
+ * Will work out the CRC-32 of two pieces of data put together from
+ * the CRCs of each piece, just like zlib's crc32_combine(). The first
+ * CRC is run through length zero bytes by repeatedly squaring the
+ * operator for one zero bit, so this takes log(length) steps no
+ * matter how long the second piece is.
+ * @param unsigned int first The CRC of the first piece.
+ * @param unsigned int second The CRC of the second piece.
+ * @param size_t length The length of the second piece in bytes.
+ * @returns unsigned int The CRC of both pieces, one after the other.
+ */
+unsigned int crcCombine(unsigned int first, unsigned int second,
+                        size_t length){
+  unsigned int even[32], odd[32], row = 1;
+  int i;
+
+  if(length == 0)
+    return first;
+
+  /* The operator for one zero bit... */
+  odd[0] = 0xedb88320;
+  for(i = 1; i < 32; i++){
+    odd[i] = row;
+    row <<= 1;
+  }
+
+  /* ...squared up to one for a zero byte */
+  crcMatrixSquare(even, odd);
+  crcMatrixSquare(odd, even);
+
+  /* Then applied once for every bit set in the length */
+  do {
+    crcMatrixSquare(even, odd);
+    if(length & 1)
+      first = crcMatrixTimes(even, first);
+    length >>= 1;
+
+    if(!length)
+      break;
+
+    crcMatrixSquare(odd, even);
+    if(length & 1)
+      first = crcMatrixTimes(odd, first);
+    length >>= 1;
+  } while(length);
+
+  return first ^ second;
+}
+
+/*
+ * Sets how many threads big buffers are checksummed with.
+ * @param int threads The number of threads, 0 for one per core, or 1
+ * to always checksum on the calling thread.
+ * @returns int The previous setting.
+ */
+int crcThreads(int threads){
+  int previous = crcThreadCount;
+
+  crcThreadCount = threads;
+  return previous;
+}
+
+/*
+ * Works out how many threads to split a buffer across. Every thread
+ * gets at least CRC_SLICE bytes.
+ * @param size_t length The length of the buffer.
+ * @returns int The number of threads; 1 to not split it.
+ */
+static int crcThreadsFor(size_t length){
+  long threads = crcThreadCount;
+
+  if(length < CRC_PARALLEL || threads == 1)
+    return 1;
+
+  if(threads <= 0){
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(threads <= 0)
+      threads = 1;
+  }
+
+  if(threads > CRC_MAX_THREADS)
+    threads = CRC_MAX_THREADS;
+
+  if((size_t)threads > length / CRC_SLICE)
+    threads = (long)(length / CRC_SLICE);
+
+  return (int)threads;
+}
+
+/*
+ * Worker thread body. Checksums one slice.
+ */
+static void *crcWorker(void *argument){
+  struct crcSlice *slice = (struct crcSlice*)argument;
+
+  slice->crc = ~crcKernel(~slice->crc, slice->buffer, slice->length);
+  return NULL;
+}
+
+/*
+ * Checksums a buffer as several slices on their own threads, and puts
+ * the slices' CRCs together with crcCombine. The slices are only
+ * read, so a mapped file is paged in by all of the threads at once.
+ * @param unsigned int crc The CRC of everything before this buffer.
+ * @param const unsigned char *buffer The data to checksum.
+ * @param size_t length The length of the data in bytes.
+ * @param int threads How many slices to split it into.
+ * @returns unsigned int The CRC of all the data so far.
+ */
+static unsigned int crcParallel(unsigned int crc, const unsigned char *buffer,
+                                size_t length, int threads){
+  struct crcSlice slices[CRC_MAX_THREADS];
+  pthread_t workers[CRC_MAX_THREADS];
+  size_t size = length / threads;
+  int i, started;
+
+  /* Pick the kernel here, before the workers can race to. */
+  crcKernel(0, buffer, 0);
+
+  for(i = 0; i < threads; i++){
+    slices[i].buffer = buffer + i * size;
+    slices[i].length = i == threads - 1 ? length - i * size : size;
+    slices[i].crc = 0;
+  }
+  slices[0].crc = crc;
+
+  for(started = 1; started < threads; started++)
+    if(pthread_create(&workers[started], NULL, crcWorker,
+                      &slices[started]) != 0)
+      break;
+
+  /* Anything that didn't get a thread is done here. */
+  for(i = started; i < threads; i++)
+    crcWorker(&slices[i]);
+  crcWorker(&slices[0]);
+
+  for(i = 1; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  crc = slices[0].crc;
+  for(i = 1; i < threads; i++)
+    crc = crcCombine(crc, slices[i].crc, slices[i].length);
+
+  return crc;
+}
+
+/*
+ * Will continue a CRC-32 (0xedb88320, as used by UPS) over a buffer.
+ * Works just like zlib's crc32(): start with 0, and pass the previous
+ * result back in to carry on over the next piece of data. Big buffers
+ * are split across threads. (See crcThreads)
+ * @param unsigned int crc The CRC of everything before this buffer,
+ * or 0 to start a new one.
+ * @param const unsigned char *buffer The data to checksum.
+ * @param size_t length The length of the data in bytes.
+ * @returns unsigned int The CRC of all the data so far.
+ */
+unsigned int crcBuffer(unsigned int crc, const unsigned char *buffer,
+                       size_t length){
+  unsigned long long start;
+  int threads;
+
+  if(length < CRC_TIMED) {
+    return ~crcKernel(~crc, buffer, length);
+  }
+
+  start = statsClock();
+  threads = crcThreadsFor(length);
+  crc = threads > 1 ? crcParallel(crc, buffer, length, threads) :
+        ~crcKernel(~crc, buffer, length);
+  statsPhase(STATS_CRC, start);
+  return crc;
+}
+
+/*
+ * Will generate a CRC-32 value for a file up until the current read
  * position.
  * @param FILE *file The file to generate a CRC for... If the read
  * position of the file isn't at the beginning of the file, it will
  * read up to the point the pointer currently is at only, and generate
  * a CRC using only that.
- * unsigned int *crcTable A CRC table as generated by crcTable()
- * above. This will be used to create the CRC value; different table
- * means a diferent CRC result.
  * @returns unsigned int CRC check value; the result of the CRC.
  */
-unsigned int crcFile(FILE *file, unsigned int *crcTable){
-  unsigned int crc = 0xFFFFFFFF;
-  unsigned char buffer;
-  unsigned long i = 0L,
-                lastPosition = ftell(file);
+unsigned int crcFile(FILE *file){
+  struct mappedFile map;
+  unsigned int crc = 0;
+  unsigned long lastPosition = ftell(file);
+  int whole = lastPosition == 0;
 
-  if(lastPosition == 0){
+  if(whole){
     fseek(file, 0L, SEEK_END);
     lastPosition = ftell(file);
   }
 
-  rewind(file);
+  /* The whole file can be checksummed while it's read in */
+  if(mapFile(&map, file, whole ? MAPPED_CRC : 0)){
+    if(lastPosition > map.size)
+      lastPosition = map.size;
+
+    crc = whole && lastPosition == map.size ? map.crc :
+          crcBuffer(0, map.data, lastPosition);
+    unmapFile(&map);
+  } else {
+    unsigned char *buffer = (unsigned char*)malloc(CRC_BLOCK);
+    unsigned long i = 0L;
+    size_t read;
 
-  while(fread(&buffer, BYTE, 1, file) && lastPosition > i++)
-    crc = (crc >> 8) ^ crcTable[buffer ^ ((crc) & 0x000000FF)];
+    rewind(file);
+    while(buffer && i < lastPosition &&
+          (read = fread(buffer, BYTE,
+                        lastPosition - i < CRC_BLOCK ?
+                        lastPosition - i : CRC_BLOCK, file))){
+      crc = crcBuffer(crc, buffer, read);
+      i += read;
+    }
+
+    free(buffer);
+  }
 
   fseek(file, lastPosition, SEEK_SET);
-  return crc ^ ~0U;
+  return crc;
+}
+
+/*
+ * Starts a buffered output stream that keeps a CRC-32 of everything
+ * written to it, for patch formats that checksum themselves.
+ * @param struct crcStream *stream The stream to set up.
+ * @param FILE *file The file to write to.
+ */
+void crcStreamOpen(struct crcStream *stream, FILE *file){
+  stream->file = file;
+  stream->crc = 0;
+  stream->used = 0;
+  stream->failed = 0;
+}
+
+/*
+ * Writes out (And checksums) whatever is in the stream buffer.
+ * @param struct crcStream *stream The stream to flush.
+ * @returns int 1 if everything written so far made it, 0 otherwise.
+ */
+int crcStreamFlush(struct crcStream *stream){
+  if(stream->used){
+    stream->crc = crcBuffer(stream->crc, stream->buffer, stream->used);
+    if(fwrite(stream->buffer, BYTE, stream->used, stream->file) != stream->used)
+      stream->failed = 1;
+    STATS_ADD(syscalls, 1);
+    STATS_ADD(bytesWritten, stream->used);
+    stream->used = 0;
+  }
+
+  return !stream->failed;
+}
+
+/*
+ * Writes data to a checksummed stream.
+ * @param struct crcStream *stream The stream to write to.
+ * @param const unsigned char *data The data to write.
+ * @param size_t length The length of the data.
+ */
+void crcStreamWrite(struct crcStream *stream, const unsigned char *data,
+                    size_t length){
+  while(length){
+    size_t room = CRC_STREAM_SIZE - stream->used;
+    size_t chunk = length < room ? length : room;
+
+    memcpy(stream->buffer + stream->used, data, chunk);
+    stream->used += chunk;
+    data += chunk;
+    length -= chunk;
+
+    if(stream->used == CRC_STREAM_SIZE)
+      crcStreamFlush(stream);
+  }
+}
+
+/*
+ * Writes a single byte to a checksummed stream.
+ * @param struct crcStream *stream The stream to write to.
+ * @param unsigned char byte The byte to write.
+ */
+void crcStreamByte(struct crcStream *stream, unsigned char byte){
+  stream->buffer[stream->used++] = byte;
+
+  if(stream->used == CRC_STREAM_SIZE)
+    crcStreamFlush(stream);
 }
@@ -1,2 +1,28 @@
-unsigned int crcFile(FILE *file, unsigned int *crcTable);
+/* Buffer size for checksummed output */
+#define CRC_STREAM_SIZE (1 << 16)
+
+/* Buffers at least this big are split across threads */
+#define CRC_PARALLEL (1 << 25)
+#define CRC_SLICE (1 << 23)
+#define CRC_MAX_THREADS 16
+
+struct crcStream {
+  FILE *file;
+  unsigned int crc;
+  size_t used;
+  int failed;
+  unsigned char buffer[CRC_STREAM_SIZE];
+};
+
+unsigned int crcBuffer(unsigned int crc, const unsigned char *buffer,
+                       size_t length);
+unsigned int crcCombine(unsigned int first, unsigned int second,
+                        size_t length);
+unsigned int crcFile(FILE *file);
+int crcThreads(int threads);
 void crcTable(unsigned int *table, unsigned int polynomial);
+void crcStreamOpen(struct crcStream *stream, FILE *file);
+void crcStreamWrite(struct crcStream *stream, const unsigned char *data,
+                    size_t length);
+void crcStreamByte(struct crcStream *stream, unsigned char byte);
+int crcStreamFlush(struct crcStream *stream);
@@ -0,0 +1,411 @@
+/* Compressed (gzip, zip and zstd) input */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "FORMAT.h"
+#include "STATS.h"
+#include "DECODE.h"
+
+#ifdef AIPS_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef AIPS_ZSTD
+#include <zstd.h>
+#endif
+
+/* Zip record signatures and sizes */
+#define ZIP_LOCAL 0x04034b50U
+#define ZIP_CENTRAL 0x02014b50U
+#define ZIP_END 0x06054b50U
+#define ZIP_END_SIZE 22
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_NAME_MAX 1024
+
+/**
+ * Works out whether a file is compressed, from its first few bytes.
+ * The file is left at its start.
+ *
+ * @param FILE *file The file to check.
+ *
+ * @return int One of the DECODE_ types.
+ */
+int decodeType(FILE *file) {
+  unsigned char magic[4];
+  size_t length;
+
+  rewind(file);
+  length = fread(magic, BYTE, 4, file);
+  rewind(file);
+
+  if(length >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+    return DECODE_GZIP;
+  } else if(length == 4 && BYTE4_TO_UINT_LE(magic) == ZIP_LOCAL) {
+    return DECODE_ZIP;
+  } else if(length == 4 && BYTE4_TO_UINT_LE(magic) == 0xFD2FB528U) {
+    return DECODE_ZSTD;
+  }
+
+  return DECODE_NONE;
+}
+
+/**
+ * Checks whether this build can unpack a type of compressed file.
+ * (Zip files are let through, since stored entries don't need zlib)
+ *
+ * @param int type One of the DECODE_ types.
+ *
+ * @return int 1 if it can, 0 if its library wasn't built in.
+ */
+int decodeSupported(int type) {
+  switch(type) {
+    case DECODE_GZIP:
+#ifdef AIPS_ZLIB
+      return 1;
+#else
+      return 0;
+#endif
+
+    case DECODE_ZSTD:
+#ifdef AIPS_ZSTD
+      return 1;
+#else
+      return 0;
+#endif
+  }
+
+  return 1;
+}
+
+/**
+ * Refills the compressed input buffer, up to whatever's left of a zip
+ * entry.
+ *
+ * @return size_t How many bytes are buffered.
+ */
+static size_t decodeFill(struct decoder *decoder) {
+  size_t wanted = DECODE_BUFFER, read;
+
+  if(decoder->inputStart < decoder->inputEnd) {
+    return decoder->inputEnd - decoder->inputStart;
+  }
+
+  if(decoder->type == DECODE_ZIP && decoder->left < wanted) {
+    wanted = decoder->left;
+  }
+
+  read = wanted ? fread(decoder->input, BYTE, wanted, decoder->file) : 0;
+  STATS_ADD(syscalls, wanted ? 1 : 0);
+  decoder->left -= decoder->type == DECODE_ZIP ? read : 0;
+  decoder->inputStart = 0;
+  decoder->inputEnd = read;
+  return read;
+}
+
+/**
+ * Finds the entry of a zip file to read, and moves to its data.
+ *
+ * Patches are picked by their extension. For anything else, an entry
+ * with the CRC we're after wins, and failing that, the largest entry
+ * that isn't a patch.
+ *
+ * @return int 1 if an entry was found, 0 otherwise.
+ */
+static int decodeZipEntry(struct decoder *decoder, int patch,
+                          const unsigned int *crc) {
+  unsigned char buffer[ZIP_END_SIZE + 0xFFFF], *end = NULL;
+  unsigned char entry[ZIP_CENTRAL_SIZE];
+  char name[ZIP_NAME_MAX];
+  long size, tail, offset, best = -1, bestSize = -1;
+  unsigned int count, i;
+  int bestCRC = 0;
+
+  if(fseek(decoder->file, 0L, SEEK_END) != 0 ||
+     (size = ftell(decoder->file)) < ZIP_END_SIZE) {
+    return 0;
+  }
+
+  /* The end record is somewhere in the last 64K, before the comment. */
+  tail = size < (long)sizeof(buffer) ? size : (long)sizeof(buffer);
+  fseek(decoder->file, size - tail, SEEK_SET);
+  if(fread(buffer, BYTE, (size_t)tail, decoder->file) != (size_t)tail) {
+    return 0;
+  }
+
+  for(i = (unsigned int)(tail - ZIP_END_SIZE) + 1; i-- > 0;) {
+    if(BYTE4_TO_UINT_LE(buffer + i) == ZIP_END) {
+      end = buffer + i;
+      break;
+    }
+  }
+
+  if(!end) {
+    return 0;
+  }
+
+  count = end[10] | (end[11] << 8);
+  offset = (long)BYTE4_TO_UINT_LE(end + 16);
+  if(fseek(decoder->file, offset, SEEK_SET) != 0) {
+    return 0;
+  }
+
+  for(i = 0; i < count; i++) {
+    unsigned int nameLength, skip, method, checksum;
+    unsigned long compressed, uncompressed, local;
+    const struct patchFormat *format;
+
+    if(fread(entry, BYTE, ZIP_CENTRAL_SIZE, decoder->file) != ZIP_CENTRAL_SIZE ||
+       BYTE4_TO_UINT_LE(entry) != ZIP_CENTRAL) {
+      return 0;
+    }
+
+    method = entry[10] | (entry[11] << 8);
+    checksum = BYTE4_TO_UINT_LE(entry + 16);
+    compressed = BYTE4_TO_UINT_LE(entry + 20);
+    uncompressed = BYTE4_TO_UINT_LE(entry + 24);
+    nameLength = entry[28] | (entry[29] << 8);
+    skip = (entry[30] | (entry[31] << 8)) + (entry[32] | (entry[33] << 8));
+    local = BYTE4_TO_UINT_LE(entry + 42);
+
+    if(nameLength >= ZIP_NAME_MAX ||
+       fread(name, BYTE, nameLength, decoder->file) != nameLength ||
+       fseek(decoder->file, (long)skip, SEEK_CUR) != 0) {
+      return 0;
+    }
+    name[nameLength] = '\0';
+
+    /* Directories, and methods we can't read */
+    if((nameLength && name[nameLength - 1] == '/') ||
+       (method != DECODE_STORED && method != DECODE_DEFLATED)) {
+      continue;
+    }
+
+    format = formatByExtension(name);
+    if(patch ? !(format && format->patch) : (format && format->patch)) {
+      continue;
+    }
+
+    /* A matching CRC beats anything else; otherwise bigger is better */
+    if(!bestCRC && ((crc && *crc == checksum) ||
+                    (long)uncompressed > bestSize)) {
+      bestCRC = crc && *crc == checksum;
+      best = (long)local;
+      bestSize = (long)uncompressed;
+      decoder->method = (int)method;
+      decoder->left = compressed;
+      decoder->expected = checksum;
+    }
+  }
+
+  if(best < 0 || fseek(decoder->file, best, SEEK_SET) != 0 ||
+     fread(entry, BYTE, ZIP_LOCAL_SIZE, decoder->file) != ZIP_LOCAL_SIZE ||
+     BYTE4_TO_UINT_LE(entry) != ZIP_LOCAL) {
+    return 0;
+  }
+
+  return fseek(decoder->file, (long)((entry[26] | (entry[27] << 8)) +
+                                     (entry[28] | (entry[29] << 8))),
+               SEEK_CUR) == 0;
+}
+
+/**
+ * Starts reading a compressed file.
+ *
+ * @param FILE *file The compressed file.
+ * @param int patch For zip files, nonzero to read the patch in the
+ * archive, or zero to read the file to patch.
+ * @param const unsigned int *crc For zip files, the CRC of the file
+ * we're after if we know it, or NULL.
+ *
+ * @return struct decoder* The decoder, or NULL if the file can't be
+ * read. (Including when AIPS was built without support for it)
+ */
+struct decoder *decodeOpen(FILE *file, int patch, const unsigned int *crc) {
+  struct decoder *decoder = (struct decoder*)calloc(1, sizeof(*decoder));
+
+  if(!decoder) {
+    return NULL;
+  }
+
+  decoder->file = file;
+  decoder->type = decodeType(file);
+  decoder->method = DECODE_DEFLATED;
+
+  if(decoder->type == DECODE_ZIP && !decodeZipEntry(decoder, patch, crc)) {
+    free(decoder);
+    return NULL;
+  }
+
+  switch(decoder->type) {
+    case DECODE_GZIP:
+    case DECODE_ZIP:
+#ifdef AIPS_ZLIB
+      if(decoder->method == DECODE_DEFLATED) {
+        z_stream *zlib = (z_stream*)calloc(1, sizeof(z_stream));
+
+        /* Raw deflate in zip files, and a gzip wrapper otherwise */
+        if(!zlib || inflateInit2(zlib, decoder->type == DECODE_ZIP ?
+                                 -MAX_WBITS : MAX_WBITS + 16) != Z_OK) {
+          free(zlib);
+          break;
+        }
+        decoder->state = zlib;
+      }
+      return decoder;
+#else
+      if(decoder->method == DECODE_STORED) {
+        return decoder;
+      }
+      break;
+#endif
+
+    case DECODE_ZSTD:
+#ifdef AIPS_ZSTD
+      if((decoder->state = ZSTD_createDStream())) {
+        ZSTD_initDStream((ZSTD_DStream*)decoder->state);
+        return decoder;
+      }
+#endif
+      break;
+  }
+
+  free(decoder);
+  return NULL;
+}
+
+/**
+ * Reads some decompressed data.
+ *
+ * @param struct decoder *decoder The decoder to read from.
+ * @param unsigned char *out Where to put the data.
+ * @param size_t length How much room there is.
+ *
+ * @return size_t How much was read, which is only 0 at the end of the
+ * data. (Check failed to tell a damaged file from a finished one)
+ */
+size_t decodeRead(struct decoder *decoder, unsigned char *out, size_t length) {
+  size_t produced = 0;
+
+  while(!produced && !decoder->done && length) {
+    size_t available = decodeFill(decoder);
+
+    if(decoder->type == DECODE_ZIP && decoder->method == DECODE_STORED) {
+      produced = available < length ? available : length;
+      memcpy(out, decoder->input + decoder->inputStart, produced);
+      decoder->inputStart += produced;
+      decoder->done = !available;
+    }
+#ifdef AIPS_ZLIB
+    else if(decoder->type != DECODE_ZSTD) {
+      z_stream *zlib = (z_stream*)decoder->state;
+      int status;
+
+      zlib->next_in = decoder->input + decoder->inputStart;
+      zlib->avail_in = (uInt)available;
+      zlib->next_out = out;
+      zlib->avail_out = (uInt)(length < 0x40000000 ? length : 0x40000000);
+      status = inflate(zlib, Z_NO_FLUSH);
+      decoder->inputStart = decoder->inputEnd - zlib->avail_in;
+      produced = (size_t)(zlib->next_out - out);
+
+      if(status == Z_STREAM_END) {
+        /* gzip files can be several gzip streams back to back */
+        if(decoder->type == DECODE_GZIP && decodeFill(decoder)) {
+          inflateReset(zlib);
+        } else {
+          decoder->done = 1;
+        }
+      } else if((status != Z_OK && status != Z_BUF_ERROR) ||
+                (!available && !produced)) {
+        decoder->failed = decoder->done = 1;
+      }
+    }
+#endif
+#ifdef AIPS_ZSTD
+    else {
+      ZSTD_inBuffer in;
+      ZSTD_outBuffer result;
+      size_t status;
+
+      in.src = decoder->input + decoder->inputStart;
+      in.size = available;
+      in.pos = 0;
+      result.dst = out;
+      result.size = length;
+      result.pos = 0;
+      status = ZSTD_decompressStream((ZSTD_DStream*)decoder->state, &result,
+                                     &in);
+      decoder->inputStart += in.pos;
+      produced = result.pos;
+
+      if(ZSTD_isError(status)) {
+        decoder->failed = decoder->done = 1;
+      } else if(!available && !produced) {
+        /* Out of input; that's only fine between frames */
+        decoder->failed = status != 0;
+        decoder->done = 1;
+      }
+    }
+#else
+    else {
+      decoder->failed = decoder->done = 1;
+    }
+#endif
+  }
+
+  if(decoder->type == DECODE_ZIP) {
+    decoder->crc = crcBuffer(decoder->crc, out, produced);
+    if(decoder->done && decoder->crc != decoder->expected) {
+      decoder->failed = 1;
+    }
+  }
+
+  return produced;
+}
+
+/**
+ * Decompresses everything that's left into a file.
+ *
+ * @param struct decoder *decoder The decoder to read from.
+ * @param FILE *out The file to write to.
+ *
+ * @return int 1 on success, 0 if the compressed file is damaged or
+ * the output couldn't be written.
+ */
+int decodeTo(struct decoder *decoder, FILE *out) {
+  unsigned char *buffer = (unsigned char*)malloc(DECODE_BUFFER);
+  size_t read;
+  int result = !!buffer;
+
+  while(result && (read = decodeRead(decoder, buffer, DECODE_BUFFER))) {
+    result = fwrite(buffer, BYTE, read, out) == read;
+    STATS_ADD(bytesWritten, read);
+  }
+
+  free(buffer);
+  return result && !decoder->failed && fflush(out) == 0;
+}
+
+/**
+ * Frees a decoder from decodeOpen. (The file is left open)
+ */
+void decodeClose(struct decoder *decoder) {
+  if(!decoder) {
+    return;
+  }
+
+#ifdef AIPS_ZLIB
+  if(decoder->type != DECODE_ZSTD && decoder->state) {
+    inflateEnd((z_stream*)decoder->state);
+  }
+#endif
+#ifdef AIPS_ZSTD
+  if(decoder->type == DECODE_ZSTD) {
+    ZSTD_freeDStream((ZSTD_DStream*)decoder->state);
+  }
+#endif
+
+  free(decoder->state);
+  free(decoder);
+}
@@ -0,0 +1,38 @@
+/* Compression formats */
+#define DECODE_NONE 0
+#define DECODE_GZIP 1
+#define DECODE_ZIP 2
+#define DECODE_ZSTD 3
+
+/* Read buffer size for compressed input */
+#define DECODE_BUFFER (1 << 16)
+
+/* Zip entry methods */
+#define DECODE_STORED 0
+#define DECODE_DEFLATED 8
+
+/*
+ * A compressed file being read. For zip files, this is a single entry
+ * of the archive.
+ */
+struct decoder {
+  FILE *file;
+  int type;
+  int method;
+  int done;
+  int failed;
+  size_t left;
+  unsigned int crc;
+  unsigned int expected;
+  void *state;
+  size_t inputStart;
+  size_t inputEnd;
+  unsigned char input[DECODE_BUFFER];
+};
+
+int decodeType(FILE *file);
+int decodeSupported(int type);
+struct decoder *decodeOpen(FILE *file, int patch, const unsigned int *crc);
+size_t decodeRead(struct decoder *decoder, unsigned char *out, size_t length);
+int decodeTo(struct decoder *decoder, FILE *out);
+void decodeClose(struct decoder *decoder);
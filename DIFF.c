@@ -0,0 +1,117 @@
+/* Block comparison functions shared by the patch creators */
+
+#include "AIPS.h"
+#include "DIFF.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Finds the first differing byte in a nonzero 64-bit XOR of two words */
+static size_t lowestByte(unsigned long long word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (size_t)__builtin_clzll(word) / 8;
+#else
+  return (size_t)__builtin_ctzll(word) / 8;
+#endif
+}
+
+/**
+ * Measures how many bytes two buffers have in common from the start.
+ *
+ * Compares 16 bytes at a time with SSE2 where we have it, and a
+ * machine word at a time otherwise.
+ *
+ * @param const unsigned char *a The first buffer.
+ * @param const unsigned char *b The second buffer.
+ * @param size_t length How far to compare.
+ *
+ * @return size_t The offset of the first difference, or length if
+ * there isn't one.
+ */
+size_t diffEqual(const unsigned char *a, const unsigned char *b, size_t length) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for(; i + 16 <= length; i += 16) {
+    __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                  _mm_loadu_si128((const __m128i*)(b + i)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(same) ^ 0xFFFF;
+
+    if(mask) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for(; i + 8 <= length; i += 8) {
+    unsigned long long x, y;
+
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if(x != y) {
+      return i + lowestByte(x ^ y);
+    }
+  }
+
+  while(i < length && a[i] == b[i]) {
+    i++;
+  }
+
+  return i;
+}
+
+/**
+ * Measures how many bytes differ between two buffers from the start.
+ *
+ * @param const unsigned char *a The first buffer.
+ * @param const unsigned char *b The second buffer.
+ * @param size_t length How far to compare.
+ *
+ * @return size_t The offset of the first byte that matches, or length
+ * if there isn't one.
+ */
+size_t diffUnequal(const unsigned char *a, const unsigned char *b,
+                   size_t length) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for(; i + 16 <= length; i += 16) {
+    __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                  _mm_loadu_si128((const __m128i*)(b + i)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(same);
+
+    if(mask) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+
+  while(i < length && a[i] != b[i]) {
+    i++;
+  }
+
+  return i;
+}
+
+/**
+ * Measures how many times the first byte of a buffer repeats.
+ *
+ * @param const unsigned char *data The buffer.
+ * @param size_t length The size of the buffer.
+ *
+ * @return size_t The number of leading bytes equal to data[0].
+ */
+size_t diffRepeat(const unsigned char *data, size_t length) {
+  size_t i = 1;
+
+  if(length == 0) {
+    return 0;
+  }
+
+  while(i < length && data[i] == data[0]) {
+    i++;
+  }
+
+  return i;
+}
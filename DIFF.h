@@ -0,0 +1,4 @@
+size_t diffEqual(const unsigned char *a, const unsigned char *b, size_t length);
+size_t diffUnequal(const unsigned char *a, const unsigned char *b,
+                   size_t length);
+size_t diffRepeat(const unsigned char *data, size_t length);
@@ -0,0 +1,340 @@
+/* Patch format detection */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* For nftw */
+#endif
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "IPS.h"
+#include "UPS.h"
+#include "BPS.h"
+#include "MAP.h"
+#include "DECODE.h"
+#include "STREAM.h"
+#include "FORMAT.h"
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <ftw.h>
+#endif
+
+/* Every format we know, by signature. */
+static const struct patchFormat formats[] = {
+  {"IPS", "PATCH", 5, 5, ".ips", IPSPatchFile, IPSCreatePatch, IPSPatchFile,
+   IPSVerify},
+  {"UPS", "UPS1", 4, 18, ".ups", UPSPatchFile, UPSCreatePatch, UPSPatchPipe,
+   UPSVerify},
+  {"BPS", "BPS1", 4, 19, ".bps", BPSPatchFile, BPSCreatePatch, BPSPatchFile,
+   BPSVerify},
+  {"IPS32", "IPS32", 5, 5, ".ips32", IPSPatchFile, IPS32CreatePatch,
+   IPSPatchFile, IPSVerify},
+  {"PPF", "PPF", 3, 60, ".ppf", NULL, NULL, NULL, NULL},
+  {"APS", "APS1", 4, 4, ".aps", NULL, NULL, NULL, NULL},
+  {"VCDIFF", "\xD6\xC3\xC4", 3, 5, ".xdelta", NULL, NULL, NULL, NULL},
+  {"BSDIFF", "BSDIFF40", 8, 32, ".bsdiff", NULL, NULL, NULL, NULL}
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+/* Totals for a directory scan */
+static struct {
+  size_t counts[FORMAT_COUNT];
+  size_t files;
+  int flags;
+} scan;
+
+/**
+ * Works out what kind of patch something is from the first few bytes
+ * of it.
+ *
+ * @param const unsigned char *prefix The start of the file.
+ * @param size_t length How many bytes of it there are.
+ * @param size_t size The size of the whole file, if it's known.
+ * (Otherwise, the largest size_t)
+ *
+ * @return const struct patchFormat* The format, or NULL if it doesn't
+ * look like a patch.
+ */
+const struct patchFormat *formatMatch(const unsigned char *prefix,
+                                      size_t length, size_t size) {
+  size_t i;
+
+  for(i = 0; i < FORMAT_COUNT; i++) {
+    if(length >= formats[i].magicLength && size >= formats[i].minimumSize &&
+       memcmp(prefix, formats[i].magic, formats[i].magicLength) == 0) {
+      return &formats[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Works out what kind of patch a file is from the start of it.
+ *
+ * Only a single read of the first few bytes and a stat of the file
+ * are done, no matter how many formats there are to check, and the
+ * file is left at its start.
+ *
+ * @param FILE *file The file to check.
+ * @param size_t *size Where to store the size of the file, or NULL.
+ * (The number of bytes read if the file isn't a regular file)
+ *
+ * @return const struct patchFormat* The format of the file, or NULL
+ * if it doesn't look like a patch.
+ */
+const struct patchFormat *formatSniff(FILE *file, size_t *size) {
+  unsigned char prefix[FORMAT_PREFIX];
+  struct stat info;
+  size_t length, fileSize;
+
+  rewind(file);
+  length = fread(prefix, BYTE, FORMAT_PREFIX, file);
+  rewind(file);
+
+  fileSize = length;
+  if(fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)) {
+    fileSize = (size_t)info.st_size;
+  }
+
+  if(size) {
+    *size = fileSize;
+  }
+
+  return formatMatch(prefix, length, fileSize);
+}
+
+/**
+ * Works out what kind of patch a filename is for, from its extension.
+ *
+ * @param const char *filename The name of the patch.
+ *
+ * @return const struct patchFormat* The format, or NULL if the
+ * extension isn't one we know.
+ */
+const struct patchFormat *formatByExtension(const char *filename) {
+  const char *extension = strrchr(filename, '.');
+  size_t i;
+
+  if(!extension) {
+    return NULL;
+  }
+
+  for(i = 0; i < FORMAT_COUNT; i++) {
+    if(strcasecmp(extension, formats[i].extension) == 0) {
+      return &formats[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Reads the checksum a patch has for the file it applies to, for
+ * picking that file out of an archive.
+ *
+ * Only UPS and BPS patches have one. (In their footers, 12 bytes from
+ * the end) The patch is left at its start.
+ *
+ * @param FILE *file The patch, which has to be seekable.
+ * @param unsigned int *crc Where to store the checksum.
+ *
+ * @return int 1 if the patch has a checksum, 0 otherwise.
+ */
+int formatSourceCRC(FILE *file, unsigned int *crc) {
+  const struct patchFormat *format = formatSniff(file, NULL);
+  unsigned char footer[4];
+  int result;
+
+  if(!format || (strcmp(format->name, "UPS") != 0 &&
+                 strcmp(format->name, "BPS") != 0)) {
+    return 0;
+  }
+
+  result = fseek(file, -12L, SEEK_END) == 0 &&
+           fread(footer, BYTE, 4, file) == 4;
+  rewind(file);
+  if(result) {
+    *crc = BYTE4_TO_UINT_LE(footer);
+  }
+
+  return result;
+}
+
+/**
+ * Works out how much of the front of a file is a copier header, with
+ * --copier-header. Patches are then applied to what comes after it,
+ * with every offset and CRC starting there, and the header itself is
+ * left as it is.
+ *
+ * SNES ROMs are whole kilobytes, so a file with 512 bytes over is
+ * taken to have a header.
+ *
+ * @param const struct pStruct *params The parameter struct, with the
+ * flags.
+ * @param size_t size The size of the file.
+ *
+ * @return size_t The size of the header, or 0 if there isn't one.
+ */
+size_t formatHeader(const struct pStruct *params, size_t size) {
+  if(!(params->flags & ARG_HEADER) ||
+     size % FORMAT_HEADER_BLOCK != FORMAT_HEADER) {
+    return 0;
+  }
+
+  if(params->flags & ARG_VERBOSE) {
+    printf("Leaving the %d byte copier header alone.\n", FORMAT_HEADER);
+  }
+
+  return FORMAT_HEADER;
+}
+
+#ifndef _WIN32
+/**
+ * Checks a single file found in a directory scan.
+ */
+static int formatScanFile(const char *path, const struct stat *info,
+                          int type, struct FTW *walk) {
+  const struct patchFormat *format;
+  size_t size;
+  FILE *file;
+
+  (void)walk;
+  if(type != FTW_F || !S_ISREG(info->st_mode)) {
+    return 0;
+  }
+
+  scan.files++;
+  if(!(file = fopen(path, "rb"))) {
+    AIPSError(ERR_MINOR, "Couldn't open %s", path);
+    return 0;
+  }
+
+  format = formatSniff(file, &size);
+  fclose(file);
+
+  if(format) {
+    scan.counts[format - formats]++;
+    printf("%s\t%lu\t%s\n", format->name, (unsigned long)size, path);
+  } else if(scan.flags & ARG_VERBOSE) {
+    printf("-\t%lu\t%s\n", (unsigned long)size, path);
+  }
+
+  return 0;
+}
+#endif
+
+/**
+ * Classifies every file in a directory tree, printing the format,
+ * size and path of each patch found, and then how many of each
+ * format there were.
+ *
+ * With --verbose, files that aren't patches are listed too, with a
+ * format of "-".
+ *
+ * @param pStruct *params The parameter struct, with the path to scan.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int formatScan(struct pStruct *params) {
+#ifndef _WIN32
+  size_t i, patches = 0;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.flags = params->flags;
+
+  if(nftw(params->scanPath, formatScanFile, 64, FTW_PHYS) != 0) {
+    return AIPSError(ERR_MEDIUM, "Couldn't scan %s", params->scanPath);
+  }
+
+  for(i = 0; i < FORMAT_COUNT; i++) {
+    if(scan.counts[i]) {
+      printf("%s%lu %s", patches ? ", " : "Found ",
+             (unsigned long)scan.counts[i], formats[i].name);
+      patches += scan.counts[i];
+    }
+  }
+
+  printf("%s%lu patch%s in %lu files.\n", patches ? " -- " : "Found ",
+         (unsigned long)patches, patches == 1 ? "" : "es",
+         (unsigned long)scan.files);
+  return 1;
+#else
+  (void)params;
+  return AIPSError(ERR_MEDIUM, "Scanning isn't supported on this system.");
+#endif
+}
+
+/**
+ * Checks a patch against a file without changing either of them.
+ *
+ * The whole patch is read, every record in it is checked to fit the
+ * file, and the checksums the patch has for the file (If it has any)
+ * are checked too. Then the size and CRC the patched file would have
+ * are printed out. A copier header (See formatHeader) is left out of
+ * the check, and counted back into the size and CRC.
+ *
+ * @param struct pStruct *params The parameter struct with the patch,
+ * (Or a stream of it) the file to check it against, and the flags.
+ *
+ * @return int 1 if the patch would apply cleanly, 0 otherwise.
+ */
+int formatVerify(struct pStruct *params) {
+  const struct patchFormat *format;
+  struct patchCheck check = {0, 0, 0, 0};
+  struct mappedFile patch, rom;
+  size_t header;
+  int result = 0;
+
+  if(params->stream) {
+    patch.file = NULL;
+    patch.flags = MAPPED_HEAP;
+    if(!(patch.data = streamReadAll(params->stream, &patch.size))) {
+      return AIPSError(ERR_MEDIUM, "Couldn't read the patch.");
+    }
+  } else if(!mapBegin(&patch, params->patchFile, 0)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't read the patch.");
+  }
+
+  /* With --async, both files are read in at the same time */
+  if(!mapBegin(&rom, params->romFile, 0)) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the file to check.");
+  }
+
+  if(!mapWait(&patch) || !mapWait(&rom)) {
+    unmapFile(&rom);
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the patch and the file to"
+                     " check.");
+  }
+
+  header = formatHeader(params, rom.size);
+  format = formatMatch(patch.data, patch.size, patch.size);
+  if(decodeType(params->romFile) != DECODE_NONE) {
+    AIPSError(ERR_MEDIUM, "Compressed files can't be checked; unpack it"
+              " first.");
+  } else if(!format || !format->verify) {
+    AIPSError(ERR_MEDIUM, "%s patches can't be checked.",
+              format ? format->name : "These");
+  } else if((result = format->verify(patch.data, patch.size,
+                                     rom.data + header, rom.size - header,
+                                     &check))) {
+    /* The header is the same in the patched file */
+    if(header) {
+      check.outputCRC = crcCombine(crcBuffer(0, rom.data, header),
+                                   check.outputCRC, check.outputSize);
+      check.outputSize += header;
+    }
+    printf("%s: OK -- %lu bytes, CRC32 %08x, %lu record%s\n",
+           params->patchPath ? params->patchPath : format->name,
+           check.outputSize, check.outputCRC, check.records,
+           check.records == 1 ? "" : "s");
+  }
+
+  unmapFile(&rom);
+  unmapFile(&patch);
+  return result;
+}
@@ -0,0 +1,33 @@
+/* How much of a file is read to work out what it is */
+#define FORMAT_PREFIX 16
+
+/* SNES copier headers, which ROMs are whole kilobytes without */
+#define FORMAT_HEADER 512
+#define FORMAT_HEADER_BLOCK 1024
+
+/*
+ * A patch format we know the signature of. Formats we can only
+ * recognize have no patch or create functions.
+ */
+struct patchFormat {
+  const char *name;
+  const char *magic;
+  size_t magicLength;
+  size_t minimumSize;
+  const char *extension;
+  int (*patch)(struct pStruct *params);
+  int (*create)(struct pStruct *params);
+  int (*stream)(struct pStruct *params);
+  int (*verify)(const unsigned char *patch, size_t patchSize,
+                const unsigned char *rom, size_t romSize,
+                struct patchCheck *check);
+};
+
+const struct patchFormat *formatMatch(const unsigned char *prefix,
+                                      size_t length, size_t size);
+const struct patchFormat *formatSniff(FILE *file, size_t *size);
+const struct patchFormat *formatByExtension(const char *filename);
+int formatSourceCRC(FILE *file, unsigned int *crc);
+size_t formatHeader(const struct pStruct *params, size_t size);
+int formatScan(struct pStruct *params);
+int formatVerify(struct pStruct *params);
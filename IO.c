@@ -0,0 +1,655 @@
+/* Asynchronous file I/O */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "IO.h"
+#include "STATS.h"
+
+#include <pthread.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * One piece of a transfer. With io_uring, a piece that comes back
+ * short is sent off again from as far as it got.
+ */
+struct ioPiece {
+  struct ioRequest *request;
+  size_t chunk;
+  size_t from;
+};
+
+/*
+ * One transfer, split into IO_CHUNK pieces. Pieces can finish in any
+ * order, but are checksummed in order as soon as they can be, while
+ * later pieces are still in flight.
+ */
+struct ioRequest {
+  int descriptor;
+  unsigned char *buffer;
+  size_t size;
+  int write;
+  unsigned int *crc;
+  size_t chunks;
+  size_t queued;   /* Pieces handed to the backend so far */
+  size_t inflight; /* Pieces the backend isn't done with */
+  size_t checked;
+  unsigned char *done;
+  struct ioPiece *pieces;
+  int failed;
+  struct ioRequest *next;
+};
+
+#ifdef __linux__
+/* The parts of an io_uring we need, mapped from the kernel. */
+struct ioRing {
+  int descriptor;
+  unsigned int entries;
+  unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned int *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqRing, *cqRing;
+  size_t sqSize, cqSize, sqeSize;
+};
+
+/**
+ * Closes a ring from ioRingOpen.
+ */
+static void ioRingClose(struct ioRing *ring) {
+  if(ring->sqes) {
+    munmap(ring->sqes, ring->sqeSize);
+  }
+  if(ring->cqRing && ring->cqRing != ring->sqRing) {
+    munmap(ring->cqRing, ring->cqSize);
+  }
+  if(ring->sqRing) {
+    munmap(ring->sqRing, ring->sqSize);
+  }
+  close(ring->descriptor);
+}
+
+/**
+ * Sets up an io_uring with room for a number of requests.
+ *
+ * @return int 1 on success, 0 if the kernel won't give us one.
+ */
+static int ioRingOpen(struct ioRing *ring, unsigned int entries) {
+  struct io_uring_params params;
+  unsigned char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->descriptor = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if(ring->descriptor < 0) {
+    return 0;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cqSize = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqSize = ring->cqSize = ring->sqSize > ring->cqSize ?
+                                  ring->sqSize : ring->cqSize;
+  }
+
+  ring->sqRing = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->descriptor,
+                      IORING_OFF_SQ_RING);
+  if(ring->sqRing == MAP_FAILED) {
+    ring->sqRing = NULL;
+    ioRingClose(ring);
+    return 0;
+  }
+
+  ring->cqRing = ring->sqRing;
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cqRing = mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->descriptor,
+                        IORING_OFF_CQ_RING);
+    if(ring->cqRing == MAP_FAILED) {
+      ring->cqRing = NULL;
+      ioRingClose(ring);
+      return 0;
+    }
+  }
+
+  ring->sqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqeSize,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE,
+                                          ring->descriptor, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    ioRingClose(ring);
+    return 0;
+  }
+
+  sq = (unsigned char*)ring->sqRing;
+  cq = (unsigned char*)ring->cqRing;
+  ring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+  ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return 1;
+}
+
+#endif
+
+/*
+ * Everything in flight, from every thread. The ring (Or the pool of
+ * threads) is set up once by ioEnable and kept for the life of the
+ * process. Requests wait in a queue until there's room for their
+ * pieces, so transfers of different files, and of different batch
+ * jobs, are all in flight together.
+ */
+static struct {
+  int backend;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;   /* A piece finished, or a request failed */
+  pthread_cond_t work;      /* A request was queued (Thread pool) */
+  struct ioRequest *queue;  /* Requests with pieces left to hand out */
+  int reaping;              /* A thread is waiting on the ring */
+  unsigned int inflight;    /* Pieces on the ring */
+  unsigned int unsubmitted; /* ...that the kernel hasn't been told of */
+#ifdef __linux__
+  struct ioRing ring;
+#endif
+} io;
+
+/**
+ * Counts how many pieces at the front of a transfer are finished.
+ */
+static size_t ioReady(const struct ioRequest *request) {
+  size_t ready = request->checked;
+
+  while(ready < request->chunks && request->done[ready]) {
+    ready++;
+  }
+
+  return ready;
+}
+
+/**
+ * Checksums the finished pieces at the front of a transfer, up to a
+ * piece from ioReady.
+ */
+static void ioChecksum(struct ioRequest *request, size_t ready) {
+  while(request->checked < ready) {
+    size_t offset = request->checked * IO_CHUNK;
+    size_t length = request->size - offset < IO_CHUNK ?
+                    request->size - offset : IO_CHUNK;
+
+    if(request->crc) {
+      *request->crc = crcBuffer(*request->crc, request->buffer + offset,
+                                length);
+    }
+    request->checked++;
+  }
+}
+
+/**
+ * Transfers one piece with plain blocking calls, picking up after
+ * short reads and writes.
+ */
+static int ioChunk(struct ioRequest *request, size_t chunk) {
+#ifndef _WIN32
+  size_t offset = chunk * IO_CHUNK;
+  size_t end = request->size - offset < IO_CHUNK ? request->size :
+               offset + IO_CHUNK;
+
+  while(offset < end) {
+    ssize_t moved = request->write ?
+      pwrite(request->descriptor, request->buffer + offset, end - offset,
+             (off_t)offset) :
+      pread(request->descriptor, request->buffer + offset, end - offset,
+            (off_t)offset);
+
+    if(moved <= 0) {
+      return 0;
+    }
+    offset += (size_t)moved;
+  }
+
+  return 1;
+#else
+  (void)request;
+  (void)chunk;
+  return 0;
+#endif
+}
+
+/**
+ * Adds a request to the end of the queue. The lock must be held.
+ */
+static void ioQueue(struct ioRequest *request) {
+  struct ioRequest **link = &io.queue;
+
+  while(*link) {
+    link = &(*link)->next;
+  }
+  request->next = NULL;
+  *link = request;
+}
+
+/**
+ * Takes a request out of the queue, if it's still in it. The lock
+ * must be held.
+ */
+static void ioDequeue(struct ioRequest *request) {
+  struct ioRequest **link;
+
+  for(link = &io.queue; *link; link = &(*link)->next) {
+    if(*link == request) {
+      *link = request->next;
+      return;
+    }
+  }
+}
+
+/**
+ * Hands out the next piece waiting in the queue, oldest request
+ * first. The lock must be held.
+ *
+ * @return struct ioPiece* The piece, or NULL if nothing is waiting.
+ */
+static struct ioPiece *ioNext(void) {
+  struct ioRequest *request;
+
+  while((request = io.queue)) {
+    if(!request->failed && request->queued < request->chunks) {
+      struct ioPiece *piece = &request->pieces[request->queued++];
+
+      request->inflight++;
+      if(request->queued == request->chunks) {
+        io.queue = request->next;
+      }
+      return piece;
+    }
+    io.queue = request->next;
+  }
+
+  return NULL;
+}
+
+#ifdef __linux__
+/**
+ * Checks that the kernel can read and write through a ring, and not
+ * just set one up. (Reads and writes came a little later)
+ */
+static int ioRingSupported(const struct ioRing *ring) {
+  size_t size = sizeof(struct io_uring_probe) +
+                (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, size);
+  int result;
+
+  result = probe &&
+           syscall(__NR_io_uring_register, ring->descriptor,
+                   IORING_REGISTER_PROBE, probe, IORING_OP_WRITE + 1) == 0 &&
+           probe->ops_len > IORING_OP_WRITE &&
+           (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return result;
+}
+
+/**
+ * Puts a read or write of the rest of a piece on the ring. The lock
+ * must be held, and there must be room.
+ */
+static void ioRingQueue(struct ioPiece *piece) {
+  struct ioRequest *request = piece->request;
+  unsigned int tail = *io.ring.sqTail, index = tail & *io.ring.sqMask;
+  struct io_uring_sqe *sqe = &io.ring.sqes[index];
+  size_t start = piece->chunk * IO_CHUNK, offset = start + piece->from;
+  size_t end = request->size - start < IO_CHUNK ? request->size :
+               start + IO_CHUNK;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = request->descriptor;
+  sqe->addr = (unsigned long)(request->buffer + offset);
+  sqe->len = (unsigned int)(end - offset);
+  sqe->off = offset;
+  sqe->user_data = (unsigned long)piece;
+  io.ring.sqArray[index] = index;
+  __atomic_store_n(io.ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  io.inflight++;
+  io.unsubmitted++;
+}
+
+/**
+ * Fills the ring from the queue, and tells the kernel about it. The
+ * lock must be held.
+ *
+ * If the kernel won't take them, the pieces it hasn't taken are taken
+ * back off the ring, and their transfers fail.
+ */
+static void ioRingSubmit(void) {
+  struct ioPiece *piece;
+
+  while(io.inflight < io.ring.entries && (piece = ioNext())) {
+    ioRingQueue(piece);
+  }
+
+  while(io.unsubmitted) {
+    int submitted;
+
+    STATS_ADD(syscalls, 1);
+    submitted = (int)syscall(__NR_io_uring_enter, io.ring.descriptor,
+                             io.unsubmitted, 0U, 0U, NULL, 0);
+    if(submitted > 0) {
+      io.unsubmitted -= (unsigned int)submitted;
+    } else if(submitted < 0 && errno == EINTR) {
+      continue;
+    } else {
+      unsigned int head = __atomic_load_n(io.ring.sqHead, __ATOMIC_ACQUIRE);
+      unsigned int tail = *io.ring.sqTail;
+
+      for(; head != tail; tail--) {
+        struct io_uring_sqe *sqe =
+          &io.ring.sqes[io.ring.sqArray[(tail - 1) & *io.ring.sqMask]];
+
+        piece = (struct ioPiece*)(unsigned long)sqe->user_data;
+        piece->request->inflight--;
+        piece->request->failed = 1;
+        io.inflight--;
+      }
+      __atomic_store_n(io.ring.sqTail, tail, __ATOMIC_RELEASE);
+      io.unsubmitted = 0;
+      pthread_cond_broadcast(&io.changed);
+    }
+  }
+}
+
+/**
+ * Waits for pieces on the ring to finish, and sorts out whatever has,
+ * whichever thread's transfer it belongs to. Then the ring is topped
+ * back up from the queue.
+ *
+ * The lock must be held, and is let go while waiting. Only one thread
+ * waits on the ring at a time; the rest wait to hear from it.
+ */
+static void ioRingReap(void) {
+  unsigned int head, tail;
+
+  io.reaping = 1;
+  pthread_mutex_unlock(&io.lock);
+  STATS_ADD(syscalls, 1);
+  syscall(__NR_io_uring_enter, io.ring.descriptor, 0U, 1U,
+          IORING_ENTER_GETEVENTS, NULL, 0);
+  pthread_mutex_lock(&io.lock);
+  io.reaping = 0;
+
+  head = *io.ring.cqHead;
+  tail = __atomic_load_n(io.ring.cqTail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++) {
+    struct io_uring_cqe *cqe = &io.ring.cqes[head & *io.ring.cqMask];
+    struct ioPiece *piece = (struct ioPiece*)(unsigned long)cqe->user_data;
+    struct ioRequest *request = piece->request;
+    size_t start = piece->chunk * IO_CHUNK;
+    size_t length = request->size - start < IO_CHUNK ?
+                    request->size - start : IO_CHUNK;
+
+    io.inflight--;
+    request->inflight--;
+    if(cqe->res <= 0) {
+      request->failed = 1;
+    } else if((piece->from += (size_t)cqe->res) < length) {
+      if(!request->failed) {
+        request->inflight++;
+        ioRingQueue(piece);
+      }
+    } else {
+      request->done[piece->chunk] = 1;
+    }
+  }
+  __atomic_store_n(io.ring.cqHead, head, __ATOMIC_RELEASE);
+
+  ioRingSubmit();
+  pthread_cond_broadcast(&io.changed);
+}
+#endif
+
+/**
+ * Thread pool worker, for when there's no io_uring. Takes pieces from
+ * the queue for as long as the process runs.
+ */
+static void *ioWorker(void *argument) {
+  (void)argument;
+
+  pthread_mutex_lock(&io.lock);
+  while(1) {
+    struct ioPiece *piece = ioNext();
+    int result;
+
+    if(!piece) {
+      pthread_cond_wait(&io.work, &io.lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&io.lock);
+    result = ioChunk(piece->request, piece->chunk);
+    pthread_mutex_lock(&io.lock);
+
+    piece->request->inflight--;
+    if(result) {
+      piece->request->done[piece->chunk] = 1;
+    } else {
+      piece->request->failed = 1;
+    }
+    pthread_cond_broadcast(&io.changed);
+  }
+
+  return NULL;
+}
+
+/**
+ * Turns asynchronous transfers on, picking the backend and setting it
+ * up for the rest of the process.
+ *
+ * io_uring is used if the kernel can read and write through it, and a
+ * small thread pool otherwise. This should be called before any other
+ * threads start.
+ *
+ * @param int enable Nonzero to turn asynchronous transfers on.
+ */
+void ioEnable(int enable) {
+#ifndef _WIN32
+  pthread_t thread;
+  int i;
+
+  if(!enable || io.backend != IO_NONE) {
+    return;
+  }
+
+  pthread_mutex_init(&io.lock, NULL);
+  pthread_cond_init(&io.changed, NULL);
+  pthread_cond_init(&io.work, NULL);
+
+#ifdef __linux__
+  if(ioRingOpen(&io.ring, IO_DEPTH)) {
+    if(ioRingSupported(&io.ring)) {
+      io.backend = IO_URING;
+      return;
+    }
+    ioRingClose(&io.ring);
+  }
+#endif
+
+  for(i = 0; i < IO_THREADS; i++) {
+    if(pthread_create(&thread, NULL, ioWorker, NULL) == 0) {
+      pthread_detach(thread);
+      io.backend = IO_THREADED;
+    }
+  }
+#else
+  (void)enable;
+#endif
+}
+
+/**
+ * Tells which backend transfers use.
+ *
+ * @return int IO_URING, IO_THREADED, or IO_NONE if they're off.
+ */
+int ioEnabled(void) {
+  return io.backend;
+}
+
+/**
+ * Starts reading or writing a whole range of a file, with several
+ * pieces of it in flight at once. Other transfers (From this thread
+ * or any other) can be started before it's finished with ioFinish.
+ *
+ * The data can also be checksummed on the way through; each piece is
+ * added to the CRC as soon as it and everything before it is done,
+ * while the pieces after it are still being transferred. (By whoever
+ * is waiting in ioFinish)
+ *
+ * @param int descriptor The file to transfer from or to, starting at
+ * its beginning.
+ * @param unsigned char *buffer The data to write, or where to read it.
+ * This has to stay put until ioFinish.
+ * @param size_t size How many bytes to transfer.
+ * @param int write Nonzero to write, zero to read.
+ * @param unsigned int *crc A CRC to continue over the data, or NULL.
+ *
+ * @return struct ioRequest* The transfer, to pass to ioFinish, or
+ * NULL if we ran out of memory.
+ */
+struct ioRequest *ioStart(int descriptor, unsigned char *buffer, size_t size,
+                          int write, unsigned int *crc) {
+  struct ioRequest *request =
+    (struct ioRequest*)malloc(sizeof(struct ioRequest));
+  size_t i;
+
+  if(!request) {
+    return NULL;
+  }
+
+  request->descriptor = descriptor;
+  request->buffer = buffer;
+  request->size = size;
+  request->write = write;
+  request->crc = crc;
+  request->chunks = (size + IO_CHUNK - 1) / IO_CHUNK;
+  request->queued = 0;
+  request->inflight = 0;
+  request->checked = 0;
+  request->failed = 0;
+  request->next = NULL;
+  request->done = (unsigned char*)calloc(request->chunks + 1, 1);
+  request->pieces = (struct ioPiece*)malloc((request->chunks + 1) *
+                                            sizeof(struct ioPiece));
+  if(!request->done || !request->pieces) {
+    free(request->done);
+    free(request->pieces);
+    free(request);
+    return NULL;
+  }
+
+  for(i = 0; i < request->chunks; i++) {
+    request->pieces[i].request = request;
+    request->pieces[i].chunk = i;
+    request->pieces[i].from = 0;
+  }
+
+  /* One piece isn't worth handing off */
+  if(request->chunks <= 1 || io.backend == IO_NONE) {
+    for(i = 0; !request->failed && i < request->chunks; i++) {
+      request->done[i] = (unsigned char)ioChunk(request, i);
+      request->failed = !request->done[i];
+    }
+    request->queued = i;
+    STATS_ADD(syscalls, i);
+    return request;
+  }
+
+  pthread_mutex_lock(&io.lock);
+  ioQueue(request);
+#ifdef __linux__
+  if(io.backend == IO_URING) {
+    ioRingSubmit();
+  }
+#endif
+  pthread_cond_broadcast(&io.work);
+  pthread_mutex_unlock(&io.lock);
+
+  if(io.backend == IO_THREADED) {
+    STATS_ADD(syscalls, request->chunks);
+  }
+  return request;
+}
+
+/**
+ * Waits for a transfer from ioStart to finish, checksumming it as it
+ * comes in, and frees it.
+ *
+ * @param struct ioRequest *request The transfer.
+ *
+ * @return int 1 if everything was transferred, 0 otherwise.
+ */
+int ioFinish(struct ioRequest *request) {
+  int result;
+
+  if(!request) {
+    return 0;
+  }
+
+  if(request->chunks > 1 && io.backend != IO_NONE) {
+    pthread_mutex_lock(&io.lock);
+    while(request->inflight ||
+          (!request->failed && request->checked < request->chunks)) {
+      size_t ready = ioReady(request);
+
+      if(!request->failed && ready > request->checked) {
+        /* Checksum without the lock, so the rest can keep going. */
+        pthread_mutex_unlock(&io.lock);
+        ioChecksum(request, ready);
+        pthread_mutex_lock(&io.lock);
+        continue;
+      }
+
+#ifdef __linux__
+      /* Nobody's waiting on the ring, so this thread does */
+      if(io.backend == IO_URING && !io.reaping) {
+        if(io.inflight) {
+          ioRingReap();
+        } else {
+          ioRingSubmit();
+        }
+        continue;
+      }
+#endif
+
+      pthread_cond_wait(&io.changed, &io.lock);
+    }
+    ioDequeue(request);
+    pthread_mutex_unlock(&io.lock);
+  }
+
+  if(!request->failed) {
+    ioChecksum(request, ioReady(request));
+  }
+
+  if((result = !request->failed) && request->write) {
+    STATS_ADD(bytesWritten, request->size);
+  } else if(result) {
+    STATS_ADD(bytesRead, request->size);
+  }
+
+  free(request->done);
+  free(request->pieces);
+  free(request);
+  return result;
+}
@@ -0,0 +1,15 @@
+/* Asynchronous transfer settings */
+#define IO_CHUNK (1 << 20)
+#define IO_DEPTH 16
+#define IO_THREADS 4
+
+/* Backends */
+#define IO_NONE 0
+#define IO_URING 1
+#define IO_THREADED 2
+
+void ioEnable(int enable);
+int ioEnabled(void);
+struct ioRequest *ioStart(int descriptor, unsigned char *buffer, size_t size,
+                          int write, unsigned int *crc);
+int ioFinish(struct ioRequest *request);
@@ -1,7 +1,108 @@
 /* IPS specific functions */
 
 #include "AIPS.h"
+#include "CRC.h"
 #include "IPS.h"
+#include "MAP.h"
+#include "DIFF.h"
+#include "STREAM.h"
+#include "STATS.h"
+#include "SHA.h"
+#include "CACHE.h"
+#include "FORMAT.h"
+
+#include <sys/stat.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define ftruncate(fd, size) _chsize((fd), (long)(size))
+#else
+#include <sys/uio.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Fills part of the file being patched (Or one of IPSPlan's fill
+ * blocks) with a single byte, for RLE records.
+ *
+ * Long runs are written 64 bytes at a time with non-temporal stores
+ * where we have SSE2, so clearing a large region doesn't push the
+ * rest of the file out of the cache.
+ *
+ * @param unsigned char *target Where to fill.
+ * @param unsigned char value The byte to fill with.
+ * @param size_t length How many bytes to fill.
+ */
+static void IPSFill(unsigned char *target, unsigned char value,
+                    size_t length) {
+#ifdef __SSE2__
+  if(length >= IPS_STREAM_STORE) {
+    __m128i fill = _mm_set1_epi8((char)value);
+    size_t head = (16 - ((size_t)target & 15)) & 15;
+
+    memset(target, value, head);
+    target += head;
+    length -= head;
+
+    for(; length >= 64; target += 64, length -= 64) {
+      _mm_stream_si128((__m128i*)target, fill);
+      _mm_stream_si128((__m128i*)(target + 16), fill);
+      _mm_stream_si128((__m128i*)(target + 32), fill);
+      _mm_stream_si128((__m128i*)(target + 48), fill);
+    }
+    _mm_sfence();
+  }
+#endif
+
+  memset(target, value, length);
+}
+
+/**
+ * Copies a record's data into the file being patched.
+ *
+ * Like IPSFill, long records are copied with non-temporal stores
+ * where we have SSE2.
+ *
+ * @param unsigned char *target Where to copy to.
+ * @param const unsigned char *data The record's data.
+ * @param size_t length How many bytes to copy.
+ */
+static void IPSCopy(unsigned char *target, const unsigned char *data,
+                    size_t length) {
+#ifdef __SSE2__
+  if(length >= IPS_STREAM_STORE) {
+    size_t head = (16 - ((size_t)target & 15)) & 15;
+
+    memcpy(target, data, head);
+    target += head;
+    data += head;
+    length -= head;
+
+    for(; length >= 64; target += 64, data += 64, length -= 64) {
+      __m128i a = _mm_loadu_si128((const __m128i*)data);
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + 16));
+      __m128i c = _mm_loadu_si128((const __m128i*)(data + 32));
+      __m128i d = _mm_loadu_si128((const __m128i*)(data + 48));
+
+      _mm_stream_si128((__m128i*)target, a);
+      _mm_stream_si128((__m128i*)(target + 16), b);
+      _mm_stream_si128((__m128i*)(target + 32), c);
+      _mm_stream_si128((__m128i*)(target + 48), d);
+    }
+    _mm_sfence();
+  }
+#endif
+
+  memcpy(target, data, length);
+}
 
 /**
  * Reads a record from the patch file.
@@ -10,30 +111,49 @@
  * filePointer at the given location and writes the results into the
  * patchData struct supplied.
  *
+ * The record's data is read into a scratch buffer that's reused for
+ * every record, so nothing is allocated per record.
+ *
+ * A stream can't be read ahead, so the end of file marker always
+ * ends the patch here, even where it could be a record's offset.
+ *
  * @param struct *patchData A pointer to a patchData struct that the
  * information will be written to.
  * @param FILE *filePointer a pointer to the patch file being read.
+ * @param unsigned char *scratch Where to put the data, which must
+ * hold IPS_MAX_SIZE bytes. (The data is only good until the next
+ * record is read)
+ * @param int wide Nonzero for an IPS32 patch.
  *
- * @return int: 1 if successful, 0 otherwise.
+ * @return int: 1 if a record was read, 0 at the end of the patch, and
+ * -1 if the record is cut short.
  */
-int IPSReadRecord(struct patchData *patch, FILE *filePointer) {
-  unsigned char offset[3], size[2];
+int IPSReadRecord(struct patchData *patch, FILE *filePointer,
+                  unsigned char *scratch, int wide) {
+  unsigned char offset[4], size[2];
+  size_t width = wide ? 4 : 3;
 
-  if(fread(&offset, BYTE, 3, filePointer) &&
-     fread(&size, BYTE, 2, filePointer)) {
-      /* Fix linear reads */
-      patch->size = BYTE2_TO_UINT(size);
-      patch->offset = BYTE3_TO_UINT(offset);
+  if(fread(offset, BYTE, width, filePointer) != width ||
+     memcmp(offset, wide ? "EEOF" : "EOF", width) == 0) {
+    return 0;
+  }
 
-      if(patch->size == 0) {
-        return IPSReadRLE(patch, filePointer);
-      }
+  if(fread(size, BYTE, 2, filePointer) != 2) {
+    return -1;
+  }
 
-      patch->data = (char*)malloc(patch->size + 1);
-      return fread(patch->data, BYTE, patch->size, filePointer);
-    }
+  /* Fix linear reads */
+  patch->size = BYTE2_TO_UINT(size);
+  patch->offset = wide ? BYTE4_TO_UINT(offset) : BYTE3_TO_UINT(offset);
+  patch->rle = (patch->size == 0);
+  patch->data = (char*)scratch;
 
-  return 0;
+  if(patch->size == 0) {
+    return IPSReadRLE(patch, filePointer) ? 1 : -1;
+  }
+
+  return fread(patch->data, BYTE, patch->size, filePointer) == patch->size ?
+         1 : -1;
 }
 
 /**
@@ -45,122 +165,1633 @@ int IPSReadRecord(struct patchData *patch, FILE *filePointer) {
  * immediately succeeding this number is the patch character itself...
  *
  * @param struct patchData *patch A patch struct pointer holding the
- * offset, the size, and the data...
+ * offset, the size, and the scratch buffer to fill from IPSReadRecord.
  * @param FILE *filePointer a file pointer to the current location in
  * the patch file.
  *
  * @return Returns 1 on success, 0 on failure.
  */
 int IPSReadRLE(struct patchData *patch, FILE *filePointer) {
-  char size[2];
-
-  if(fread(&size, BYTE, 2, filePointer)) {
-      unsigned int count;
-      char data = '\0';
+  unsigned char size[3];
 
-      patch->size = BYTE2_TO_UINT(size);
-
-      if(!fread(&data, BYTE, 1, filePointer)){
-        return 0;
-      }
+  if(fread(size, BYTE, 3, filePointer) == 3) {
+    patch->size = BYTE2_TO_UINT(size);
+    IPSFill((unsigned char*)patch->data, size[2], patch->size);
+    return 1;
+  }
 
-      patch->data = (char*)malloc((patch->size * sizeof(char)) + 1);
-      for(count = 0; count < patch->size; count++) {
-        patch->data[count] = (char)data;
-      }
+  return 0;
+}
 
-      return 1;
-    }
+/**
+ * Checks that a patch in memory is an IPS or IPS32 patch.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ *
+ * @return int How many bytes its record offsets take: 3 for IPS, 4
+ * for IPS32, or 0 if it's neither.
+ */
+int IPSOffsetSize(const unsigned char *patch, size_t patchSize) {
+  if(patchSize >= 5 && memcmp(patch, "PATCH", 5) == 0) {
+    return 3;
+  } else if(patchSize >= 5 && memcmp(patch, "IPS32", 5) == 0) {
+    return 4;
+  }
 
   return 0;
 }
 
+/**
+ * Works out whether an IPS patch ends at the given position.
+ *
+ * The end of file marker ("EOF", or "EEOF" for IPS32) is also a
+ * valid record offset, so it only ends the patch when it's the last
+ * thing in it, when it's followed by nothing but a truncation size,
+ * or when what follows can't be a whole record. Otherwise, it's a
+ * record at that offset.
+ *
+ * @param const unsigned char *patch The whole patch file, which has
+ * already been checked with IPSOffsetSize.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param size_t position Where the next record would start.
+ * @param size_t *truncate Where to store the size the patched file
+ * is cut to, if the patch has one.
+ *
+ * @return int 0 if there's a record here, 1 if the patch ends here,
+ * and 2 if it ends with a truncation size.
+ */
+static int IPSEnd(const unsigned char *patch, size_t patchSize,
+                  size_t position, size_t *truncate) {
+  size_t width = patch[0] == 'I' ? 4 : 3, left = patchSize - position;
+  const unsigned char *current = patch + position;
+  size_t size;
+
+  if(left < width) {
+    return 1;
+  }
+
+  if(memcmp(current, width == 4 ? "EEOF" : "EOF", width) != 0) {
+    return 0;
+  }
+
+  if(left == width) {
+    return 1;
+  }
+
+  if(left == width * 2) {
+    *truncate = width == 4 ? BYTE4_TO_UINT(current + width) :
+                BYTE3_TO_UINT(current + width);
+    return 2;
+  }
+
+  if(left < width + 2) {
+    return 1;
+  }
+
+  /* A record needs its data, or for RLE, a length and a fill byte */
+  size = BYTE2_TO_UINT(current + width);
+  return left - width - 2 < (size ? size : 3);
+}
 
 /**
- * Checks that an IPS file has the correct header
+ * Reads the record at the given position of an IPS patch in memory.
  *
- * Checks that the next 5 bytes (In an IPS file, the first 5 bytes are
- * where the header is present) say "PATCH".
+ * Nothing is copied; for normal records the data pointer points
+ * straight into the patch, and for RLE records it points at the
+ * single fill byte with the rle flag set.
  *
- * @param FILE *filePointer the pointer to the IPS patch file.
+ * @param const unsigned char *patch The whole patch file, header
+ * included. (IPS or IPS32, see IPSOffsetSize)
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param size_t *position The offset of the record to read, which is
+ * moved past the record on success.
+ * @param struct patchData *record The struct to describe the record
+ * in.
  *
- * @returns int 1 on a valid PATCH header, 0 otherwise.
+ * @return int 1 if a record was read, 0 at the end of the patch, and
+ * -1 if the record is cut short.
  */
-int IPSCheckPatch(FILE *filePointer, int verbose) {
-  char buffer[6];
-  if(fread(buffer, BYTE, 5, filePointer) == 0) {
+int IPSNextRecord(const unsigned char *patch, size_t patchSize,
+                  size_t *position, struct patchData *record) {
+  const unsigned char *current = patch + *position;
+  size_t left = patchSize - *position, width = patch[0] == 'I' ? 4 : 3;
+  size_t truncate;
+
+  if(IPSEnd(patch, patchSize, *position, &truncate)) {
     return 0;
   }
 
-  buffer[5] = '\0';
+  if(left < width + 2) {
+    return -1;
+  }
 
-  /* Valid patch header? */
-  if(strcmp(buffer, "PATCH") == 0) {
-    if(verbose) {
-      printf("This appears to be a valid IPS patch file...\n");
+  record->offset = width == 4 ? BYTE4_TO_UINT(current) :
+                   BYTE3_TO_UINT(current);
+  record->size = BYTE2_TO_UINT(current + width);
+  record->rle = (record->size == 0);
+  current += width + 2;
+  left -= width + 2;
+
+  if(record->rle) {
+    if(left < 3) {
+      return -1;
     }
-    return 1;
+
+    record->size = BYTE2_TO_UINT(current);
+    record->data = (char*)(current + 2);
+    *position += width + 5;
+  } else {
+    if(left < record->size) {
+      return -1;
+    }
+
+    record->data = (char*)current;
+    *position += width + 2 + record->size;
   }
 
-  return 0;
+  /* Only possible with IPS32 where size_t is 32 bits */
+  if((size_t)record->offset + record->size < record->offset) {
+    return -1;
+  }
+
+  return 1;
 }
 
 /**
- * Patches a file using an IPS file
+ * Allocates the arrays of an index for a number of records, in one
+ * block.
+ */
+static int IPSIndexAlloc(struct ipsIndex *index, size_t count) {
+  size_t words = count * sizeof(unsigned int);
+
+  index->count = count;
+  index->offset = (unsigned int*)malloc(words * 3 + count + 1);
+  if(!index->offset) {
+    return 0;
+  }
+
+  index->length = index->offset + count;
+  index->payload = index->length + count;
+  index->rle = (unsigned char*)(index->payload + count);
+  return 1;
+}
+
+/**
+ * Frees an index from IPSIndexBuild or IPSIndexLoad.
  *
- * This function will attempt to patch a file specified in it's
- * parameters with the patch file also specified in it's parameters
- * according to the flags set.
+ * @param struct ipsIndex *index The index to free.
+ */
+void IPSIndexFree(struct ipsIndex *index) {
+  free(index->offset);
+  index->offset = index->length = index->payload = NULL;
+  index->rle = NULL;
+  index->count = index->size = index->truncate = 0;
+  index->truncated = 0;
+}
+
+/**
+ * Parses and checks a whole IPS patch into an index.
  *
- * @param struct pStruct *params A pointer to a parameter struct that
- * contains the files and parameters in which to patch the file.
+ * The patch is walked once to validate and count the records, then
+ * again to fill in the arrays, so a patch that's cut short is caught
+ * before anything gets written.
  *
- * @return Returns 1 on success or 0 on failure.
+ * @param const unsigned char *patch The whole patch file, header
+ * included.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param struct ipsIndex *index The index to fill in. Its size is the
+ * smallest file that can hold every record, and the truncation size
+ * (If any) is read from after the end of file marker.
+ *
+ * @return int 1 on success, 0 if the patch is damaged or we ran out
+ * of memory.
  */
-int IPSPatchFile(struct pStruct *params) {
-  struct patchData patch = {0, 0, NULL};
+int IPSIndexBuild(const unsigned char *patch, size_t patchSize,
+                  struct ipsIndex *index) {
+  struct patchData record = {0, 0, NULL, 0};
+  size_t position = 5, count = 0, i;
+  int status;
 
-  while(IPSReadRecord(&patch, params->patchFile)) {
-    if((params->flags & ARG_VERYVERBOSE)) {
+  index->offset = NULL;
+  index->size = index->truncate = 0;
+  while((status = IPSNextRecord(patch, patchSize, &position, &record)) > 0) {
+    if((size_t)record.offset + record.size > index->size) {
+      index->size = (size_t)record.offset + record.size;
+    }
+    count++;
+  }
+
+  index->truncated = status == 0 &&
+                     IPSEnd(patch, patchSize, position, &index->truncate) == 2;
+
+  if(status < 0) {
+    index->count = 0;
+    return AIPSError(ERR_MEDIUM, "This IPS patch is cut short: record %lu,"
+                     " at byte %lu of the patch, runs past the end of it.",
+                     (unsigned long)count + 1, (unsigned long)position);
+  }
+
+  if(!IPSIndexAlloc(index, count)) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  for(i = 0, position = 5; i < count; i++) {
+    IPSNextRecord(patch, patchSize, &position, &record);
+    index->offset[i] = record.offset;
+    index->length[i] = record.size;
+    index->payload[i] = (unsigned int)((unsigned char*)record.data - patch);
+    index->rle[i] = (unsigned char)record.rle;
+  }
+
+  return 1;
+}
+
+/**
+ * Applies an indexed IPS patch to a file in memory.
+ *
+ * Every record is still bounds checked, so a stale index can't write
+ * or read anywhere it shouldn't.
+ *
+ * @param const struct ipsIndex *index The index of the patch.
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param unsigned char *target The data to patch, which must be at
+ * least index->size bytes.
+ * @param size_t targetSize The size of the data to patch.
+ * @param int verbose Print out each record as it's applied.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSIndexApply(const struct ipsIndex *index, const unsigned char *patch,
+                  size_t patchSize, unsigned char *target, size_t targetSize,
+                  int verbose) {
+  size_t i;
+
+  for(i = 0; i < index->count; i++) {
+    size_t offset = index->offset[i], length = index->length[i];
+    size_t payload = index->payload[i];
+
+    if(offset + length > targetSize ||
+       payload + (index->rle[i] ? 1 : length) > patchSize) {
+      return 0;
+    }
+
+    if(verbose) {
       printf("Applied patch. Offset: Byte %d size: %d bytes\n",
-             (unsigned int)patch.offset,
-             (unsigned int)patch.size);
+             (unsigned int)offset, (unsigned int)length);
     }
 
-    fseek(params->romFile, patch.offset, SEEK_SET);
-    fwrite(patch.data, patch.size, 1, params->romFile);
-    free(patch.data);
+    if(index->rle[i]) {
+      IPSFill(target + offset, patch[payload], length);
+    } else {
+      IPSCopy(target + offset, patch + payload, length);
+    }
   }
 
-  return 0;
+  return 1;
 }
 
 /**
- * Creates a patch file with the passed in pStruct
+ * Works out what a saved index of a patch is checked against. This
+ * is cheap next to parsing the patch: a stat, and a CRC of each end.
  *
- * This function creates an IPS patch file
+ * @param struct ipsStamp *stamp The stamp to fill in.
+ * @param FILE *file The patch file, or NULL to leave out which file it
+ * is. (For the cache, where the contents are all that matter)
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
  */
-int IPSCreatePatch(struct pStruct *params) {
-  rewind(params->patchFile);
-  fwrite("PATCH", 1, sizeof("PATCH"), params->patchFile);
+void IPSIndexStamp(struct ipsStamp *stamp, FILE *file,
+                   const unsigned char *patch, size_t patchSize) {
+  size_t head = patchSize < IPS_INDEX_SAMPLE * 2 ? patchSize :
+                IPS_INDEX_SAMPLE;
+  struct stat info;
 
-  fwrite("EOF", 1, sizeof("EOF"), params->patchFile);
-  return 0;
+  stamp->size = patchSize;
+  stamp->inode = 0;
+  stamp->modified = 0;
+  if(file && fstat(fileno(file), &info) == 0) {
+    stamp->inode = (unsigned long long)info.st_ino;
+    stamp->modified = (long long)info.st_mtime;
+  }
+
+  stamp->sample = crcBuffer(0, patch, head);
+  if(head < patchSize) {
+    stamp->sample = crcBuffer(stamp->sample, patch + patchSize -
+                              IPS_INDEX_SAMPLE, IPS_INDEX_SAMPLE);
+  }
 }
 
+/**
+ * Packs an index into a single buffer, to save or cache it.
+ *
+ * The patch's stamp is packed with it, so it's only used while the
+ * patch is unchanged, and the arrays are stored little endian.
+ *
+ * @param const struct ipsIndex *index The index to pack.
+ * @param const struct ipsStamp *stamp The stamp of the patch it was
+ * built from.
+ * @param size_t *size Where to store the size of the buffer.
+ *
+ * @return unsigned char* The packed index, (Free it when done) or
+ * NULL if we ran out of memory.
+ */
+unsigned char *IPSIndexPack(const struct ipsIndex *index,
+                            const struct ipsStamp *stamp, size_t *size) {
+  size_t total = IPS_INDEX_HEADER + index->count * 13, i;
+  unsigned char *buffer = (unsigned char*)malloc(total), *out;
+
+  if(!buffer) {
+    return NULL;
+  }
+
+  memcpy(buffer, IPS_INDEX_MAGIC, 8);
+  UINT_TO_BYTE4_LE(buffer + 8, (unsigned int)stamp->size);
+  UINT_TO_BYTE4_LE(buffer + 12, (unsigned int)(stamp->size >> 16 >> 16));
+  UINT_TO_BYTE4_LE(buffer + 16, (unsigned int)stamp->inode);
+  UINT_TO_BYTE4_LE(buffer + 20, (unsigned int)(stamp->inode >> 32));
+  UINT_TO_BYTE4_LE(buffer + 24, (unsigned int)stamp->modified);
+  UINT_TO_BYTE4_LE(buffer + 28,
+                   (unsigned int)((unsigned long long)stamp->modified >> 32));
+  UINT_TO_BYTE4_LE(buffer + 32, stamp->sample);
+  UINT_TO_BYTE4_LE(buffer + 36, (unsigned int)index->count);
+  UINT_TO_BYTE4_LE(buffer + 40, (unsigned int)index->truncated);
+  UINT_TO_BYTE4_LE(buffer + 44, (unsigned int)index->size);
+  UINT_TO_BYTE4_LE(buffer + 48, (unsigned int)(index->size >> 16 >> 16));
+  UINT_TO_BYTE4_LE(buffer + 52, (unsigned int)index->truncate);
+  UINT_TO_BYTE4_LE(buffer + 56, (unsigned int)(index->truncate >> 16 >> 16));
+  UINT_TO_BYTE4_LE(buffer + 60, 0);
 
-int IPSWriteRecord(struct patchData *patch, FILE *filePointer) {
-  fwrite(&patch->offset, 3, 1, filePointer);
-  fwrite(&patch->size, 2, 1, filePointer);
-  fwrite(&patch->data, sizeof(patch->data), 1, filePointer);
-  return 0;
+  out = buffer + IPS_INDEX_HEADER;
+  for(i = 0; i < index->count; i++, out += 4) {
+    UINT_TO_BYTE4_LE(out, index->offset[i]);
+  }
+  for(i = 0; i < index->count; i++, out += 4) {
+    UINT_TO_BYTE4_LE(out, index->length[i]);
+  }
+  for(i = 0; i < index->count; i++, out += 4) {
+    UINT_TO_BYTE4_LE(out, index->payload[i]);
+  }
+  if(index->count) {
+    memcpy(out, index->rle, index->count);
+  }
+
+  *size = total;
+  return buffer;
 }
 
+/**
+ * Unpacks an index packed with IPSIndexPack.
+ *
+ * @param struct ipsIndex *index The index to fill in.
+ * @param const unsigned char *buffer The packed index.
+ * @param size_t size The size of the buffer.
+ * @param const struct ipsStamp *stamp The stamp of the patch now.
+ *
+ * @return int 1 if the index was unpacked, 0 if it's damaged, or was
+ * made from a different version of the patch.
+ */
+int IPSIndexUnpack(struct ipsIndex *index, const unsigned char *buffer,
+                   size_t size, const struct ipsStamp *stamp) {
+  const unsigned char *in = buffer + IPS_INDEX_HEADER;
+  size_t count, i;
 
-int IPSWriteRLE(struct patchData *patch, FILE *filePointer) {
-  ASSERT(&patch->offset == 0, "RLE writing occurring without offset of 0.");
-  fwrite(&patch->offset, 2, 1, filePointer); /* Offset should be 0 */
-  fwrite(&patch->size, 2, 1, filePointer);
-  fwrite(&patch->data, 1, 1, filePointer);
-  return 0;
+  if(size < IPS_INDEX_HEADER ||
+     memcmp(buffer, IPS_INDEX_MAGIC, 8) != 0 ||
+     BYTE4_TO_UINT_LE(buffer + 8) != (unsigned int)stamp->size ||
+     BYTE4_TO_UINT_LE(buffer + 12) != (unsigned int)(stamp->size >> 16 >> 16) ||
+     BYTE4_TO_UINT_LE(buffer + 16) != (unsigned int)stamp->inode ||
+     BYTE4_TO_UINT_LE(buffer + 20) != (unsigned int)(stamp->inode >> 32) ||
+     BYTE4_TO_UINT_LE(buffer + 24) != (unsigned int)stamp->modified ||
+     BYTE4_TO_UINT_LE(buffer + 28) !=
+     (unsigned int)((unsigned long long)stamp->modified >> 32) ||
+     BYTE4_TO_UINT_LE(buffer + 32) != stamp->sample) {
+    return 0;
+  }
+
+  count = BYTE4_TO_UINT_LE(buffer + 36);
+  if(count > stamp->size / 5 || size - IPS_INDEX_HEADER != count * 13 ||
+     !IPSIndexAlloc(index, count)) {
+    return 0;
+  }
+
+  index->truncated = BYTE4_TO_UINT_LE(buffer + 40) != 0;
+  index->size = (size_t)BYTE4_TO_UINT_LE(buffer + 48) << 16 << 16 |
+                BYTE4_TO_UINT_LE(buffer + 44);
+  index->truncate = (size_t)BYTE4_TO_UINT_LE(buffer + 56) << 16 << 16 |
+                    BYTE4_TO_UINT_LE(buffer + 52);
+  for(i = 0; i < count; i++, in += 4) {
+    index->offset[i] = BYTE4_TO_UINT_LE(in);
+  }
+  for(i = 0; i < count; i++, in += 4) {
+    index->length[i] = BYTE4_TO_UINT_LE(in);
+  }
+  for(i = 0; i < count; i++, in += 4) {
+    index->payload[i] = BYTE4_TO_UINT_LE(in);
+  }
+  memcpy(index->rle, in, count);
+
+  return 1;
+}
+
+/**
+ * Saves an index as a sidecar file, so later applies of the same
+ * patch don't have to parse it. (See IPSIndexPack)
+ *
+ * @param const struct ipsIndex *index The index to save.
+ * @param const char *path Where to save it.
+ * @param const struct ipsStamp *stamp The stamp of the patch it was
+ * built from.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSIndexSave(const struct ipsIndex *index, const char *path,
+                 const struct ipsStamp *stamp) {
+  size_t total;
+  unsigned char *buffer = IPSIndexPack(index, stamp, &total);
+  FILE *file;
+  int result;
+
+  if(!buffer) {
+    return 0;
+  }
+
+  if(!(file = fopen(path, "wb"))) {
+    free(buffer);
+    return 0;
+  }
+
+  result = fwrite(buffer, BYTE, total, file) == total;
+  result = (fclose(file) == 0) && result;
+  free(buffer);
+  return result;
+}
+
+/**
+ * Loads a sidecar index saved with IPSIndexSave.
+ *
+ * @param struct ipsIndex *index The index to fill in.
+ * @param const char *path The sidecar file.
+ * @param const struct ipsStamp *stamp The stamp of the patch now.
+ *
+ * @return int 1 if the index was loaded, 0 if it's missing, damaged,
+ * or was made from a different version of the patch.
+ */
+int IPSIndexLoad(struct ipsIndex *index, const char *path,
+                 const struct ipsStamp *stamp) {
+  unsigned char *buffer;
+  size_t size;
+  long length;
+  FILE *file;
+  int result;
+
+  if(!(file = fopen(path, "rb"))) {
+    return 0;
+  }
+
+  if(fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0 ||
+     (size = (size_t)length) > IPS_INDEX_HEADER + stamp->size / 5 * 13 ||
+     !(buffer = (unsigned char*)malloc(size + 1))) {
+    fclose(file);
+    return 0;
+  }
+
+  rewind(file);
+  result = fread(buffer, BYTE, size, file) == size &&
+           IPSIndexUnpack(index, buffer, size, stamp);
+  fclose(file);
+  free(buffer);
+  return result;
+}
+
+/**
+ * Gets the index of a patch, either from its sidecar file, from the
+ * cache, or by parsing it.
+ *
+ * With --index, a freshly parsed index is also saved next to the
+ * patch for next time, and is only used while the patch's stamp (See
+ * IPSIndexStamp) still matches. With --cache, it's filed under the
+ * patch's contents, so the same patch under any name can use it.
+ */
+static int IPSIndexFind(struct pStruct *params, const struct mappedFile *patch,
+                        struct ipsIndex *index) {
+  struct ipsStamp stamp, contents;
+  struct cacheKey key;
+  unsigned char *packed;
+  size_t packedSize;
+  char *path = NULL;
+  int found;
+
+  if((params->flags & ARG_INDEX) && params->patchPath && !params->stream &&
+     (path = (char*)malloc(strlen(params->patchPath) +
+                           sizeof(IPS_INDEX_EXTENSION)))) {
+    strcpy(path, params->patchPath);
+    strcat(path, IPS_INDEX_EXTENSION);
+  }
+
+  IPSIndexStamp(&stamp, patch->file, patch->data, patch->size);
+  if(path && IPSIndexLoad(index, path, &stamp)) {
+    if(params->flags & ARG_VERBOSE) {
+      printf("Using the saved index: %s\n", path);
+    }
+    free(path);
+    return 1;
+  }
+
+  /* Cache entries are found by contents, whichever file they're in */
+  contents = stamp;
+  contents.inode = 0;
+  contents.modified = 0;
+  if(cacheEnabled()) {
+    cacheKeyFile(&key, CACHE_INDEX, patch->file, patch->data, patch->size);
+    if(cacheGet(&key, &packed, &packedSize)) {
+      found = IPSIndexUnpack(index, packed, packedSize, &contents);
+      free(packed);
+      if(found) {
+        if(params->flags & ARG_VERBOSE) {
+          printf("Using the cached index of this patch.\n");
+        }
+        free(path);
+        return 1;
+      }
+    }
+  }
+
+  if(!IPSIndexBuild(patch->data, patch->size, index)) {
+    free(path);
+    return 0;
+  }
+
+  if(path && !IPSIndexSave(index, path, &stamp)) {
+    AIPSError(ERR_MINOR, "Couldn't save the patch index to %s.", path);
+  }
+
+  if(cacheEnabled() &&
+     (packed = IPSIndexPack(index, &contents, &packedSize))) {
+    if(!cachePut(&key, packed, packedSize)) {
+      AIPSError(ERR_MINOR, "Couldn't save the patch index to the cache.");
+    }
+    free(packed);
+  }
+
+  free(path);
+  return 1;
+}
+
+/* A record's place in the file, for sorting */
+struct ipsExtent {
+  size_t start;
+  size_t end;
+  size_t record;
+};
+
+static int IPSExtentCompare(const void *a, const void *b) {
+  const struct ipsExtent *left = (const struct ipsExtent*)a;
+  const struct ipsExtent *right = (const struct ipsExtent*)b;
+
+  if(left->start != right->start) {
+    return left->start < right->start ? -1 : 1;
+  }
+  return left->record < right->record ? -1 : left->record > right->record;
+}
+
+static int IPSOffsetCompare(const void *a, const void *b) {
+  size_t left = *(const size_t*)a, right = *(const size_t*)b;
+
+  return left < right ? -1 : left > right;
+}
+
+/**
+ * Pushes a record onto a max-heap of records, by record number.
+ */
+static void IPSHeapPush(size_t *heap, size_t *count, size_t record) {
+  size_t i = (*count)++;
+
+  while(i > 0 && heap[(i - 1) / 2] < record) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = record;
+}
+
+/**
+ * Pops the highest record number off a max-heap of records.
+ */
+static void IPSHeapPop(size_t *heap, size_t *count) {
+  size_t last = heap[--(*count)], i = 0;
+
+  while(i * 2 + 1 < *count) {
+    size_t child = i * 2 + 1;
+
+    if(child + 1 < *count && heap[child + 1] > heap[child]) {
+      child++;
+    }
+    if(heap[child] <= last) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}
+
+/**
+ * Works out the fewest writes that give the same file as applying
+ * every record in order.
+ *
+ * Records are sorted by offset and swept from the start of the file
+ * to the end. Between any two record edges, the record that's written
+ * is the last one in the patch that covers that stretch, (Found with
+ * a heap of the records covering it) so anything a later record
+ * overwrites is never written at all. Neighbouring stretches from the
+ * same record are joined back together, and runs of spans that touch
+ * are counted as a single write. Anything past a truncation size is
+ * dropped.
+ *
+ * @param const struct ipsIndex *index The index of the patch.
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param struct ipsPlan *plan The plan to fill in.
+ * @param int verbose Print out each record as it's planned.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSPlan(const struct ipsIndex *index, const unsigned char *patch,
+            size_t patchSize, struct ipsPlan *plan, int verbose) {
+  struct ipsExtent *extents;
+  size_t *points, *heap;
+  size_t count = 0, pointCount = 0, heapCount = 0, next = 0, i;
+  size_t longest[256] = {0};
+
+  memset(plan, 0, sizeof(*plan));
+  plan->size = index->truncated ? index->truncate : index->size;
+  plan->truncated = index->truncated;
+
+  extents = (struct ipsExtent*)malloc((index->count + 1) *
+                                      sizeof(struct ipsExtent));
+  points = (size_t*)malloc((index->count * 2 + 1) * sizeof(size_t));
+  heap = (size_t*)malloc((index->count + 1) * sizeof(size_t));
+  plan->spans = (struct ipsSpan*)malloc((index->count * 2 + 1) *
+                                        sizeof(struct ipsSpan));
+  if(!extents || !points || !heap || !plan->spans) {
+    free(extents);
+    free(points);
+    free(heap);
+    IPSPlanFree(plan);
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  for(i = 0; i < index->count; i++) {
+    size_t length = index->length[i];
+
+    if(index->payload[i] + (index->rle[i] ? 1 : length) > patchSize) {
+      free(extents);
+      free(points);
+      free(heap);
+      IPSPlanFree(plan);
+      return AIPSError(ERR_MEDIUM, "The patch index doesn't match this patch.");
+    }
+
+    if(verbose) {
+      printf("Applied patch. Offset: Byte %d size: %d bytes\n",
+             (unsigned int)index->offset[i], (unsigned int)length);
+    }
+
+    /* Fill blocks only need to be as long as their longest run */
+    if(index->rle[i] && length > longest[patch[index->payload[i]]]) {
+      longest[patch[index->payload[i]]] = length;
+    }
+
+    if(length) {
+      extents[count].start = index->offset[i];
+      extents[count].end = index->offset[i] + length;
+      extents[count].record = i;
+      points[pointCount++] = extents[count].start;
+      points[pointCount++] = extents[count].end;
+      count++;
+    }
+  }
+
+  qsort(extents, count, sizeof(struct ipsExtent), IPSExtentCompare);
+  qsort(points, pointCount, sizeof(size_t), IPSOffsetCompare);
+
+  for(i = 0; i + 1 < pointCount; i++) {
+    size_t from = points[i], to = points[i + 1], record;
+    struct ipsSpan *last = plan->count ? &plan->spans[plan->count - 1] : NULL;
+    const unsigned char *data;
+
+    if(from >= plan->size) {
+      break;
+    } else if(to > plan->size) {
+      to = plan->size;
+    }
+
+    while(next < count && extents[next].start == from) {
+      IPSHeapPush(heap, &heapCount, extents[next++].record);
+    }
+
+    /* Records that ended before here are only dropped once they're on top */
+    while(heapCount && (size_t)index->offset[heap[0]] +
+          index->length[heap[0]] <= from) {
+      IPSHeapPop(heap, &heapCount);
+    }
+
+    if(from == to || !heapCount) {
+      continue;
+    }
+
+    record = heap[0];
+    if(index->rle[record]) {
+      unsigned char value = patch[index->payload[record]];
+
+      if(!plan->fill[value]) {
+        if(!(plan->fill[value] = (unsigned char*)malloc(longest[value]))) {
+          free(extents);
+          free(points);
+          free(heap);
+          IPSPlanFree(plan);
+          return AIPSError(ERR_MEDIUM, "Out of memory!");
+        }
+        /* Long fills are only read back by pwritev, not by us */
+        IPSFill(plan->fill[value], value, longest[value]);
+      }
+      data = plan->fill[value];
+    } else {
+      data = patch + index->payload[record] + (from - index->offset[record]);
+    }
+
+    if(last && last->offset + last->length == from &&
+       last->data + last->length == data) {
+      last->length += to - from;
+      continue;
+    }
+
+    if(!last || last->offset + last->length != from) {
+      plan->writes++;
+    }
+
+    plan->spans[plan->count].offset = from;
+    plan->spans[plan->count].length = to - from;
+    plan->spans[plan->count].data = data;
+    plan->count++;
+  }
+
+  free(extents);
+  free(points);
+  free(heap);
+  return 1;
+}
+
+/**
+ * Frees the spans and fill blocks of a plan.
+ *
+ * @param struct ipsPlan *plan The plan to free.
+ */
+void IPSPlanFree(struct ipsPlan *plan) {
+  int i;
+
+  for(i = 0; i < 256; i++) {
+    free(plan->fill[i]);
+    plan->fill[i] = NULL;
+  }
+
+  free(plan->spans);
+  plan->spans = NULL;
+  plan->count = plan->writes = 0;
+}
+
+#ifndef _WIN32
+/**
+ * Checks whether a span is an RLE fill of zeros that starts past the
+ * end of the file, which doesn't need writing once the file is grown.
+ */
+static int IPSPlanZeroed(const struct ipsPlan *plan, size_t span,
+                         size_t fileSize) {
+  return plan->fill[0] && plan->spans[span].data == plan->fill[0] &&
+         plan->spans[span].offset >= fileSize;
+}
+#endif
+
+/**
+ * Moves every span of a plan along, to leave a copier header in front
+ * of the patched file alone.
+ *
+ * @param struct ipsPlan *plan The plan from IPSPlan.
+ * @param size_t header The size of the header.
+ */
+static void IPSPlanShift(struct ipsPlan *plan, size_t header) {
+  size_t i;
+
+  for(i = 0; i < plan->count; i++) {
+    plan->spans[i].offset += header;
+  }
+  plan->size += header;
+}
+
+/**
+ * Writes a planned patch to a file, in file order.
+ *
+ * Spans that touch are written together with pwritev, (Where we have
+ * it) and the file is grown first if the patch runs past its end,
+ * or cut to size if the patch truncates it. Zero fills past the old
+ * end of the file are skipped, since growing the file leaves them
+ * zero anyway. (Often padding a ROM out to a larger size)
+ *
+ * @param const struct ipsPlan *plan The plan from IPSPlan.
+ * @param FILE *file The file to patch.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSPlanWrite(const struct ipsPlan *plan, FILE *file) {
+  size_t i = 0;
+
+#ifndef _WIN32
+  struct iovec vectors[IOV_MAX];
+  struct stat info;
+  int descriptor = fileno(file), resize;
+
+  fflush(file);
+  if(fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return 0;
+  }
+
+  resize = (size_t)info.st_size < plan->size ||
+           (plan->truncated && (size_t)info.st_size != plan->size);
+  if(resize && ftruncate(descriptor, (off_t)plan->size) != 0) {
+    return 0;
+  }
+  STATS_ADD(syscalls, resize ? 2 : 1);
+
+  while(i < plan->count) {
+    size_t offset = plan->spans[i].offset, total = 0;
+    int count = 0;
+
+    /* Growing the file zeroed everything past its old end already */
+    if(IPSPlanZeroed(plan, i, (size_t)info.st_size)) {
+      i++;
+      continue;
+    }
+
+    do {
+      vectors[count].iov_base = (void*)plan->spans[i].data;
+      vectors[count].iov_len = plan->spans[i].length;
+      total += plan->spans[i++].length;
+      count++;
+    } while(i < plan->count && count < IOV_MAX &&
+            plan->spans[i].offset == offset + total &&
+            !IPSPlanZeroed(plan, i, (size_t)info.st_size));
+
+    while(total) {
+      ssize_t written = pwritev(descriptor, vectors, count, (off_t)offset);
+      struct iovec *vector = vectors;
+
+      STATS_ADD(syscalls, 1);
+      if(written <= 0) {
+        return 0;
+      }
+      STATS_ADD(bytesWritten, written);
+
+      /* Pick up where a short write left off */
+      offset += (size_t)written;
+      total -= (size_t)written;
+      while(written && (size_t)written >= vector->iov_len) {
+        written -= (ssize_t)vector->iov_len;
+        vector++;
+        count--;
+      }
+      if(count) {
+        vector->iov_base = (char*)vector->iov_base + written;
+        vector->iov_len -= (size_t)written;
+        memmove(vectors, vector, count * sizeof(struct iovec));
+      }
+    }
+  }
+
+  return 1;
+#else
+  for(; i < plan->count; i++) {
+    if((i == 0 || plan->spans[i].offset != plan->spans[i - 1].offset +
+        plan->spans[i - 1].length) &&
+       fseek(file, (long)plan->spans[i].offset, SEEK_SET) != 0) {
+      return 0;
+    }
+
+    if(fwrite(plan->spans[i].data, BYTE, plan->spans[i].length, file) !=
+       plan->spans[i].length) {
+      return 0;
+    }
+  }
+
+  return fflush(file) == 0 &&
+         (!plan->truncated || ftruncate(fileno(file), plan->size) == 0);
+#endif
+}
+
+/**
+ * Writes a stretch of zeros to a stream, from a zeroed block of
+ * IPS_STREAM_BLOCK bytes.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int IPSStreamZeros(FILE *out, const unsigned char *zeros,
+                          size_t length) {
+  while(length) {
+    size_t gap = length < IPS_STREAM_BLOCK ? length : IPS_STREAM_BLOCK;
+
+    if(fwrite(zeros, BYTE, gap, out) != gap) {
+      return 0;
+    }
+    length -= gap;
+  }
+
+  return 1;
+}
+
+/**
+ * Patches a file that can only be read once, writing the patched
+ * file out as it goes.
+ *
+ * As the plan is in file order, each block of the file only needs
+ * the spans that land in it copied over it before it's written out.
+ * Whatever the patch adds past the end of the file is written after,
+ * and a truncated plan stops reading the file at its size.
+ *
+ * @param const struct ipsPlan *plan The plan from IPSPlan.
+ * @param FILE *in The file to patch.
+ * @param FILE *out Where to write the patched file.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSPlanStream(const struct ipsPlan *plan, FILE *in, FILE *out) {
+  unsigned char *buffer = (unsigned char*)malloc(IPS_STREAM_BLOCK);
+  size_t position = 0, span = 0, read, end, i;
+
+  if(!buffer) {
+    return 0;
+  }
+
+  while((!plan->truncated || position < plan->size) &&
+        (read = fread(buffer, BYTE, IPS_STREAM_BLOCK, in)) > 0) {
+    if(plan->truncated && read > plan->size - position) {
+      read = plan->size - position;
+    }
+    end = position + read;
+
+    for(i = span; i < plan->count && plan->spans[i].offset < end; i++) {
+      const struct ipsSpan *current = &plan->spans[i];
+      size_t from = current->offset > position ? current->offset : position;
+      size_t to = current->offset + current->length < end ?
+                  current->offset + current->length : end;
+
+      memcpy(buffer + (from - position), current->data +
+             (from - current->offset), to - from);
+    }
+
+    while(span < plan->count &&
+          plan->spans[span].offset + plan->spans[span].length <= end) {
+      span++;
+    }
+
+    if(fwrite(buffer, BYTE, read, out) != read) {
+      free(buffer);
+      return 0;
+    }
+    STATS_ADD(syscalls, 2);
+    STATS_ADD(bytesRead, read);
+    STATS_ADD(bytesWritten, read);
+    position = end;
+  }
+
+  /* Past the end of the file, gaps between spans read as zero */
+  memset(buffer, 0, IPS_STREAM_BLOCK);
+  for(; span < plan->count; span++) {
+    const struct ipsSpan *current = &plan->spans[span];
+    size_t from = current->offset > position ? current->offset : position;
+
+    if(!IPSStreamZeros(out, buffer, from - position) ||
+       fwrite(current->data + (from - current->offset), BYTE,
+              current->offset + current->length - from, out) !=
+       current->offset + current->length - from) {
+      free(buffer);
+      return 0;
+    }
+    STATS_ADD(bytesWritten, current->offset + current->length - from);
+    position = current->offset + current->length;
+  }
+
+  /* As is anything up to a truncation size past the last record */
+  if(position < plan->size && !IPSStreamZeros(out, buffer,
+                                              plan->size - position)) {
+    free(buffer);
+    return 0;
+  }
+
+  free(buffer);
+  return !ferror(in) && fflush(out) == 0;
+}
+
+/**
+ * Patches a file using an IPS file, one record at a time
+ *
+ * This is the stream based fallback for when either file can't be
+ * mapped into memory. The patch file must be at its start, and the
+ * header tells IPS and IPS32 apart. A truncation size after the end
+ * of file marker cuts the file down once every record is written.
+ * Offsets (And the truncation size) start after a copier header, if
+ * there's one to leave alone. (See formatHeader)
+ *
+ * @param struct pStruct *params A pointer to a parameter struct that
+ * contains the files and parameters in which to patch the file.
+ *
+ * @return Returns 1 on success or 0 on failure.
+ */
+int IPSPatchStream(struct pStruct *params) {
+  struct patchData patch = {0, 0, NULL, 0};
+  unsigned char header[5], truncate[4];
+  unsigned char *scratch;
+  struct stat info;
+  size_t width, skip = 0;
+  unsigned long records = 0;
+  int status;
+
+  if(fread(header, BYTE, 5, params->patchFile) != 5 ||
+     !(width = (size_t)IPSOffsetSize(header, 5))) {
+    return AIPSError(ERR_MEDIUM, "This isn't an IPS patch.");
+  }
+
+  if(!(scratch = (unsigned char*)malloc(IPS_MAX_SIZE))) {
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  if(fstat(fileno(params->romFile), &info) == 0) {
+    skip = formatHeader(params, (size_t)info.st_size);
+  }
+
+  while((status = IPSReadRecord(&patch, params->patchFile, scratch,
+                                width == 4)) > 0) {
+    if((params->flags & ARG_VERYVERBOSE)) {
+      printf("Applied patch. Offset: Byte %d size: %d bytes\n",
+             (unsigned int)patch.offset,
+             (unsigned int)patch.size);
+    }
+
+    if(fseeko(params->romFile, (off_t)patch.offset + (off_t)skip,
+              SEEK_SET) != 0 ||
+       fwrite(patch.data, BYTE, patch.size, params->romFile) != patch.size) {
+      free(scratch);
+      return AIPSError(ERR_MEDIUM, "Couldn't write to the file to patch.");
+    }
+    STATS_ADD(records, 1);
+    STATS_ADD(bytesWritten, patch.size);
+    records++;
+  }
+
+  free(scratch);
+  if(status < 0) {
+    return AIPSError(ERR_MEDIUM, "This IPS patch is cut short: record %lu"
+                     " runs past the end of it.", records + 1);
+  }
+
+  if(fflush(params->romFile) != 0) {
+    return AIPSError(ERR_MEDIUM, "Couldn't write to the file to patch.");
+  }
+
+  if(fread(truncate, BYTE, width, params->patchFile) == width &&
+     ftruncate(fileno(params->romFile), (off_t)skip + (width == 4 ?
+               BYTE4_TO_UINT(truncate) : BYTE3_TO_UINT(truncate))) != 0) {
+    return AIPSError(ERR_MEDIUM, "Couldn't cut the file down to size.");
+  }
+
+  return 1;
+}
+
+/**
+ * Patches a file using an IPS file
+ *
+ * This function will attempt to patch a file specified in it's
+ * parameters with the patch file also specified in it's parameters
+ * according to the flags set.
+ *
+ * The patch is mapped into memory and the whole thing is checked and
+ * indexed, (Or the index is loaded from its sidecar file) so nothing
+ * is written if it's damaged. The records are then planned into the
+ * fewest writes that give the same result, (See IPSPlan) and written
+ * to the ROM in order. The ROM itself is never read. If the patch
+ * can't be mapped, we fall back to IPSPatchStream.
+ *
+ * A patch coming from a pipe is read into memory first. (IPS patches
+ * can't be applied before they've been checked all the way through)
+ * A ROM coming from a pipe is patched block by block as it's read,
+ * and written to stdout.
+ *
+ * If the ROM has a copier header to leave alone, (See formatHeader)
+ * the plan is moved past it, so the header costs nothing to skip.
+ *
+ * @param struct pStruct *params A pointer to a parameter struct that
+ * contains the files and parameters in which to patch the file.
+ *
+ * @return Returns 1 on success or 0 on failure.
+ */
+int IPSPatchFile(struct pStruct *params) {
+  struct mappedFile patch;
+  struct ipsIndex index;
+  struct ipsPlan plan;
+  struct stat info;
+  unsigned long long start;
+  int result = 0;
+
+  if(params->stream) {
+    patch.file = NULL;
+    patch.flags = MAPPED_HEAP;
+    if(!(patch.data = streamReadAll(params->stream, &patch.size))) {
+      return AIPSError(ERR_MEDIUM, "Couldn't read the IPS patch.");
+    }
+  } else if(!mapFile(&patch, params->patchFile, 0)) {
+    rewind(params->patchFile);
+    return IPSPatchStream(params);
+  }
+
+  start = statsClock();
+  result = IPSIndexFind(params, &patch, &index);
+  statsPhase(STATS_PARSE, start);
+  if(!result) {
+    unmapFile(&patch);
+    return 0;
+  }
+  STATS_ADD(records, index.count);
+
+  start = statsClock();
+  result = IPSPlan(&index, patch.data, patch.size, &plan,
+                   params->flags & ARG_VERYVERBOSE);
+  statsPhase(STATS_APPLY, start);
+  if(result) {
+    if(params->flags & ARG_VERBOSE) {
+      printf("%lu records, written as %lu spans in %lu writes.\n",
+             (unsigned long)index.count, (unsigned long)plan.count,
+             (unsigned long)plan.writes);
+    }
+
+    start = statsClock();
+    if(fstat(fileno(params->romFile), &info) != 0) {
+      result = 0;
+    } else if(!S_ISREG(info.st_mode)) {
+      if(params->flags & ARG_HEADER) {
+        AIPSError(ERR_MINOR, "Can't tell if a piped ROM has a copier header,"
+                  " so it's patched as it is.");
+      }
+      result = IPSPlanStream(&plan, params->romFile, stdout);
+    } else {
+      IPSPlanShift(&plan, formatHeader(params, (size_t)info.st_size));
+      result = IPSPlanWrite(&plan, params->romFile);
+    }
+    statsPhase(STATS_FLUSH, start);
+
+    if(!result) {
+      AIPSError(ERR_MEDIUM, "Couldn't write to the file to patch.");
+    }
+    IPSPlanFree(&plan);
+  }
+
+  IPSIndexFree(&index);
+  unmapFile(&patch);
+  return result;
+}
+
+/**
+ * Continues the CRC of a patched file over a stretch no record
+ * touches, which is the original file's bytes, or zeros past its end.
+ */
+static unsigned int IPSVerifyGap(unsigned int crc, const unsigned char *rom,
+                                 size_t romSize, size_t from, size_t to) {
+  static const unsigned char zeros[IPS_STREAM_BLOCK];
+
+  if(from < romSize) {
+    size_t end = to < romSize ? to : romSize;
+
+    crc = crcBuffer(crc, rom + from, end - from);
+    from = end;
+  }
+
+  while(from < to) {
+    size_t length = to - from < sizeof(zeros) ? to - from : sizeof(zeros);
+
+    crc = crcBuffer(crc, zeros, length);
+    from += length;
+  }
+
+  return crc;
+}
+
+/**
+ * Checks an IPS or IPS32 patch against a file without patching it.
+ *
+ * IPS has no checksums, so this only makes sure every record can be
+ * read. The CRC of the patched file is worked out from the plan of
+ * the patch, (See IPSPlan) so only the bytes that would end up in it
+ * are read, and nothing is copied.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param const unsigned char *rom The file the patch is for.
+ * @param size_t romSize The size of the file in bytes.
+ * @param struct patchCheck *check Where to store the size and CRC of
+ * the patched file.
+ *
+ * @return int 1 if the patch can be applied to the file, 0 otherwise.
+ */
+int IPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check) {
+  struct ipsIndex index;
+  struct ipsPlan plan;
+  size_t offset = 0, i;
+  unsigned int crc = 0;
+  int result;
+
+  if(!IPSOffsetSize(patch, patchSize)) {
+    return AIPSError(ERR_MEDIUM, "This isn't an IPS patch.");
+  }
+
+  if(!IPSIndexBuild(patch, patchSize, &index)) {
+    return 0;
+  }
+
+  result = IPSPlan(&index, patch, patchSize, &plan, 0);
+  check->records = (unsigned long)index.count;
+  STATS_ADD(records, index.count);
+  check->outputSize = (unsigned long)(index.truncated ? index.truncate :
+                                      index.size > romSize ? index.size :
+                                      romSize);
+  IPSIndexFree(&index);
+  if(!result) {
+    return 0;
+  }
+
+  for(i = 0; i < plan.count; i++) {
+    crc = IPSVerifyGap(crc, rom, romSize, offset, plan.spans[i].offset);
+    crc = crcBuffer(crc, plan.spans[i].data, plan.spans[i].length);
+    offset = plan.spans[i].offset + plan.spans[i].length;
+  }
+
+  check->outputCRC = IPSVerifyGap(crc, rom, romSize, offset,
+                                  check->outputSize);
+  IPSPlanFree(&plan);
+  return 1;
+}
+
+/**
+ * Writes a record (Or as many records as it takes to hold it) for a
+ * region of the modified file.
+ *
+ * Records are split at the 16-bit size limit, and a record that
+ * would start at 0x454F46 (Which reads as "EOF", or for IPS32,
+ * 0x45454F46 for "EEOF") is started a byte early instead.
+ *
+ * @param FILE *out The patch file being written.
+ * @param const unsigned char *target The modified file.
+ * @param size_t offset The offset of the region.
+ * @param size_t size The size of the region.
+ * @param int rle Nonzero to write the region as RLE records.
+ * @param int wide Nonzero for an IPS32 patch.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int IPSEmit(FILE *out, const unsigned char *target,
+                   size_t offset, size_t size, int rle, int wide) {
+  size_t limit = wide ? IPS32_MAX_OFFSET : IPS_MAX_OFFSET;
+  size_t marker = wide ? IPS32_EOF_OFFSET : IPS_EOF_OFFSET;
+
+  while(size) {
+    struct patchData record = {0, 0, NULL, 0};
+
+    if(offset > limit) {
+      return 0;
+    }
+
+    if(offset == marker) {
+      /* Start a byte early, carrying that byte along */
+      offset--;
+      size++;
+    }
+
+    record.offset = (unsigned int)offset;
+    record.data = (char*)(target + offset);
+    record.size = (unsigned int)(size > IPS_MAX_SIZE ? IPS_MAX_SIZE : size);
+    record.rle = rle;
+
+    /* An RLE record can't start at the marker either, so the two
+       bytes (Or the last one left) around it are written out plainly */
+    if(rle && offset == marker - 1) {
+      record.size = size < 2 ? (unsigned int)size : 2;
+      record.rle = 0;
+    }
+
+    offset += record.size;
+    size -= record.size;
+
+    if(!(record.rle ? IPSWriteRLE(&record, out, wide) :
+         IPSWriteRecord(&record, out, wide))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Writes the records for a run of changed bytes, picking out repeated
+ * bytes that are cheaper to store as RLE records.
+ *
+ * An RLE record takes 8 bytes, and splitting a normal record around
+ * one costs another 5 byte header, so a repeat has to be longer than
+ * that to be worth it.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int IPSEmitRun(FILE *out, const unsigned char *target,
+                      size_t start, size_t end, int wide) {
+  size_t pending = start, i = start;
+
+  while(i < end) {
+    size_t repeat = diffRepeat(target + i, end - i);
+    size_t worth = 13;
+
+    if(i == pending) {
+      worth -= 5;
+    }
+
+    if(i + repeat == end) {
+      worth -= 5;
+    }
+
+    if(repeat > worth) {
+      if((pending < i && !IPSEmit(out, target, pending, i - pending, 0,
+                                  wide)) ||
+         !IPSEmit(out, target, i, repeat, 1, wide)) {
+        return 0;
+      }
+      pending = i + repeat;
+    }
+
+    i += repeat;
+  }
+
+  return pending == end ||
+         IPSEmit(out, target, pending, end - pending, 0, wide);
+}
+
+/**
+ * Finds the next byte at or after position that needs patching.
+ *
+ * Past the end of the original file, the patched file gets zeros, so
+ * anything nonzero needs a record. The very last byte always does,
+ * so the file grows to the right size.
+ */
+static size_t IPSNextChange(const unsigned char *source, size_t sourceSize,
+                            const unsigned char *target, size_t targetSize,
+                            size_t position) {
+  static const unsigned char zero[4096];
+  size_t common = sourceSize < targetSize ? sourceSize : targetSize;
+
+  if(position >= targetSize) {
+    return targetSize;
+  }
+
+  if(position < common) {
+    position += diffEqual(source + position, target + position,
+                          common - position);
+    if(position < common) {
+      return position;
+    }
+  }
+
+  while(position < targetSize) {
+    size_t left = targetSize - position;
+    size_t block = left < sizeof(zero) ? left : sizeof(zero);
+    size_t same = diffEqual(zero, target + position, block);
+
+    position += same;
+    if(same < block) {
+      return position;
+    }
+  }
+
+  return targetSize > sourceSize ? targetSize - 1 : targetSize;
+}
+
+/**
+ * Finds the first byte at or after position that doesn't need
+ * patching. (The counterpart to IPSNextChange)
+ */
+static size_t IPSNextSame(const unsigned char *source, size_t sourceSize,
+                          const unsigned char *target, size_t targetSize,
+                          size_t position) {
+  size_t common = sourceSize < targetSize ? sourceSize : targetSize;
+
+  if(position < common) {
+    position += diffUnequal(source + position, target + position,
+                            common - position);
+    if(position < common) {
+      return position;
+    }
+  }
+
+  while(position < targetSize - 1 && target[position]) {
+    position++;
+  }
+
+  return position < targetSize - 1 ? position : targetSize;
+}
+
+/**
+ * Creates an IPS patch from an original and a modified file in memory.
+ *
+ * Runs of changed bytes are found with wide compares, and runs
+ * separated by fewer equal bytes than a record header costs are
+ * merged into one. If the modified file is smaller, the patch ends
+ * with its size, so the patched file is cut down to match.
+ *
+ * @param const unsigned char *source The original file.
+ * @param size_t sourceSize The size of the original file.
+ * @param const unsigned char *target The modified file.
+ * @param size_t targetSize The size of the modified file.
+ * @param FILE *out The file to write the patch to.
+ * @param int wide Nonzero to write an IPS32 patch, which can reach
+ * past the first 16 MB of a file.
+ *
+ * @return int 1 on success, 0 if the files are too big for the
+ * format or writing fails.
+ */
+int IPSCreateBuffer(const unsigned char *source, size_t sourceSize,
+                    const unsigned char *target, size_t targetSize,
+                    FILE *out, int wide) {
+  size_t start = IPSNextChange(source, sourceSize, target, targetSize, 0);
+  size_t width = wide ? 4 : 3;
+  unsigned char truncate[4];
+
+  if(fwrite(wide ? "IPS32" : "PATCH", BYTE, 5, out) != 5) {
+    return 0;
+  }
+
+  while(start < targetSize) {
+    size_t end = IPSNextSame(source, sourceSize, target, targetSize, start);
+    size_t next = IPSNextChange(source, sourceSize, target, targetSize, end);
+
+    /* Equal bytes are cheaper to carry along than a new record header */
+    while(next < targetSize && next - end <= 5) {
+      end = IPSNextSame(source, sourceSize, target, targetSize, next);
+      next = IPSNextChange(source, sourceSize, target, targetSize, end);
+    }
+
+    if(!IPSEmitRun(out, target, start, end, wide)) {
+      return 0;
+    }
+
+    start = next;
+  }
+
+  if(fwrite(wide ? "EEOF" : "EOF", BYTE, width, out) != width) {
+    return 0;
+  }
+
+  if(targetSize >= sourceSize) {
+    return 1;
+  }
+
+  if(targetSize > (wide ? IPS32_MAX_OFFSET : IPS_MAX_OFFSET)) {
+    return 0;
+  }
+
+  if(wide) {
+    UINT_TO_BYTE4(truncate, targetSize);
+  } else {
+    UINT_TO_BYTE3(truncate, targetSize);
+  }
+
+  return fwrite(truncate, BYTE, width, out) == width;
+}
+
+/**
+ * Creates an IPS or IPS32 patch file with the passed in pStruct.
+ */
+static int IPSCreateWith(struct pStruct *params, int wide) {
+  struct mappedFile source, target;
+  int result;
+
+  /* With --async, both files are read in at the same time */
+  if(!mapBegin(&source, params->romFile, 0)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't read the original file.");
+  }
+
+  if(!mapBegin(&target, params->targetFile, 0)) {
+    unmapFile(&source);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the modified file.");
+  }
+
+  if(!mapWait(&source) || !mapWait(&target)) {
+    unmapFile(&target);
+    unmapFile(&source);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the original and modified"
+                     " files.");
+  }
+
+  rewind(params->patchFile);
+  result = IPSCreateBuffer(source.data, source.size,
+                           target.data, target.size, params->patchFile, wide);
+  result = fflush(params->patchFile) == 0 && result;
+
+  if(!result) {
+    AIPSError(ERR_MEDIUM, wide ? "Couldn't write the IPS32 patch. (IPS32"
+              " can only patch the first 4 GB of a file.)" :
+              "Couldn't write the IPS patch. (IPS can only patch the first"
+              " 16 MB of a file; try an .ips32 patch.)");
+  } else if(params->flags & ARG_VERBOSE) {
+    printf("Created a %ld byte %s patch.\n", ftell(params->patchFile),
+           wide ? "IPS32" : "IPS");
+  }
+
+  unmapFile(&target);
+  unmapFile(&source);
+  return result;
+}
+
+/**
+ * Creates a patch file with the passed in pStruct
+ *
+ * This function creates an IPS patch file from the differences
+ * between the ROM file (The original) and the target file (The
+ * modified one).
+ *
+ * @param struct pStruct *params A pointer to a parameter struct with
+ * the original, modified and patch files.
+ *
+ * @return Returns 1 on success or 0 on failure.
+ */
+int IPSCreatePatch(struct pStruct *params) {
+  return IPSCreateWith(params, 0);
+}
+
+/**
+ * Creates an IPS32 patch file with the passed in pStruct
+ *
+ * IPS32 is IPS with 4 byte offsets, for files over 16 MB.
+ *
+ * @param struct pStruct *params A pointer to a parameter struct with
+ * the original, modified and patch files.
+ *
+ * @return Returns 1 on success or 0 on failure.
+ */
+int IPS32CreatePatch(struct pStruct *params) {
+  return IPSCreateWith(params, 1);
+}
+
+/**
+ * Writes a normal record to the patch file.
+ *
+ * @param struct patchData *patch The record to write.
+ * @param FILE *filePointer The patch file being written.
+ * @param int wide Nonzero for an IPS32 patch.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSWriteRecord(struct patchData *patch, FILE *filePointer, int wide) {
+  unsigned char header[6];
+  size_t width = wide ? 4 : 3;
+
+  if(wide) {
+    UINT_TO_BYTE4(header, patch->offset);
+  } else {
+    UINT_TO_BYTE3(header, patch->offset);
+  }
+  UINT_TO_BYTE2(header + width, patch->size);
+
+  return fwrite(header, BYTE, width + 2, filePointer) == width + 2 &&
+         fwrite(patch->data, BYTE, patch->size, filePointer) == patch->size;
+}
+
+/**
+ * Writes an RLE record to the patch file.
+ *
+ * @param struct patchData *patch The record to write; the first byte
+ * of the data is repeated size times.
+ * @param FILE *filePointer The patch file being written.
+ * @param int wide Nonzero for an IPS32 patch.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int IPSWriteRLE(struct patchData *patch, FILE *filePointer, int wide) {
+  unsigned char record[9];
+  size_t width = wide ? 4 : 3;
+
+  if(wide) {
+    UINT_TO_BYTE4(record, patch->offset);
+  } else {
+    UINT_TO_BYTE3(record, patch->offset);
+  }
+  UINT_TO_BYTE2(record + width, 0); /* A size of 0 marks RLE */
+  UINT_TO_BYTE2(record + width + 2, patch->size);
+  record[width + 4] = (unsigned char)patch->data[0];
+
+  return fwrite(record, BYTE, width + 5, filePointer) == width + 5;
 }
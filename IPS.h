@@ -1,13 +1,123 @@
+/* IPS format limits */
+#define IPS_MAX_OFFSET 0xFFFFFF
+#define IPS_MAX_SIZE 0xFFFF
+#define IPS_EOF_OFFSET 0x454F46
+
+/* IPS32 has 4 byte offsets, and an end marker of "EEOF" */
+#define IPS32_MAX_OFFSET 0xFFFFFFFF
+#define IPS32_EOF_OFFSET 0x45454F46
+
+/* Block size for patching a streamed file */
+#define IPS_STREAM_BLOCK (1 << 16)
+
+/* Records at least this long are written around the cache */
+#define IPS_STREAM_STORE (1 << 15)
+
+/* Sidecar index files */
+#define IPS_INDEX_EXTENSION ".aidx"
+#define IPS_INDEX_MAGIC "AIPSIDX4"
+#define IPS_INDEX_HEADER 64
+
+/* Bytes from each end of a patch that a saved index is checked on */
+#define IPS_INDEX_SAMPLE 4096
+
+/*
+ * Every record of a patch, parsed once. Each array has one entry per
+ * record; payload is where the record's data (Or RLE fill byte)
+ * starts in the patch. If the patch ends with a truncation size, the
+ * patched file is cut (Or padded) to exactly that many bytes.
+ */
+struct ipsIndex {
+  size_t count;
+  size_t size;
+  size_t truncate;
+  int truncated;
+  unsigned int *offset;
+  unsigned int *length;
+  unsigned int *payload;
+  unsigned char *rle;
+};
+
+/*
+ * What a saved index is checked against, to tell whether the patch
+ * has changed since: its size, which file it is and when that was
+ * last written, (Both 0 when it doesn't matter, like in the cache) and
+ * a CRC of its first and last IPS_INDEX_SAMPLE bytes.
+ */
+struct ipsStamp {
+  size_t size;
+  unsigned long long inode;
+  long long modified;
+  unsigned int sample;
+};
+
+/*
+ * A write planned from an index; a piece of the final patched file,
+ * coming from a single record.
+ */
+struct ipsSpan {
+  size_t offset;
+  size_t length;
+  const unsigned char *data;
+};
+
+/*
+ * Every span that ends up in the patched file, in file order with no
+ * overlaps, and the blocks RLE spans are written from. A truncated
+ * plan's size is the exact size of the patched file.
+ */
+struct ipsPlan {
+  struct ipsSpan *spans;
+  size_t count;
+  size_t writes;
+  size_t size;
+  int truncated;
+  unsigned char *fill[256];
+};
+
 struct patchData {
   unsigned int offset;
   unsigned int size;
   char *data;
+  int rle;
 };
 
-int IPSReadRecord(struct patchData *patch, FILE *filePointer);
+int IPSReadRecord(struct patchData *patch, FILE *filePointer,
+                  unsigned char *scratch, int wide);
 int IPSReadRLE(struct patchData *patch, FILE *filePointer);
-int IPSCheckPatch(FILE *filePointer, int verbose);
 int IPSCreatePatch(struct pStruct *params);
+int IPS32CreatePatch(struct pStruct *params);
+int IPSCreateBuffer(const unsigned char *source, size_t sourceSize,
+                    const unsigned char *target, size_t targetSize,
+                    FILE *out, int wide);
 int IPSPatchFile(struct pStruct *params);
-int IPSWriteRecord(struct patchData *patch, FILE *filePointer);
-int IPSWriteRLE(struct patchData *patch, FILE *filePointer);
+int IPSPatchStream(struct pStruct *params);
+int IPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check);
+int IPSOffsetSize(const unsigned char *patch, size_t patchSize);
+int IPSNextRecord(const unsigned char *patch, size_t patchSize,
+                  size_t *position, struct patchData *record);
+int IPSIndexBuild(const unsigned char *patch, size_t patchSize,
+                  struct ipsIndex *index);
+int IPSIndexApply(const struct ipsIndex *index, const unsigned char *patch,
+                  size_t patchSize, unsigned char *target, size_t targetSize,
+                  int verbose);
+void IPSIndexStamp(struct ipsStamp *stamp, FILE *file,
+                   const unsigned char *patch, size_t patchSize);
+unsigned char *IPSIndexPack(const struct ipsIndex *index,
+                            const struct ipsStamp *stamp, size_t *size);
+int IPSIndexUnpack(struct ipsIndex *index, const unsigned char *buffer,
+                   size_t size, const struct ipsStamp *stamp);
+int IPSIndexSave(const struct ipsIndex *index, const char *path,
+                 const struct ipsStamp *stamp);
+int IPSIndexLoad(struct ipsIndex *index, const char *path,
+                 const struct ipsStamp *stamp);
+void IPSIndexFree(struct ipsIndex *index);
+int IPSPlan(const struct ipsIndex *index, const unsigned char *patch,
+            size_t patchSize, struct ipsPlan *plan, int verbose);
+int IPSPlanWrite(const struct ipsPlan *plan, FILE *file);
+int IPSPlanStream(const struct ipsPlan *plan, FILE *in, FILE *out);
+void IPSPlanFree(struct ipsPlan *plan);
+int IPSWriteRecord(struct patchData *patch, FILE *filePointer, int wide);
+int IPSWriteRLE(struct patchData *patch, FILE *filePointer, int wide);
@@ -0,0 +1,556 @@
+/* Embeddable patching library (See LIBAIPS.h) */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "IPS.h"
+#include "UPS.h"
+#include "BPS.h"
+#include "FORMAT.h"
+#include "LIBAIPS.h"
+
+/* Room for the last error message on each thread */
+#define AIPS_MESSAGE 256
+
+/* Patch types a layout can be for */
+#define AIPS_IPS 1
+#define AIPS_UPS 2
+#define AIPS_BPS 3
+
+static _Thread_local char aipsMessage[AIPS_MESSAGE];
+
+/*
+ * How a patch lays out over a file of a given size: how much room
+ * patching it takes, how big it comes out, and the parsed header (Or
+ * for IPS, the index) so it's only read once.
+ */
+struct aipsLayout {
+  int type;
+  size_t capacity;
+  size_t outputSize;
+  struct ipsIndex index;
+  struct upsHeader ups;
+  struct bpsHeader bps;
+};
+
+/**
+ * Keeps the message of an error for aipsError, in place of printing
+ * it. Nothing here ever exits; major errors are handed back to the
+ * caller like any other.
+ *
+ * @param int level The error level. Minor errors are only warnings,
+ * and aren't kept.
+ * @param const char *message A printf format string for the message.
+ *
+ * @return int 1 for minor errors, 0 otherwise. (The same as AIPS's)
+ */
+int AIPSError(int level, const char *message, ...) {
+  va_list arguments;
+
+  if(level == ERR_MINOR) {
+    return 1;
+  }
+
+  va_start(arguments, message);
+  vsnprintf(aipsMessage, sizeof(aipsMessage), message, arguments);
+  va_end(arguments);
+  return 0;
+}
+
+/**
+ * Records an error and hands back its result code.
+ */
+static int aipsFail(int code, const char *message) {
+  AIPSError(ERR_MEDIUM, "%s", message);
+  return code;
+}
+
+/**
+ * Allocates a buffer with the caller's allocator, or malloc.
+ */
+static void *aipsAllocate(size_t size, const struct aipsAllocator *allocator) {
+  void *data = allocator ?
+               allocator->allocate(size ? size : 1, allocator->context) :
+               malloc(size ? size : 1);
+
+  if(!data) {
+    AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  return data;
+}
+
+/**
+ * Frees a buffer the library handed back.
+ *
+ * @param void *data The buffer, or NULL.
+ * @param const struct aipsAllocator *allocator The allocator it came
+ * from, or NULL if it came from malloc.
+ */
+void aipsRelease(void *data, const struct aipsAllocator *allocator) {
+  if(!data) {
+    return;
+  }
+
+  if(allocator) {
+    allocator->release(data, allocator->context);
+  } else {
+    free(data);
+  }
+}
+
+/**
+ * Gives the message behind the last failure on this thread. Each call
+ * into the library clears it first.
+ *
+ * @return const char* The message, or "" if the last call didn't
+ * fail.
+ */
+const char *aipsError(void) {
+  return aipsMessage;
+}
+
+/**
+ * Describes a result code.
+ *
+ * @param int code A result code.
+ *
+ * @return const char* A short description of it.
+ */
+const char *aipsResult(int code) {
+  switch(code) {
+    case AIPS_OK:
+      return "OK";
+    case AIPS_ERROR_DAMAGED:
+      return "The patch is damaged";
+    case AIPS_ERROR_WRONG_FILE:
+      return "The patch isn't for this file";
+    case AIPS_ERROR_UNSUPPORTED:
+      return "Not a patch that can be used this way";
+    case AIPS_ERROR_MEMORY:
+      return "Out of memory";
+    case AIPS_ERROR_CAPACITY:
+      return "The buffer is too small for the patched file";
+  }
+
+  return "Unknown result";
+}
+
+/**
+ * Works out what kind of patch something is.
+ *
+ * @param const unsigned char *data The patch, or at least the start
+ * of it.
+ * @param size_t size How many bytes of it there are.
+ *
+ * @return const char* The name of the format, like "IPS", or NULL if
+ * it doesn't look like a patch.
+ */
+const char *aipsDetect(const unsigned char *data, size_t size) {
+  const struct patchFormat *format;
+
+  aipsMessage[0] = '\0';
+  format = formatMatch(data, size, size);
+  return format ? format->name : NULL;
+}
+
+/**
+ * Checks a patch against a file without changing either. (See
+ * formatVerify)
+ *
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param const unsigned char *rom The file the patch is for.
+ * @param size_t romSize The size of the file in bytes.
+ * @param struct aipsCheck *check Where to store the size and CRC the
+ * patched file will have.
+ *
+ * @return int AIPS_OK if the patch would apply cleanly, or why not.
+ */
+int aipsVerify(const unsigned char *patch, size_t patchSize,
+               const unsigned char *rom, size_t romSize,
+               struct aipsCheck *check) {
+  const struct patchFormat *format;
+  struct patchCheck result = {0, 0, 0, 0};
+
+  aipsMessage[0] = '\0';
+  format = formatMatch(patch, patchSize, patchSize);
+  if(!format || !format->verify) {
+    return aipsFail(AIPS_ERROR_UNSUPPORTED, "This isn't a patch that can be"
+                    " checked.");
+  }
+
+  if(!format->verify(patch, patchSize, rom, romSize, &result)) {
+    return result.wrongFile ? AIPS_ERROR_WRONG_FILE : AIPS_ERROR_DAMAGED;
+  }
+
+  check->outputSize = result.outputSize;
+  check->outputCRC = result.outputCRC;
+  check->records = result.records;
+  return AIPS_OK;
+}
+
+/**
+ * Reads the header of a patch and works out its layout over a file.
+ *
+ * @return int AIPS_OK, or why the patch can't be applied to the file.
+ */
+static int aipsMeasure(const unsigned char *patch, size_t patchSize,
+                       size_t size, struct aipsLayout *layout) {
+  layout->index.count = 0;
+  layout->index.offset = NULL;
+
+  if(IPSOffsetSize(patch, patchSize)) {
+    layout->type = AIPS_IPS;
+    if(!IPSIndexBuild(patch, patchSize, &layout->index)) {
+      /* The count is only kept if the records were all there */
+      return layout->index.count ? AIPS_ERROR_MEMORY : AIPS_ERROR_DAMAGED;
+    }
+    layout->outputSize = layout->index.size > size ? layout->index.size : size;
+    layout->capacity = layout->outputSize;
+
+    /* Every record is still written before the file is cut down */
+    if(layout->index.truncated) {
+      layout->outputSize = layout->index.truncate;
+      if(layout->outputSize > layout->capacity) {
+        layout->capacity = layout->outputSize;
+      }
+    }
+  } else if(patchSize >= 4 && memcmp(patch, "UPS1", 4) == 0) {
+    layout->type = AIPS_UPS;
+    if(!UPSReadHeader(patch, patchSize, &layout->ups)) {
+      return aipsFail(AIPS_ERROR_DAMAGED, "This UPS patch seems to be"
+                      " damaged.");
+    }
+
+    /* Either side of the patch will do */
+    if(size == layout->ups.inputSize) {
+      layout->outputSize = layout->ups.outputSize;
+    } else if(size == layout->ups.outputSize) {
+      layout->outputSize = layout->ups.inputSize;
+    } else {
+      return aipsFail(AIPS_ERROR_WRONG_FILE, "The file seems to be the wrong"
+                      " size, yo~!");
+    }
+    layout->capacity = size > layout->outputSize ? size : layout->outputSize;
+  } else if(patchSize >= 4 && memcmp(patch, "BPS1", 4) == 0) {
+    layout->type = AIPS_BPS;
+    if(!BPSReadHeader(patch, patchSize, &layout->bps)) {
+      return aipsFail(AIPS_ERROR_DAMAGED, "This BPS patch seems to be"
+                      " damaged.");
+    }
+
+    if(size != layout->bps.sourceSize) {
+      return aipsFail(AIPS_ERROR_WRONG_FILE, "The file seems to be the wrong"
+                      " size, yo~!");
+    }
+    layout->outputSize = layout->bps.targetSize;
+    layout->capacity = size > layout->outputSize ? size : layout->outputSize;
+  } else {
+    return aipsFail(AIPS_ERROR_UNSUPPORTED, "This doesn't look like a patch"
+                    " we can apply.");
+  }
+
+  return AIPS_OK;
+}
+
+/**
+ * Applies a UPS patch in place, undoing it again if anything doesn't
+ * check out.
+ */
+static int aipsUPS(const unsigned char *patch, const struct upsHeader *header,
+                   unsigned char *data, size_t size, size_t outputSize) {
+  pStruct params;
+  struct upsChecksums actual;
+  int matched;
+
+  memset(&params, 0, sizeof(params));
+  if(!UPSApplyBuffer(patch, header, data, size, outputSize, &actual)) {
+    UPSApplyBuffer(patch, header, data, size, outputSize, NULL);
+    return aipsFail(AIPS_ERROR_DAMAGED, "This UPS patch seems to be"
+                    " damaged.");
+  }
+
+  if(!UPSVerifyCRC(&params, header, &actual, size)) {
+    UPSApplyBuffer(patch, header, data, size, outputSize, NULL);
+    matched = (size == header->inputSize &&
+               actual.input == header->footer.input) ||
+              (size == header->outputSize &&
+               actual.input == header->footer.output);
+    return actual.patch != header->footer.patch || matched ?
+           AIPS_ERROR_DAMAGED : AIPS_ERROR_WRONG_FILE;
+  }
+
+  return AIPS_OK;
+}
+
+/**
+ * Builds the file a BPS patch makes in a separate buffer, checking
+ * every checksum on the way.
+ */
+static int aipsBPS(const unsigned char *patch, size_t patchSize,
+                   const struct bpsHeader *header,
+                   const unsigned char *source, unsigned char *target) {
+  if(crcBuffer(0, patch, patchSize - 4) != header->patchChecksum) {
+    return aipsFail(AIPS_ERROR_DAMAGED, "Oh no! This patch file looks"
+                    " invalid!");
+  } else if(crcBuffer(0, source, header->sourceSize) !=
+            header->sourceChecksum) {
+    return aipsFail(AIPS_ERROR_WRONG_FILE, "You may have an invalid file."
+                    " (Or this patch isn't for this file.)");
+  } else if(!BPSApplyBuffer(patch, header, source, target)) {
+    return aipsFail(AIPS_ERROR_DAMAGED, "This BPS patch seems to be"
+                    " damaged.");
+  } else if(crcBuffer(0, target, header->targetSize) !=
+            header->targetChecksum) {
+    return aipsFail(AIPS_ERROR_DAMAGED, "The patched file didn't come out"
+                    " right!");
+  }
+
+  return AIPS_OK;
+}
+
+/**
+ * Applies a measured IPS or UPS patch to a buffer with room for its
+ * layout.
+ */
+static int aipsPatch(const unsigned char *patch, size_t patchSize,
+                     const struct aipsLayout *layout, unsigned char *data,
+                     size_t size) {
+  memset(data + size, 0, layout->capacity - size);
+
+  if(layout->type == AIPS_UPS) {
+    return aipsUPS(patch, &layout->ups, data, size, layout->outputSize);
+  }
+
+  return IPSIndexApply(&layout->index, patch, patchSize, data,
+                       layout->capacity, 0) ?
+         AIPS_OK : AIPS_ERROR_DAMAGED;
+}
+
+/**
+ * Applies a patch to a file in place.
+ *
+ * IPS and UPS patches are applied straight to the buffer, with the
+ * patch read where it is, so nothing is copied. BPS reads the whole
+ * original while it writes, so it's built in a buffer from the
+ * allocator and copied back. If the patch fails, the buffer is left
+ * as it was. (Up to size)
+ *
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param unsigned char *data The file to patch.
+ * @param size_t size The size of the file in bytes.
+ * @param size_t capacity How big the buffer is. A UPS patch needs room
+ * for whichever of the file before and after patching is larger.
+ * @param size_t *outputSize Where to store the size of the patched
+ * file, or of the buffer it needs if it's too small.
+ * @param const struct aipsAllocator *allocator Where working buffers
+ * come from, or NULL for malloc.
+ *
+ * @return int AIPS_OK on success, or why the patch couldn't be
+ * applied. (AIPS_ERROR_CAPACITY if the buffer is too small)
+ */
+int aipsApply(const unsigned char *patch, size_t patchSize,
+              unsigned char *data, size_t size, size_t capacity,
+              size_t *outputSize, const struct aipsAllocator *allocator) {
+  struct aipsLayout layout;
+  unsigned char *target;
+  int result;
+
+  aipsMessage[0] = '\0';
+  result = aipsMeasure(patch, patchSize, size, &layout);
+  if(result != AIPS_OK) {
+    return result;
+  }
+
+  if(layout.capacity > capacity) {
+    *outputSize = layout.capacity;
+    IPSIndexFree(&layout.index);
+    AIPSError(ERR_MEDIUM, "Patching this file takes a %lu byte buffer.",
+              (unsigned long)layout.capacity);
+    return AIPS_ERROR_CAPACITY;
+  }
+
+  if(layout.type != AIPS_BPS) {
+    result = aipsPatch(patch, patchSize, &layout, data, size);
+  } else if(!(target = (unsigned char*)aipsAllocate(layout.outputSize,
+                                                     allocator))) {
+    result = AIPS_ERROR_MEMORY;
+  } else {
+    result = aipsBPS(patch, patchSize, &layout.bps, data, target);
+    if(result == AIPS_OK) {
+      memcpy(data, target, layout.outputSize);
+    }
+    aipsRelease(target, allocator);
+  }
+
+  IPSIndexFree(&layout.index);
+  if(result == AIPS_OK) {
+    *outputSize = layout.outputSize;
+  }
+  return result;
+}
+
+/**
+ * Applies a patch to a copy of a file.
+ *
+ * @param const unsigned char *patch The whole patch.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param const unsigned char *rom The file to patch, which is only
+ * read.
+ * @param size_t romSize The size of the file in bytes.
+ * @param unsigned char **output Where to store the patched file, which
+ * comes from the allocator. (Free it with aipsRelease)
+ * @param size_t *outputSize Where to store the size of the patched
+ * file.
+ * @param const struct aipsAllocator *allocator Where the patched file
+ * comes from, or NULL for malloc.
+ *
+ * @return int AIPS_OK on success, or why the patch couldn't be
+ * applied.
+ */
+int aipsApplyCopy(const unsigned char *patch, size_t patchSize,
+                  const unsigned char *rom, size_t romSize,
+                  unsigned char **output, size_t *outputSize,
+                  const struct aipsAllocator *allocator) {
+  struct aipsLayout layout;
+  int result;
+
+  aipsMessage[0] = '\0';
+  result = aipsMeasure(patch, patchSize, romSize, &layout);
+  *output = NULL;
+  if(result != AIPS_OK) {
+    return result;
+  }
+
+  /* BPS writes the new file on its own, so only it is allocated. */
+  if(!(*output = (unsigned char*)aipsAllocate(layout.type == AIPS_BPS ?
+                                              layout.outputSize :
+                                              layout.capacity, allocator))) {
+    IPSIndexFree(&layout.index);
+    return AIPS_ERROR_MEMORY;
+  }
+
+  if(layout.type == AIPS_BPS) {
+    result = aipsBPS(patch, patchSize, &layout.bps, rom, *output);
+  } else {
+    memcpy(*output, rom, romSize);
+    result = aipsPatch(patch, patchSize, &layout, *output, romSize);
+  }
+
+  IPSIndexFree(&layout.index);
+  if(result != AIPS_OK) {
+    aipsRelease(*output, allocator);
+    *output = NULL;
+    return result;
+  }
+
+  *outputSize = layout.outputSize;
+  return AIPS_OK;
+}
+
+/**
+ * Creates a patch from an original and a modified file.
+ *
+ * The patch is written to a memory stream, so this needs
+ * open_memstream. (And for UPS, fmemopen)
+ *
+ * @param const char *format The kind of patch to make: "IPS",
+ * "IPS32", "UPS" or "BPS".
+ * @param const unsigned char *source The original file.
+ * @param size_t sourceSize The size of the original in bytes.
+ * @param const unsigned char *target The modified file.
+ * @param size_t targetSize The size of the modified file in bytes.
+ * @param unsigned char **patch Where to store the patch, which comes
+ * from the allocator. (Free it with aipsRelease)
+ * @param size_t *patchSize Where to store the size of the patch.
+ * @param const struct aipsAllocator *allocator Where the patch comes
+ * from, or NULL for malloc.
+ *
+ * @return int AIPS_OK on success, or why the patch couldn't be made.
+ */
+int aipsCreate(const char *format,
+               const unsigned char *source, size_t sourceSize,
+               const unsigned char *target, size_t targetSize,
+               unsigned char **patch, size_t *patchSize,
+               const struct aipsAllocator *allocator) {
+#ifndef _WIN32
+  pStruct params;
+  struct crcStream *stream = NULL;
+  char *buffer = NULL;
+  size_t length = 0;
+  FILE *out;
+  int wide = strcasecmp(format, "IPS32") == 0, ips = 0, result = 0;
+
+  memset(&params, 0, sizeof(params));
+  aipsMessage[0] = '\0';
+  *patch = NULL;
+  if(!(out = open_memstream(&buffer, &length))) {
+    return aipsFail(AIPS_ERROR_MEMORY, "Out of memory!");
+  }
+
+  if(wide || strcasecmp(format, "IPS") == 0) {
+    ips = 1;
+    if(!(result = IPSCreateBuffer(source, sourceSize, target, targetSize,
+                                  out, wide))) {
+      AIPSError(ERR_MEDIUM, wide ? "IPS32 can only patch the first 4 GB of"
+                " a file." : "IPS can only patch the first 16 MB of a file.");
+    }
+  } else if(strcasecmp(format, "BPS") == 0) {
+    if(!(stream = (struct crcStream*)malloc(sizeof(struct crcStream)))) {
+      AIPSError(ERR_MEDIUM, "Out of memory!");
+    } else {
+      crcStreamOpen(stream, out);
+      result = BPSCreateBuffer(source, sourceSize, target, targetSize, stream);
+      free(stream);
+    }
+  } else if(strcasecmp(format, "UPS") == 0) {
+    params.romFile = fmemopen((void*)source, sourceSize, "rb");
+    params.targetFile = fmemopen((void*)target, targetSize, "rb");
+    params.patchFile = out;
+    result = params.romFile && params.targetFile && UPSCreatePatch(&params);
+    if(params.romFile) {
+      fclose(params.romFile);
+    }
+    if(params.targetFile) {
+      fclose(params.targetFile);
+    }
+  } else {
+    fclose(out);
+    free(buffer);
+    return aipsFail(AIPS_ERROR_UNSUPPORTED, "Only IPS, IPS32, UPS and BPS"
+                    " patches can be made.");
+  }
+
+  if(fclose(out) != 0 || !result) {
+    free(buffer);
+    return ips ? AIPS_ERROR_UNSUPPORTED : AIPS_ERROR_MEMORY;
+  }
+
+  /* The stream's buffer is already ours with malloc; otherwise copy it. */
+  if(!allocator) {
+    *patch = (unsigned char*)buffer;
+  } else if((*patch = (unsigned char*)aipsAllocate(length, allocator))) {
+    memcpy(*patch, buffer, length);
+    free(buffer);
+  } else {
+    free(buffer);
+    return AIPS_ERROR_MEMORY;
+  }
+
+  *patchSize = length;
+  return AIPS_OK;
+#else
+  (void)format;
+  (void)source;
+  (void)sourceSize;
+  (void)target;
+  (void)targetSize;
+  (void)allocator;
+  aipsMessage[0] = '\0';
+  *patch = NULL;
+  *patchSize = 0;
+  return aipsFail(AIPS_ERROR_UNSUPPORTED, "Patches can't be made in memory"
+                  " on this system.");
+#endif
+}
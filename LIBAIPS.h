@@ -0,0 +1,66 @@
+#ifndef LIBAIPS_HEAD
+#define LIBAIPS_HEAD
+
+/*
+ * libaips: applies, checks and creates IPS, IPS32, UPS and BPS
+ * patches held in memory. Nothing here prints, exits or touches the
+ * filesystem; every function returns one of the result codes below,
+ * and the message behind the last failure on a thread is kept for
+ * aipsError.
+ */
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define AIPS_API __attribute__((visibility("default")))
+#else
+#define AIPS_API
+#endif
+
+/* Result codes */
+#define AIPS_OK 0
+#define AIPS_ERROR_DAMAGED 1
+#define AIPS_ERROR_WRONG_FILE 2
+#define AIPS_ERROR_UNSUPPORTED 3
+#define AIPS_ERROR_MEMORY 4
+#define AIPS_ERROR_CAPACITY 5
+
+/*
+ * Where buffers handed back to the caller (And the library's own
+ * working copies of files) come from. A NULL allocator means malloc
+ * and free.
+ */
+struct aipsAllocator {
+  void *(*allocate)(size_t size, void *context);
+  void (*release)(void *data, void *context);
+  void *context;
+};
+
+/* What a patch will make of a file, from aipsVerify */
+struct aipsCheck {
+  unsigned long outputSize;
+  unsigned int outputCRC;
+  unsigned long records;
+};
+
+AIPS_API const char *aipsDetect(const unsigned char *data, size_t size);
+AIPS_API int aipsVerify(const unsigned char *patch, size_t patchSize,
+                        const unsigned char *rom, size_t romSize,
+                        struct aipsCheck *check);
+AIPS_API int aipsApply(const unsigned char *patch, size_t patchSize,
+                       unsigned char *data, size_t size, size_t capacity,
+                       size_t *outputSize,
+                       const struct aipsAllocator *allocator);
+AIPS_API int aipsApplyCopy(const unsigned char *patch, size_t patchSize,
+                           const unsigned char *rom, size_t romSize,
+                           unsigned char **output, size_t *outputSize,
+                           const struct aipsAllocator *allocator);
+AIPS_API int aipsCreate(const char *format,
+                        const unsigned char *source, size_t sourceSize,
+                        const unsigned char *target, size_t targetSize,
+                        unsigned char **patch, size_t *patchSize,
+                        const struct aipsAllocator *allocator);
+AIPS_API void aipsRelease(void *data, const struct aipsAllocator *allocator);
+AIPS_API const char *aipsError(void);
+AIPS_API const char *aipsResult(int code);
+#endif
@@ -0,0 +1,424 @@
+/* File mapping functions */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* For copy_file_range */
+#endif
+
+#include "AIPS.h"
+#include "MAP.h"
+#include "CRC.h"
+#include "DIFF.h"
+#include "IO.h"
+#include "STATS.h"
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define ftruncate(fd, size) _chsize((fd), (long)(size))
+#else
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/**
+ * Maps the current size of the file into memory.
+ *
+ * Uses mmap where we have it, and otherwise (Or if mmap refuses)
+ * falls back to reading the whole file into a heap buffer that
+ * unmapFile will write back.
+ *
+ * With asynchronous I/O turned on, read-only files are read into a
+ * heap buffer with several reads in flight, and if MAPPED_CRC was
+ * asked for, each piece is checksummed as soon as it's in, while the
+ * rest are still being read. The reads are only started here; mapWait
+ * waits for them. (See ioStart) Writable files are always mapped, so
+ * only the pages that change are ever written back.
+ *
+ * @param struct mappedFile *map The mapping to fill in.
+ * @param int async Nonzero if the file can be read asynchronously.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int mapView(struct mappedFile *map, int async) {
+  map->data = NULL;
+  map->flags &= ~(MAPPED_HEAP | MAPPED_PENDING);
+
+  if(map->size == 0) {
+    return 1;
+  }
+
+  if(async && ioEnabled() && !(map->flags & MAPPED_WRITE) &&
+     (map->data = (unsigned char*)malloc(map->size))) {
+    map->crc = 0;
+    if((map->request = ioStart(fileno(map->file), map->data, map->size, 0,
+                               (map->flags & MAPPED_CRC) ? &map->crc :
+                               NULL))) {
+      map->flags |= MAPPED_HEAP | MAPPED_PENDING;
+      return 1;
+    }
+    free(map->data);
+    map->data = NULL;
+  }
+
+#ifndef _WIN32
+  {
+    int protection = PROT_READ;
+    int sharing = MAP_PRIVATE;
+    void *view;
+
+    if(map->flags & MAPPED_WRITE) {
+      protection |= PROT_WRITE;
+      sharing = MAP_SHARED;
+    }
+
+    view = mmap(NULL, map->size, protection, sharing, fileno(map->file), 0);
+    STATS_ADD(syscalls, 1);
+    if(view != MAP_FAILED) {
+      STATS_ADD(bytesRead, map->size);
+      map->data = (unsigned char*)view;
+      return 1;
+    }
+  }
+#endif
+
+  if(!(map->data = (unsigned char*)malloc(map->size))) {
+    return 0;
+  }
+
+  map->flags |= MAPPED_HEAP;
+  rewind(map->file);
+  if(fread(map->data, BYTE, map->size, map->file) != map->size) {
+    free(map->data);
+    map->data = NULL;
+    map->flags &= ~MAPPED_HEAP;
+    return 0;
+  }
+
+  STATS_ADD(syscalls, 1);
+  STATS_ADD(bytesRead, map->size);
+  return 1;
+}
+
+/**
+ * Works out the CRC of a mapping, if it was asked for.
+ *
+ * @return int Always 1.
+ */
+static int mapChecksum(struct mappedFile *map) {
+  if(map->flags & MAPPED_CRC) {
+    map->crc = crcBuffer(0, map->data, map->size);
+  }
+
+  return 1;
+}
+
+/**
+ * Starts mapping an entire file into memory. With asynchronous I/O,
+ * the file is still being read when this returns, so other files can
+ * be read at the same time; mapWait has to be called before the data
+ * is used. Otherwise it's mapped right away.
+ *
+ * The file's stdio buffers are flushed first so that the mapping
+ * sees everything written through the FILE so far. Only regular
+ * files can be mapped; pipes and the like will return 0 so the
+ * caller can fall back on plain stream reads.
+ *
+ * @param struct mappedFile *map The mapping structure to fill in.
+ * @param FILE *file The file to map.
+ * @param int flags MAPPED_WRITE if changes to the mapping should end
+ * up in the file, (The file must be open for writing too) and
+ * MAPPED_CRC to have the CRC of the file left in map->crc.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int mapBegin(struct mappedFile *map, FILE *file, int flags) {
+  struct stat info;
+
+  map->data = NULL;
+  map->size = 0;
+  map->file = file;
+  map->flags = flags & (MAPPED_WRITE | MAPPED_CRC);
+
+  fflush(file);
+  STATS_ADD(syscalls, 1);
+  if(fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return 0;
+  }
+
+  map->size = (size_t)info.st_size;
+  return mapView(map, 1) &&
+         ((map->flags & MAPPED_PENDING) || mapChecksum(map));
+}
+
+/**
+ * Waits for a mapping from mapBegin to be read in. If the reads fail,
+ * the file is mapped the usual way instead.
+ *
+ * @param struct mappedFile *map The mapping.
+ *
+ * @return int 1 if the data is ready, 0 otherwise.
+ */
+int mapWait(struct mappedFile *map) {
+  if(!(map->flags & MAPPED_PENDING)) {
+    return 1;
+  }
+
+  map->flags &= ~MAPPED_PENDING;
+  if(ioFinish(map->request)) {
+    return 1;
+  }
+
+  free(map->data);
+  return mapView(map, 0) && mapChecksum(map);
+}
+
+/**
+ * Maps an entire file into memory. (See mapBegin)
+ *
+ * @param struct mappedFile *map The mapping structure to fill in.
+ * @param FILE *file The file to map.
+ * @param int flags MAPPED_WRITE and MAPPED_CRC, as with mapBegin.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int mapFile(struct mappedFile *map, FILE *file, int flags) {
+  return mapBegin(map, file, flags) && mapWait(map);
+}
+
+/**
+ * Grows or shrinks a writable mapping, and the file behind it.
+ *
+ * New bytes past the old end of the file read as zero.
+ *
+ * @param struct mappedFile *map A writable mapping from mapFile.
+ * @param size_t size The new size of the file.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int mapResize(struct mappedFile *map, size_t size) {
+  if(!(map->flags & MAPPED_WRITE)) {
+    return 0;
+  }
+
+  if(size == map->size) {
+    return 1;
+  }
+
+  if(map->flags & MAPPED_HEAP) {
+    unsigned char *data = (unsigned char*)realloc(map->data, size ? size : 1);
+
+    if(!data) {
+      return 0;
+    }
+
+    if(size > map->size) {
+      memset(data + map->size, 0, size - map->size);
+    }
+
+    map->data = data;
+    map->size = size;
+    return 1;
+  }
+
+#ifndef _WIN32
+  if(map->data) {
+    munmap(map->data, map->size);
+    map->data = NULL;
+    STATS_ADD(syscalls, 1);
+  }
+#endif
+
+  STATS_ADD(syscalls, 1);
+  if(ftruncate(fileno(map->file), size) != 0) {
+    return 0;
+  }
+
+  map->size = size;
+  return mapView(map, 0);
+}
+
+/**
+ * Releases a mapping made with mapFile.
+ *
+ * Heap-backed writable mappings are written back to the file (And
+ * the file is cut down to the mapping size) at this point.
+ *
+ * @param struct mappedFile *map The mapping to release.
+ *
+ * @return int 1 if everything made it to the file, 0 otherwise.
+ */
+int unmapFile(struct mappedFile *map) {
+  int result = 1;
+
+  /* Reads still going into the buffer have to finish first */
+  if(map->flags & MAPPED_PENDING) {
+    ioFinish(map->request);
+    map->flags &= ~MAPPED_PENDING;
+  }
+
+  if(map->flags & MAPPED_HEAP) {
+    if(map->flags & MAPPED_WRITE) {
+      rewind(map->file);
+      result = fwrite(map->data, BYTE, map->size, map->file) == map->size &&
+               fflush(map->file) == 0 &&
+               ftruncate(fileno(map->file), map->size) == 0;
+      STATS_ADD(syscalls, 2);
+      STATS_ADD(bytesWritten, map->size);
+    }
+    free(map->data);
+  }
+#ifndef _WIN32
+  else if(map->data) {
+    munmap(map->data, map->size);
+    STATS_ADD(syscalls, 1);
+  }
+#endif
+
+  map->data = NULL;
+  map->size = 0;
+  return result;
+}
+
+/**
+ * Writes new contents over a mapping, only touching the bytes that
+ * actually changed.
+ *
+ * Pages that come out the same are never written to, so they stay
+ * shared with whatever the file was cloned from, and never have to be
+ * written back.
+ *
+ * @param struct mappedFile *map A writable mapping.
+ * @param const unsigned char *data The new contents, which must be
+ * map->size bytes long.
+ */
+void mapUpdate(struct mappedFile *map, const unsigned char *data) {
+  unsigned long long start = statsClock();
+  size_t position = 0, written = 0;
+
+  while(position < map->size) {
+    size_t changed;
+
+    position += diffEqual(map->data + position, data + position,
+                          map->size - position);
+    changed = diffUnequal(map->data + position, data + position,
+                          map->size - position);
+    memcpy(map->data + position, data + position, changed);
+    position += changed;
+    written += changed;
+  }
+
+  STATS_ADD(bytesWritten, written);
+  statsPhase(STATS_FLUSH, start);
+}
+
+/**
+ * Has the kernel copy a file, sharing the blocks between both files
+ * where the filesystem can. (btrfs, XFS and the like)
+ *
+ * @param int from The descriptor of the file to copy.
+ * @param int to The descriptor of the (Empty) file to copy it to.
+ *
+ * @return int 1 if the file was copied, 0 if it needs to be copied by
+ * hand.
+ */
+static int copyKernel(int from, int to) {
+#ifdef __linux__
+  struct stat info;
+  off_t left;
+
+  STATS_ADD(syscalls, 1);
+  if(ioctl(to, FICLONE, from) == 0) {
+    return 1;
+  }
+
+  STATS_ADD(syscalls, 2);
+  if(fstat(from, &info) != 0 || lseek(from, 0, SEEK_SET) != 0) {
+    return 0;
+  }
+
+  for(left = info.st_size; left > 0;) {
+    ssize_t copied = copy_file_range(from, NULL, to, NULL, (size_t)left, 0);
+
+    STATS_ADD(syscalls, 1);
+    if(copied <= 0) {
+      return 0; /* Not across these filesystems; copyFile starts over. */
+    }
+
+    STATS_ADD(bytesRead, copied);
+    STATS_ADD(bytesWritten, copied);
+    left -= copied;
+  }
+
+  return 1;
+#else
+  (void)from;
+  (void)to;
+  return 0;
+#endif
+}
+
+/**
+ * Copies a file to a new path, for patching a copy instead of the
+ * original.
+ *
+ * The copy is cloned where the filesystem supports it, so only the
+ * blocks a patch changes take up any new space. Otherwise the kernel
+ * copies it without it going through our buffers, and failing that
+ * it's copied block by block.
+ *
+ * @param FILE *from The file to copy, which is read from the start.
+ * @param const char *to The path to copy it to. (Overwritten if it
+ * already exists)
+ *
+ * @return FILE* The copy, opened for reading and writing, or NULL if
+ * the copy failed.
+ */
+FILE *copyFile(FILE *from, const char *to) {
+  FILE *copy = fopen(to, "wb+");
+  unsigned char *buffer;
+  size_t read;
+
+  if(!copy) {
+    return NULL;
+  }
+
+  fflush(from);
+  if(copyKernel(fileno(from), fileno(copy))) {
+    rewind(from);
+    rewind(copy);
+    return copy;
+  }
+
+  if(!(buffer = (unsigned char*)malloc(MAP_COPY_BLOCK))) {
+    fclose(copy);
+    return NULL;
+  }
+
+  rewind(from);
+  rewind(copy);
+  while((read = fread(buffer, BYTE, MAP_COPY_BLOCK, from))) {
+    if(fwrite(buffer, BYTE, read, copy) != read) {
+      free(buffer);
+      fclose(copy);
+      return NULL;
+    }
+    STATS_ADD(syscalls, 2);
+    STATS_ADD(bytesRead, read);
+    STATS_ADD(bytesWritten, read);
+  }
+
+  free(buffer);
+  if(ferror(from) || fflush(copy) != 0) {
+    fclose(copy);
+    return NULL;
+  }
+
+  rewind(from);
+  rewind(copy);
+  return copy;
+}
@@ -0,0 +1,25 @@
+/* Mapping flags */
+#define MAPPED_WRITE (1 << 0)
+#define MAPPED_HEAP (1 << 1)
+#define MAPPED_CRC (1 << 2)
+#define MAPPED_PENDING (1 << 3)
+
+/* Block size for plain file copies */
+#define MAP_COPY_BLOCK (1 << 20)
+
+struct mappedFile {
+  unsigned char *data;
+  size_t size;
+  FILE *file;
+  int flags;
+  unsigned int crc;
+  struct ioRequest *request;
+};
+
+int mapFile(struct mappedFile *map, FILE *file, int flags);
+int mapBegin(struct mappedFile *map, FILE *file, int flags);
+int mapWait(struct mappedFile *map);
+int mapResize(struct mappedFile *map, size_t size);
+int unmapFile(struct mappedFile *map);
+void mapUpdate(struct mappedFile *map, const unsigned char *data);
+FILE *copyFile(FILE *from, const char *to);
@@ -0,0 +1,433 @@
+/* Base ROM index */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* For nftw and realpath */
+#endif
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "UPS.h"
+#include "BPS.h"
+#include "MAP.h"
+#include "DECODE.h"
+#include "FORMAT.h"
+#include "ROMS.h"
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <ftw.h>
+#endif
+
+/* The index file in use, and what's been found so far in a build */
+static struct {
+  const char *path;
+  struct romEntry *entries;
+  size_t count;
+  size_t capacity;
+  size_t strings;
+  struct stat index;
+  int haveIndex;
+  int flags;
+} roms;
+
+/**
+ * Sets the index file ROMs are looked up in, (Or written to, by
+ * romsBuild)
+ *
+ * @param const char *path The path to the index file, which has to
+ * outlive the index.
+ */
+void romsOpen(const char *path) {
+  roms.path = path;
+}
+
+/**
+ * @return int Nonzero if an index file has been set with romsOpen.
+ */
+int romsEnabled(void) {
+  return roms.path != NULL;
+}
+
+/**
+ * Works out which bucket of an index a ROM starts looking in.
+ *
+ * CRCs are already spread evenly, so the low bits of the CRC (Mixed
+ * with the size) are all that's needed.
+ */
+static size_t romsHash(size_t size, unsigned int crc, size_t buckets) {
+  return (crc ^ (unsigned int)size ^ (unsigned int)(size >> 16 >> 16)) &
+         (buckets - 1);
+}
+
+#ifndef _WIN32
+/**
+ * Checksums a single file found while building an index.
+ *
+ * Patches, compressed files, empty files and the index itself are
+ * skipped, as none of them are something a patch could be for.
+ */
+static int romsAddFile(const char *path, const struct stat *info,
+                       int type, struct FTW *walk) {
+  struct romEntry *grown;
+  struct mappedFile map;
+  char *real;
+  FILE *file;
+
+  (void)walk;
+  if(type != FTW_F || !S_ISREG(info->st_mode) || info->st_size == 0 ||
+     (roms.haveIndex && info->st_dev == roms.index.st_dev &&
+      info->st_ino == roms.index.st_ino)) {
+    return 0;
+  }
+
+  if(!(file = fopen(path, "rb"))) {
+    AIPSError(ERR_MINOR, "Couldn't open %s", path);
+    return 0;
+  }
+
+  if(formatSniff(file, NULL) || decodeType(file) != DECODE_NONE) {
+    fclose(file);
+    return 0;
+  }
+
+  if(!mapFile(&map, file, MAPPED_CRC)) {
+    fclose(file);
+    AIPSError(ERR_MINOR, "Couldn't read %s", path);
+    return 0;
+  }
+
+  if(roms.count == roms.capacity) {
+    roms.capacity = roms.capacity ? roms.capacity * 2 : 256;
+    if(!(grown = (struct romEntry*)realloc(roms.entries, roms.capacity *
+                                           sizeof(struct romEntry)))) {
+      unmapFile(&map);
+      fclose(file);
+      AIPSError(ERR_MEDIUM, "Ran out of memory indexing %s", path);
+      return -1;
+    }
+    roms.entries = grown;
+  }
+
+  roms.entries[roms.count].size = map.size;
+  roms.entries[roms.count].crc = map.crc;
+  unmapFile(&map);
+  fclose(file);
+
+  if(!(real = realpath(path, NULL))) {
+    AIPSError(ERR_MEDIUM, "Ran out of memory indexing %s", path);
+    return -1;
+  }
+
+  if(roms.flags & ARG_VERBOSE) {
+    printf("%08x\t%lu\t%s\n", roms.entries[roms.count].crc,
+           (unsigned long)roms.entries[roms.count].size, real);
+  }
+
+  roms.entries[roms.count++].path = real;
+  roms.strings += strlen(real) + 1;
+  return 0;
+}
+
+/**
+ * Writes out the index of every ROM found.
+ *
+ * The index is a header, then a hash table of buckets, then a table
+ * of entries, then the paths of every ROM. Each bucket holds the
+ * number of an entry (Counting from 1, 0 is empty) and entries that
+ * land in the same bucket go in the next free one, so a lookup only
+ * ever reads a few buckets, no matter how many ROMs there are. The
+ * table is kept at most half full.
+ *
+ * @param FILE *file The file to write the index to.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+static int romsWrite(FILE *file) {
+  unsigned char header[ROMS_HEADER] = {0}, entry[ROMS_ENTRY];
+  unsigned char *buckets;
+  size_t count = 16, offset = 0, kept = 0, i, slot, number;
+  int result = 1;
+
+  while(count < roms.count * 2) {
+    count *= 2;
+  }
+
+  if(count > 0xFFFFFFFFUL || roms.strings > 0xFFFFFFFFUL) {
+    return AIPSError(ERR_MEDIUM, "There are too many ROMs to index.");
+  }
+
+  if(!(buckets = (unsigned char*)calloc(count, ROMS_BUCKET))) {
+    return AIPSError(ERR_MEDIUM, "Ran out of memory writing the index.");
+  }
+
+  for(i = 0; i < roms.count; i++) {
+    struct romEntry *rom = &roms.entries[i];
+
+    slot = romsHash(rom->size, rom->crc, count);
+    while((number = BYTE4_TO_UINT_LE(buckets + slot * ROMS_BUCKET)) != 0 &&
+          (roms.entries[number - 1].size != rom->size ||
+           roms.entries[number - 1].crc != rom->crc)) {
+      slot = (slot + 1) & (count - 1);
+    }
+
+    /* Copies of a ROM are only worth finding once */
+    if(number != 0) {
+      if(roms.flags & ARG_VERBOSE) {
+        printf("%s is the same as %s\n", rom->path,
+               roms.entries[number - 1].path);
+      }
+      roms.strings -= strlen(rom->path) + 1;
+      free(rom->path);
+      continue;
+    }
+
+    roms.entries[kept++] = *rom;
+    UINT_TO_BYTE4_LE(buckets + slot * ROMS_BUCKET, (unsigned int)kept);
+  }
+  roms.count = kept;
+
+  memcpy(header, ROMS_MAGIC, 8);
+  UINT_TO_BYTE4_LE(header + 8, (unsigned int)roms.count);
+  UINT_TO_BYTE4_LE(header + 12, (unsigned int)count);
+  UINT_TO_BYTE4_LE(header + 16, (unsigned int)roms.strings);
+
+  result = fwrite(header, BYTE, ROMS_HEADER, file) == ROMS_HEADER &&
+           fwrite(buckets, ROMS_BUCKET, count, file) == count;
+  free(buckets);
+
+  for(i = 0; result && i < roms.count; i++) {
+    UINT_TO_BYTE4_LE(entry, (unsigned int)roms.entries[i].size);
+    UINT_TO_BYTE4_LE(entry + 4,
+                     (unsigned int)(roms.entries[i].size >> 16 >> 16));
+    UINT_TO_BYTE4_LE(entry + 8, roms.entries[i].crc);
+    UINT_TO_BYTE4_LE(entry + 12, (unsigned int)offset);
+    offset += strlen(roms.entries[i].path) + 1;
+    result = fwrite(entry, BYTE, ROMS_ENTRY, file) == ROMS_ENTRY;
+  }
+
+  for(i = 0; result && i < roms.count; i++) {
+    size_t length = strlen(roms.entries[i].path) + 1;
+
+    result = fwrite(roms.entries[i].path, BYTE, length, file) == length;
+  }
+
+  return result;
+}
+#endif
+
+/**
+ * Builds an index of every ROM in a directory tree, filed under the
+ * size and CRC32 of each one, so romsFind can pick the ROM a patch is
+ * for without reading any of them.
+ *
+ * The index is written to a file of its own first, and then renamed
+ * over the index set with romsOpen.
+ *
+ * @param pStruct *params The parameter struct, with the directory to
+ * index.
+ *
+ * @return int 1 on success, 0 otherwise.
+ */
+int romsBuild(struct pStruct *params) {
+#ifndef _WIN32
+  char *temporary;
+  FILE *file;
+  size_t i;
+  int result;
+
+  if(!roms.path) {
+    return AIPSError(ERR_MEDIUM, "Indexing ROMs needs an index file to write."
+                     " (Use --roms)");
+  }
+
+  roms.flags = params->flags;
+  roms.haveIndex = stat(roms.path, &roms.index) == 0;
+  result = nftw(params->scanPath, romsAddFile, 64, FTW_PHYS) == 0;
+  if(!result) {
+    AIPSError(ERR_MEDIUM, "Couldn't index %s", params->scanPath);
+  } else if(!(temporary = (char*)malloc(strlen(roms.path) + 32))) {
+    result = AIPSError(ERR_MEDIUM, "Ran out of memory writing the index.");
+  } else {
+    sprintf(temporary, "%s.%lu.tmp", roms.path, (unsigned long)getpid());
+    if(!(file = fopen(temporary, "wb"))) {
+      result = AIPSError(ERR_MEDIUM, "Couldn't open %s.", temporary);
+    } else {
+      result = romsWrite(file);
+      result = fclose(file) == 0 && result;
+      if(!result || rename(temporary, roms.path) != 0) {
+        remove(temporary);
+        result = AIPSError(ERR_MEDIUM, "Couldn't write %s.", roms.path);
+      }
+    }
+    free(temporary);
+  }
+
+  if(result) {
+    printf("Indexed %lu ROM%s.\n", (unsigned long)roms.count,
+           roms.count == 1 ? "" : "s");
+  }
+
+  for(i = 0; i < roms.count; i++) {
+    free(roms.entries[i].path);
+  }
+  free(roms.entries);
+  roms.entries = NULL;
+  roms.count = roms.capacity = roms.strings = 0;
+  return result;
+#else
+  (void)params;
+  return AIPSError(ERR_MEDIUM, "Indexing ROMs isn't supported on this"
+                   " system.");
+#endif
+}
+
+/**
+ * Looks a ROM up in the index set with romsOpen.
+ *
+ * Only the buckets the ROM could be in are read, (And the index is
+ * mapped, not read) so this takes as long with a million ROMs as it
+ * does with one.
+ *
+ * @param size_t size The size of the ROM.
+ * @param unsigned int crc The CRC32 of the ROM.
+ *
+ * @return char* The path to the ROM, (Free it when done) or NULL if
+ * the index doesn't have it.
+ */
+char *romsLookup(size_t size, unsigned int crc) {
+  struct mappedFile map;
+  const unsigned char *entry, *table;
+  size_t count, buckets, strings, slot, number, probes, offset;
+  char *path = NULL;
+  FILE *file;
+
+  if(!roms.path || !(file = fopen(roms.path, "rb"))) {
+    return NULL;
+  }
+
+  if(!mapFile(&map, file, 0)) {
+    fclose(file);
+    return NULL;
+  }
+
+  if(map.size >= ROMS_HEADER && memcmp(map.data, ROMS_MAGIC, 8) == 0) {
+    count = BYTE4_TO_UINT_LE(map.data + 8);
+    buckets = BYTE4_TO_UINT_LE(map.data + 12);
+    strings = BYTE4_TO_UINT_LE(map.data + 16);
+
+    /* Damaged indexes find nothing */
+    if(buckets == 0 || (buckets & (buckets - 1)) != 0 ||
+       (map.size - ROMS_HEADER) / ROMS_BUCKET < buckets) {
+      buckets = 0;
+    } else if((map.size - ROMS_HEADER - buckets * ROMS_BUCKET) / ROMS_ENTRY <
+              count ||
+              map.size - ROMS_HEADER - buckets * ROMS_BUCKET -
+              count * ROMS_ENTRY != strings) {
+      buckets = 0;
+    }
+
+    table = map.data + ROMS_HEADER + buckets * ROMS_BUCKET;
+    slot = buckets ? romsHash(size, crc, buckets) : 0;
+    for(probes = 0; probes < buckets; probes++) {
+      number = BYTE4_TO_UINT_LE(map.data + ROMS_HEADER + slot * ROMS_BUCKET);
+      if(number == 0 || number > count) {
+        break;
+      }
+
+      entry = table + (number - 1) * ROMS_ENTRY;
+      if(BYTE4_TO_UINT_LE(entry + 8) == crc &&
+         ((size_t)BYTE4_TO_UINT_LE(entry + 4) << 16 << 16 |
+          BYTE4_TO_UINT_LE(entry)) == size) {
+        const char *name = (const char*)table + count * ROMS_ENTRY;
+
+        offset = BYTE4_TO_UINT_LE(entry + 12);
+        if(offset < strings && memchr(name + offset, 0, strings - offset) &&
+           (path = (char*)malloc(strlen(name + offset) + 1))) {
+          strcpy(path, name + offset);
+        }
+        break;
+      }
+
+      slot = (slot + 1) & (buckets - 1);
+    }
+  }
+
+  unmapFile(&map);
+  fclose(file);
+  return path;
+}
+
+/**
+ * Picks the ROM to patch out of the index, going by the size and CRC
+ * a UPS or BPS patch has for the file it applies to.
+ *
+ * ROMs out of the index are only ever read, so the patched file has
+ * to go to --output. (Or nowhere, with --verify)
+ *
+ * @param pStruct *params The parameter struct, with the patch and no
+ * ROM yet.
+ *
+ * @return int 1 if the ROM was found and opened, 0 otherwise.
+ */
+int romsFind(struct pStruct *params) {
+  const struct patchFormat *format;
+  struct mappedFile patch;
+  struct upsHeader ups;
+  struct bpsHeader bps;
+  size_t size = 0;
+  unsigned int crc = 0;
+  int known = 0;
+  char *path;
+
+  if(params->stream) {
+    return AIPSError(ERR_MEDIUM, "Finding the ROM for a patch needs the"
+                     " patch as a plain file.");
+  }
+
+  if(!params->outputFile && !(params->flags & ARG_VERIFY)) {
+    return AIPSError(ERR_MEDIUM, "ROMs from the index are only ever read."
+                     " (Use --output)");
+  }
+
+  if(!mapFile(&patch, params->patchFile, 0)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't read the patch.");
+  }
+
+  format = formatMatch(patch.data, patch.size, patch.size);
+  if(format && strcmp(format->name, "UPS") == 0 &&
+     UPSReadHeader(patch.data, patch.size, &ups)) {
+    size = ups.inputSize;
+    crc = ups.footer.input;
+    known = 1;
+  } else if(format && strcmp(format->name, "BPS") == 0 &&
+            BPSReadHeader(patch.data, patch.size, &bps)) {
+    size = bps.sourceSize;
+    crc = bps.sourceChecksum;
+    known = 1;
+  }
+  unmapFile(&patch);
+  rewind(params->patchFile);
+
+  if(!known) {
+    return AIPSError(ERR_MEDIUM, "This patch doesn't say which ROM it's for."
+                     " (Only UPS and BPS patches do)");
+  }
+
+  if(!(path = romsLookup(size, crc))) {
+    return AIPSError(ERR_MEDIUM, "There's no ROM of %lu bytes with a CRC of"
+                     " %08x in %s.", (unsigned long)size, crc, roms.path);
+  }
+
+  if(params->flags & ARG_VERBOSE) {
+    printf("Found the ROM in the index: %s\n", path);
+  }
+
+  if(!(params->romFile = fopen(path, "rb"))) {
+    AIPSError(ERR_MEDIUM, "Couldn't open %s. (Try indexing the ROMs again)",
+              path);
+  }
+
+  free(path);
+  return params->romFile != NULL;
+}
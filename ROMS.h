@@ -0,0 +1,18 @@
+/* ROM index files */
+#define ROMS_MAGIC "AIPSROM1"
+#define ROMS_HEADER 32
+#define ROMS_BUCKET 4
+#define ROMS_ENTRY 16
+
+/* A ROM found while building an index */
+struct romEntry {
+  size_t size;
+  unsigned int crc;
+  char *path;
+};
+
+void romsOpen(const char *path);
+int romsEnabled(void);
+int romsBuild(struct pStruct *params);
+char *romsLookup(size_t size, unsigned int crc);
+int romsFind(struct pStruct *params);
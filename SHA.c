@@ -0,0 +1,166 @@
+/* SHA-256, for naming things by their contents (See FIPS 180-4) */
+
+#include "AIPS.h"
+#include "SHA.h"
+
+static const unsigned int shaRounds[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Mixes one 64 byte block into the state.
+ */
+static void shaBlock(unsigned int *state, const unsigned char *block) {
+  unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for(i = 0; i < 16; i++) {
+    w[i] = BYTE4_TO_UINT(block + i * 4);
+  }
+  for(; i < 64; i++) {
+    unsigned int s0 = SHA_ROTATE(w[i - 15], 7) ^ SHA_ROTATE(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+    unsigned int s1 = SHA_ROTATE(w[i - 2], 17) ^ SHA_ROTATE(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+  e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+  for(i = 0; i < 64; i++) {
+    t1 = h + (SHA_ROTATE(e, 6) ^ SHA_ROTATE(e, 11) ^ SHA_ROTATE(e, 25)) +
+         ((e & f) ^ (~e & g)) + shaRounds[i] + w[i];
+    t2 = (SHA_ROTATE(a, 2) ^ SHA_ROTATE(a, 13) ^ SHA_ROTATE(a, 22)) +
+         ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * Starts a new digest.
+ *
+ * @param struct shaContext *context The context to start.
+ */
+void shaInit(struct shaContext *context) {
+  static const unsigned int initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(context->state, initial, sizeof(initial));
+  context->length = 0;
+  context->used = 0;
+}
+
+/**
+ * Adds data to a digest.
+ *
+ * @param struct shaContext *context The context from shaInit.
+ * @param const unsigned char *data The data to add.
+ * @param size_t length How many bytes to add.
+ */
+void shaUpdate(struct shaContext *context, const unsigned char *data,
+               size_t length) {
+  context->length += length;
+
+  if(context->used) {
+    size_t gap = SHA_BLOCK - context->used;
+
+    if(length < gap) {
+      memcpy(context->block + context->used, data, length);
+      context->used += length;
+      return;
+    }
+
+    memcpy(context->block + context->used, data, gap);
+    shaBlock(context->state, context->block);
+    data += gap;
+    length -= gap;
+    context->used = 0;
+  }
+
+  for(; length >= SHA_BLOCK; data += SHA_BLOCK, length -= SHA_BLOCK) {
+    shaBlock(context->state, data);
+  }
+
+  memcpy(context->block, data, length);
+  context->used = length;
+}
+
+/**
+ * Finishes a digest.
+ *
+ * @param struct shaContext *context The context from shaInit.
+ * @param unsigned char *digest Where to store the SHA_DIGEST bytes of
+ * the digest.
+ */
+void shaFinal(struct shaContext *context, unsigned char *digest) {
+  unsigned long long bits = context->length * 8;
+  int i;
+
+  context->block[context->used++] = 0x80;
+  if(context->used > SHA_BLOCK - 8) {
+    memset(context->block + context->used, 0, SHA_BLOCK - context->used);
+    shaBlock(context->state, context->block);
+    context->used = 0;
+  }
+
+  memset(context->block + context->used, 0, SHA_BLOCK - 8 - context->used);
+  UINT_TO_BYTE4(context->block + SHA_BLOCK - 8, (unsigned int)(bits >> 32));
+  UINT_TO_BYTE4(context->block + SHA_BLOCK - 4, (unsigned int)bits);
+  shaBlock(context->state, context->block);
+
+  for(i = 0; i < 8; i++) {
+    UINT_TO_BYTE4(digest + i * 4, context->state[i]);
+  }
+}
+
+/**
+ * Works out the digest of a whole buffer.
+ *
+ * @param const unsigned char *data The buffer.
+ * @param size_t length The size of the buffer in bytes.
+ * @param unsigned char *digest Where to store the SHA_DIGEST bytes of
+ * the digest.
+ */
+void shaBuffer(const unsigned char *data, size_t length,
+               unsigned char *digest) {
+  struct shaContext context;
+
+  shaInit(&context);
+  shaUpdate(&context, data, length);
+  shaFinal(&context, digest);
+}
+
+/**
+ * Writes a digest out in lowercase hex.
+ *
+ * @param const unsigned char *digest The digest.
+ * @param char *hex Where to write it, with room for SHA_HEX + 1
+ * characters.
+ */
+void shaHex(const unsigned char *digest, char *hex) {
+  int i;
+
+  for(i = 0; i < SHA_DIGEST; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+}
@@ -0,0 +1,21 @@
+/* SHA-256 digest and block sizes, in bytes */
+#define SHA_DIGEST 32
+#define SHA_BLOCK 64
+
+/* Hex digits in a digest, without the terminator */
+#define SHA_HEX (SHA_DIGEST * 2)
+
+struct shaContext {
+  unsigned int state[8];
+  unsigned long long length;
+  size_t used;
+  unsigned char block[SHA_BLOCK];
+};
+
+void shaInit(struct shaContext *context);
+void shaUpdate(struct shaContext *context, const unsigned char *data,
+               size_t length);
+void shaFinal(struct shaContext *context, unsigned char *digest);
+void shaBuffer(const unsigned char *data, size_t length,
+               unsigned char *digest);
+void shaHex(const unsigned char *digest, char *hex);
@@ -0,0 +1,149 @@
+/* Counters, phase timers and their machine-readable output */
+
+#include "AIPS.h"
+#include "STATS.h"
+
+#include <time.h>
+
+_Thread_local struct stats *statsCurrent = NULL;
+
+static const char *statsPhases[STATS_PHASES] = {
+  "detect", "parse", "crc", "apply", "flush"
+};
+
+/**
+ * Reads the monotonic clock, in nanoseconds.
+ */
+static unsigned long long statsNow(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Starts counting into a set of stats on this thread, or stops
+ * counting. The stats are zeroed, and the clock for the total starts.
+ *
+ * @param struct stats *stats The stats to count into, or NULL.
+ */
+void statsUse(struct stats *stats) {
+  if((statsCurrent = stats)) {
+    memset(stats, 0, sizeof(*stats));
+    stats->started = statsNow();
+  }
+}
+
+/**
+ * Starts timing a phase. Every call has to be matched by a call to
+ * statsPhase.
+ *
+ * @return unsigned long long The time in nanoseconds, or 0 if nothing
+ * is being counted (So phases cost next to nothing to time then) or
+ * another phase is already being timed.
+ */
+unsigned long long statsClock(void) {
+  if(!statsCurrent || statsCurrent->timing++) {
+    return 0;
+  }
+
+  return statsNow();
+}
+
+/**
+ * Adds the time since a statsClock reading to a phase.
+ *
+ * @param int phase One of the STATS_ phases.
+ * @param unsigned long long start The reading from statsClock.
+ */
+void statsPhase(int phase, unsigned long long start) {
+  if(statsCurrent) {
+    statsCurrent->timing--;
+    if(start) {
+      statsCurrent->phase[phase] += statsNow() - start;
+    }
+  }
+}
+
+/**
+ * Works out a stats format from its name.
+ *
+ * @return int STATS_JSON or STATS_CSV, or STATS_NONE if the name
+ * isn't one of them.
+ */
+int statsFormat(const char *name) {
+  if(strcmp(name, "json") == 0) {
+    return STATS_JSON;
+  } else if(strcmp(name, "csv") == 0) {
+    return STATS_CSV;
+  }
+
+  return STATS_NONE;
+}
+
+/**
+ * Prints a string for a JSON or CSV field, quoted and escaped.
+ */
+static void statsString(FILE *out, int format, const char *text) {
+  fputc('"', out);
+  for(; *text; text++) {
+    if(*text == '"') {
+      fputs(format == STATS_JSON ? "\\\"" : "\"\"", out);
+    } else if(format == STATS_JSON && *text == '\\') {
+      fputs("\\\\", out);
+    } else if(format == STATS_JSON && (unsigned char)*text < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned int)(unsigned char)*text);
+    } else {
+      fputc(*text, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * Prints a set of stats as one line of JSON, (One object per line, so
+ * a batch's output is JSON Lines) or one CSV row.
+ *
+ * @param FILE *out Where to print the stats.
+ * @param int format STATS_JSON or STATS_CSV.
+ * @param const struct stats *stats The stats to print.
+ * @param const char *job What the stats are for. (Usually the patch)
+ * @param int result Whether the job succeeded.
+ * @param int header Nonzero to print the CSV header line first.
+ */
+void statsPrint(FILE *out, int format, const struct stats *stats,
+                const char *job, int result, int header) {
+  unsigned long long total = statsNow() - stats->started;
+  int i;
+
+  if(format == STATS_CSV && header) {
+    fputs("job,ok,total_ms", out);
+    for(i = 0; i < STATS_PHASES; i++) {
+      fprintf(out, ",%s_ms", statsPhases[i]);
+    }
+    fputs(",bytes_read,bytes_written,syscalls,records\n", out);
+  }
+
+  if(format == STATS_JSON) {
+    fputs("{\"job\":", out);
+    statsString(out, format, job);
+    fprintf(out, ",\"ok\":%s,\"total_ms\":%.3f", result ? "true" : "false",
+            total / 1e6);
+    for(i = 0; i < STATS_PHASES; i++) {
+      fprintf(out, ",\"%s_ms\":%.3f", statsPhases[i], stats->phase[i] / 1e6);
+    }
+    fprintf(out, ",\"bytes_read\":%llu,\"bytes_written\":%llu,"
+            "\"syscalls\":%llu,\"records\":%llu}\n", stats->bytesRead,
+            stats->bytesWritten, stats->syscalls, stats->records);
+  } else {
+    statsString(out, format, job);
+    fprintf(out, ",%d,%.3f", !!result, total / 1e6);
+    for(i = 0; i < STATS_PHASES; i++) {
+      fprintf(out, ",%.3f", stats->phase[i] / 1e6);
+    }
+    fprintf(out, ",%llu,%llu,%llu,%llu\n", stats->bytesRead,
+            stats->bytesWritten, stats->syscalls, stats->records);
+  }
+
+  fflush(out);
+}
@@ -0,0 +1,45 @@
+/* Timed phases */
+#define STATS_DETECT 0
+#define STATS_PARSE 1
+#define STATS_CRC 2
+#define STATS_APPLY 3
+#define STATS_FLUSH 4
+#define STATS_PHASES 5
+
+/* Output formats */
+#define STATS_NONE 0
+#define STATS_JSON 1
+#define STATS_CSV 2
+
+/*
+ * Counters and timers for one run, or one job of a batch. Times are
+ * in nanoseconds. Only the outermost of nested phases is timed, so
+ * no time is counted twice.
+ */
+struct stats {
+  unsigned long long started;
+  int timing;
+  unsigned long long phase[STATS_PHASES];
+  unsigned long long bytesRead;
+  unsigned long long bytesWritten;
+  unsigned long long syscalls;
+  unsigned long long records;
+};
+
+/* What each thread is counting into, if anything */
+extern _Thread_local struct stats *statsCurrent;
+
+/* Adds to a counter, if anything is being counted */
+#define STATS_ADD(counter, amount) \
+  do { \
+    if(statsCurrent) { \
+      statsCurrent->counter += (amount); \
+    } \
+  } while(0)
+
+void statsUse(struct stats *stats);
+unsigned long long statsClock(void);
+void statsPhase(int phase, unsigned long long start);
+int statsFormat(const char *name);
+void statsPrint(FILE *out, int format, const struct stats *stats,
+                const char *job, int result, int header);
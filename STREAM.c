@@ -0,0 +1,221 @@
+/* Streamed (Unseekable) patch input */
+
+#include "AIPS.h"
+#include "CRC.h"
+#include "UPS.h"
+#include "DECODE.h"
+#include "MAP.h"
+#include "STATS.h"
+#include "STREAM.h"
+
+/**
+ * Starts reading a patch from a stream, and reads the first block of
+ * it so its format can be worked out from what's buffered.
+ *
+ * @param FILE *file The stream to read. (Usually stdin)
+ * @param struct decoder *decoder If the patch is compressed, the
+ * decoder to read it through, which the stream then owns. Otherwise
+ * NULL.
+ *
+ * @return struct patchStream* The stream, or NULL if we're out of
+ * memory.
+ */
+struct patchStream *streamOpen(FILE *file, struct decoder *decoder) {
+  struct patchStream *stream = (struct patchStream*)malloc(sizeof(*stream));
+
+  if(!stream) {
+    decodeClose(decoder);
+    return NULL;
+  }
+
+  stream->file = file;
+  stream->decoder = decoder;
+  stream->crc = 0;
+  stream->taken = stream->start = stream->end = 0;
+  stream->limit = (size_t)-1;
+  stream->eof = 0;
+  streamFill(stream, STREAM_BUFFER);
+  return stream;
+}
+
+/**
+ * Frees a stream from streamOpen, and its decoder if it has one. (The
+ * stream's FILE is left open)
+ */
+void streamClose(struct patchStream *stream) {
+  if(stream) {
+    decodeClose(stream->decoder);
+    free(stream);
+  }
+}
+
+/**
+ * Ends a stream early, as if it only had some number of bytes in it.
+ *
+ * @param struct patchStream *stream The stream.
+ * @param size_t limit How many bytes it has, counting the ones already
+ * taken from it.
+ */
+void streamLimit(struct patchStream *stream, size_t limit) {
+  stream->limit = limit;
+  if(stream->taken + (stream->end - stream->start) >= limit) {
+    stream->end = stream->start + (limit - stream->taken);
+    stream->eof = 1;
+  }
+}
+
+/**
+ * Makes sure some number of bytes are buffered, if the stream has
+ * that many left.
+ *
+ * @param struct patchStream *stream The stream to read.
+ * @param size_t wanted How many bytes are wanted. (At most
+ * STREAM_BUFFER)
+ *
+ * @return size_t How many bytes are buffered, which is only less than
+ * wanted at the end of the stream.
+ */
+size_t streamFill(struct patchStream *stream, size_t wanted) {
+  while(stream->end - stream->start < wanted && !stream->eof) {
+    size_t room, read;
+
+    if(stream->start) {
+      memmove(stream->buffer, stream->buffer + stream->start,
+              stream->end - stream->start);
+      stream->end -= stream->start;
+      stream->start = 0;
+    }
+
+    room = STREAM_BUFFER - stream->end;
+    if(room > stream->limit - stream->taken - stream->end) {
+      room = stream->limit - stream->taken - stream->end;
+    }
+
+    if(room == 0) {
+      read = 0;
+    } else if(stream->decoder) {
+      read = decodeRead(stream->decoder, stream->buffer + stream->end, room);
+    } else {
+      read = fread(stream->buffer + stream->end, BYTE, room, stream->file);
+      STATS_ADD(syscalls, 1);
+    }
+    STATS_ADD(bytesRead, read);
+
+    stream->end += read;
+    if(read == 0) {
+      stream->eof = 1;
+    }
+  }
+
+  return stream->end - stream->start;
+}
+
+/**
+ * Moves past buffered bytes, adding them to the CRC.
+ *
+ * @param struct patchStream *stream The stream to read.
+ * @param size_t length How many buffered bytes to move past.
+ */
+void streamTake(struct patchStream *stream, size_t length) {
+  stream->crc = crcBuffer(stream->crc, stream->buffer + stream->start,
+                         length);
+  stream->start += length;
+  stream->taken += length;
+}
+
+/**
+ * Reads a variable-length encoded integer from a stream.
+ *
+ * @param struct patchStream *stream The stream to read.
+ * @param size_t reserve How many bytes at the end of the stream can't
+ * be part of the integer. (A footer)
+ * @param unsigned long *value Where to store the integer.
+ *
+ * @return int 1 on success, 0 if the stream runs out or the value
+ * overflows.
+ */
+int streamVLE(struct patchStream *stream, size_t reserve,
+              unsigned long *value) {
+  size_t position = 0;
+  size_t available = streamFill(stream, reserve + 16);
+
+  if(available <= reserve ||
+     !readVLEBuffer(stream->buffer + stream->start, available - reserve,
+                    &position, value)) {
+    return 0;
+  }
+
+  streamTake(stream, position);
+  return 1;
+}
+
+/**
+ * Reads everything that's left in a stream into memory.
+ *
+ * @param struct patchStream *stream The stream to read.
+ * @param size_t *size Where to store how much was read.
+ *
+ * @return unsigned char* The data, (To be freed) or NULL if we ran out
+ * of memory or the stream couldn't be read.
+ */
+unsigned char *streamReadAll(struct patchStream *stream, size_t *size) {
+  size_t capacity = STREAM_BUFFER;
+  unsigned char *data = (unsigned char*)malloc(capacity);
+
+  *size = 0;
+  while(data && streamFill(stream, 1)) {
+    size_t available = stream->end - stream->start;
+
+    if(*size + available > capacity) {
+      unsigned char *grown;
+
+      while(*size + available > capacity) {
+        capacity *= 2;
+      }
+      if(!(grown = (unsigned char*)realloc(data, capacity))) {
+        free(data);
+        return NULL;
+      }
+      data = grown;
+    }
+
+    memcpy(data + *size, stream->buffer + stream->start, available);
+    *size += available;
+    streamTake(stream, available);
+  }
+
+  if(data && stream->decoder && stream->decoder->failed) {
+    free(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+/**
+ * Reads a whole compressed patch into memory, as if it were mapped.
+ *
+ * @param struct mappedFile *map The mapping to fill in. (Released
+ * with unmapFile as usual)
+ * @param FILE *file The compressed patch.
+ *
+ * @return int 1 on success, 0 if the patch couldn't be unpacked.
+ */
+int streamUnpack(struct mappedFile *map, FILE *file) {
+  struct decoder *decoder = decodeOpen(file, 1, NULL);
+  struct patchStream *stream;
+
+  map->file = NULL;
+  map->flags = MAPPED_HEAP;
+  map->data = NULL;
+  map->size = 0;
+
+  /* streamOpen frees the decoder if it fails */
+  if(!decoder || !(stream = streamOpen(file, decoder))) {
+    return 0;
+  }
+
+  map->data = streamReadAll(stream, &map->size);
+  streamClose(stream);
+  return map->data != NULL;
+}
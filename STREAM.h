@@ -0,0 +1,28 @@
+/* Read buffer size for streamed patches */
+#define STREAM_BUFFER (1 << 16)
+
+/*
+ * A patch being read from a pipe, or out of a compressed file.
+ * Everything taken from it is checksummed.
+ */
+struct patchStream {
+  FILE *file;
+  struct decoder *decoder;
+  unsigned int crc;
+  size_t taken;
+  size_t limit;
+  size_t start;
+  size_t end;
+  int eof;
+  unsigned char buffer[STREAM_BUFFER];
+};
+
+struct patchStream *streamOpen(FILE *file, struct decoder *decoder);
+void streamClose(struct patchStream *stream);
+void streamLimit(struct patchStream *stream, size_t limit);
+size_t streamFill(struct patchStream *stream, size_t wanted);
+void streamTake(struct patchStream *stream, size_t length);
+int streamVLE(struct patchStream *stream, size_t reserve,
+              unsigned long *value);
+unsigned char *streamReadAll(struct patchStream *stream, size_t *size);
+int streamUnpack(struct mappedFile *map, FILE *file);
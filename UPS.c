@@ -1,142 +1,358 @@
 /* UPS file-specific functions */
 
 #include "AIPS.h"
-#include "UPS.h"
 #include "CRC.h"
+#include "UPS.h"
+#include "MAP.h"
+#include "DIFF.h"
+#include "DECODE.h"
+#include "STREAM.h"
+#include "STATS.h"
+#include "FORMAT.h"
+
+#include <sys/stat.h>
 
 /**
- * Checks that a UPS file has the correct header
+ * Reads a single variable-length encoded integer out of a buffer.
  *
- * Checks that the next 4 bytes (In an UPS file, the first 4 bytes are
- * where the header is present) say "UPS1".
+ * @param const unsigned char *buffer The buffer to read from.
+ * @param size_t end The offset of the end of readable data.
+ * @param size_t *position The offset of the VLE, which is moved past
+ * it on success.
+ * @param unsigned long *value Where to store the integer.
  *
- * @param FILE *filePointer the pointer to the UPS patch file.
- *
- * @returns int 1 on a valid UPS1 header, 0 otherwise.
+ * @returns int 1 on success, 0 if the data runs out or overflows.
  */
-int UPSCheckPatch(FILE *filePointer, int verbose) {
-  long fileSize;
-  char buffer[5];
+int readVLEBuffer(const unsigned char *buffer, size_t end,
+                  size_t *position, unsigned long *value) {
+  unsigned long shift = 1,
+                result = 0;
+  size_t i = *position;
 
-  fseek(filePointer, 0L, SEEK_END);
-  fileSize = ftell(filePointer);
-  rewind(filePointer);
+  while(i < end) {
+    unsigned char octet = buffer[i++];
 
-  if(fileSize < 20) { /* Not long enough to be a UPS patch file */
-    return 0;
+    result += (octet & 0x7f) * shift;
+
+    /* If the encoding's high bit is set, we are done here. */
+    if(octet & 0x80) {
+      *position = i;
+      *value = result;
+      return 1;
+    }
+
+    if(shift > (~0UL >> 14)) {
+      return 0;
+    }
+
+    /* Add a new octet sans one bit (The "Should we continue?" bit.) */
+    result += (shift <<= 7);
   }
 
-  if(fread(buffer, BYTE, 4, filePointer) == 0)
+  return 0;
+}
+
+/**
+ * Reads the sizes and checksums out of a UPS patch in memory.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param struct upsHeader *header The struct to fill in.
+ *
+ * @returns int 1 if the patch looks sound, 0 otherwise.
+ */
+int UPSReadHeader(const unsigned char *patch, size_t patchSize,
+                  struct upsHeader *header) {
+  const unsigned char *footer;
+
+  if(patchSize < 18 || memcmp(patch, "UPS1", 4) != 0) {
     return 0;
+  }
 
-  buffer[4] = '\0';
+  header->start = 4;
+  header->end = patchSize - 12;
 
-  /* Valid patch header? */
-  if(strcmp(buffer, "UPS1") == 0) {
-    if(verbose) {
-      printf("This appears to be a valid UPS patch...\n");
-    }
-    return 1;
+  if(!readVLEBuffer(patch, header->end, &header->start, &header->inputSize) ||
+     !readVLEBuffer(patch, header->end, &header->start, &header->outputSize)) {
+    return 0;
   }
 
-  return 0;
+  footer = patch + header->end;
+  header->footer.input = BYTE4_TO_UINT_LE(footer);
+  header->footer.output = BYTE4_TO_UINT_LE(footer + 4);
+  header->footer.patch = BYTE4_TO_UINT_LE(footer + 8);
+  return 1;
 }
 
 /**
- * Reads a single Record from the patch file and returns it in a
- * UPS patchData struct.
+ * Reads a single record (Or "hunk") out of a UPS patch in memory.
+ *
+ * A record is a VLE count of bytes to leave alone, followed by bytes
+ * to XOR with the file up to and including a terminating zero.
  *
- * @param FILE *filePointer the pointer to the UPS patch file.
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t end The offset of the checksum footer.
+ * @param size_t *position The offset of the record, which is moved
+ * past it on success.
+ * @param struct upsRecord *record The struct to describe the record
+ * in. The data points into the patch.
  *
- * @returns int 0 on a failed read, or 1 in the event of the
- * singularity.
+ * @returns int 1 if a record was read, 0 at the end of the records,
+ * and -1 if the record runs into the footer.
  */
-int UPSReadRecord(FILE *file) {
-  int pointer = readVLE(file);
-  printf("Pointer is: %d\n", pointer);
-  /* unsigned int offset[7], bit[1]; */
-  /* fread(&offset, 1, 7, filePointer); */
-  /* fread(&bit, 1, 1, filePointer); */
-  return 0;
+int UPSReadRecord(const unsigned char *patch, size_t end,
+                  size_t *position, struct upsRecord *record) {
+  const unsigned char *terminator;
+  size_t start = *position;
+
+  if(start >= end) {
+    return 0;
+  }
+
+  if(!readVLEBuffer(patch, end, &start, &record->skip)) {
+    return -1;
+  }
+
+  terminator = (const unsigned char*)memchr(patch + start, 0, end - start);
+  if(!terminator) {
+    return -1;
+  }
+
+  record->data = patch + start;
+  record->length = (size_t)(terminator - record->data) + 1;
+  *position = start + record->length;
+  return 1;
 }
 
 /**
- * Reads a single variable-length encoded integer at the current point
- * of the file pointer passed in, and sets the file to the end of the
- * VLE.
+ * Continues a CRC over data[from, to), cut off at limit.
+ */
+static unsigned int crcRange(unsigned int crc, const unsigned char *data,
+                             size_t from, size_t to, size_t limit) {
+  if(to > limit) {
+    to = limit;
+  }
+
+  return from < to ? crcBuffer(crc, data + from, to - from) : crc;
+}
+
+/**
+ * Applies a UPS patch to a buffer in place, in a single pass.
+ *
+ * The buffer holds the file to patch in its first sourceSize bytes,
+ * and must be zeroed up to whichever of sourceSize and targetSize is
+ * larger. While the records are XORed in, the CRCs of the data
+ * before and after patching, and of the patch itself, are worked out
+ * from the same bytes.
  *
- * @param FILE *file the pointer to the file to read the VLE int from.
+ * As XOR undoes itself, calling this a second time with the same
+ * arguments puts the buffer back the way it was, even if the first
+ * call failed part way through.
  *
- * @returns int the integer from the file.
+ * @param const unsigned char *patch The whole patch file.
+ * @param const struct upsHeader *header The header from UPSReadHeader.
+ * @param unsigned char *data The data to patch.
+ * @param size_t sourceSize The size of the data before patching.
+ * @param size_t targetSize The size of the data after patching.
+ * @param struct upsChecksums *actual Where to store the CRCs, or NULL
+ * to skip working them out.
+ *
+ * @returns int 1 on success, 0 if the patch is damaged.
  */
-int readVLE(FILE* file) {
-  int shift = 1,
-      buffer = 0,
-      result = 0;
+int UPSApplyBuffer(const unsigned char *patch, const struct upsHeader *header,
+                   unsigned char *data, size_t sourceSize, size_t targetSize,
+                   struct upsChecksums *actual) {
+  struct upsRecord record = {0, 0, NULL};
+  size_t capacity = sourceSize > targetSize ? sourceSize : targetSize;
+  size_t position = header->start, checked = 0, offset = 0, count = 0;
+  int status;
+
+  if(actual) {
+    actual->input = actual->output = actual->patch = 0;
+  }
 
-  while(1){
-    if(!fread(&buffer, BYTE, 1, file)){
-      return 0;
+  while(1) {
+    size_t start, stop, i;
+
+    status = UPSReadRecord(patch, header->end, &position, &record);
+    if(status > 0) {
+      if(offset > capacity || record.skip > capacity - offset) {
+        status = -1;
+        break;
+      }
+      start = offset + record.skip;
+      stop = start + record.length;
+      if(stop > capacity) {
+        stop = capacity; /* The terminator may sit just past the end */
+      }
+    } else {
+      start = stop = capacity;
     }
 
-    result += (buffer & 0x7f) * shift;
+    if(actual) {
+      /* Checksum the untouched gap and the original record bytes... */
+      actual->input = crcRange(actual->input, data, offset, stop, sourceSize);
+      actual->output = crcRange(actual->output, data, offset, start,
+                                targetSize);
+    }
 
-    /* If the encoding's high bit is set, we are done here. */
-    if(buffer & 0x80)
+    for(i = start; i < stop; i++) {
+      data[i] ^= record.data[i - start];
+    }
+
+    if(status <= 0) {
       break;
+    }
 
-    /* Add a new octet sans one bit (The "Should we continue?" bit.) */
-    result += (shift <<= 7);
+    count++;
+    if(actual) {
+      STATS_ADD(bytesWritten, stop - start);
+      /* ...then the record bytes after patching, and the patch itself. */
+      actual->output = crcRange(actual->output, data, start, stop,
+                                targetSize);
+      actual->patch = crcBuffer(actual->patch, patch + checked,
+                                position - checked);
+      checked = position;
+    }
+
+    offset = start + record.length;
   }
-  return result;
+
+  if(actual) {
+    actual->patch = crcBuffer(actual->patch, patch + checked,
+                              header->end + 8 - checked);
+    STATS_ADD(records, count); /* Not again for an undo */
+  }
+
+  return status == 0;
 }
 
 /**
- * Verifies the CRCs of the UPS file.
+ * Verifies the CRCs of a UPS patch against the ones worked out while
+ * applying it.
+ *
+ * A UPS patch can go either way; if the file matched the output side
+ * of the patch, applying it gives back the input, so the checksums
+ * are compared the other way around.
+ *
+ * @param pStruct *params The parameter struct, for the verbose flag.
+ * @param const struct upsHeader *header The header of the patch.
+ * @param const struct upsChecksums *actual The CRCs from UPSApplyBuffer.
+ * @param size_t sourceSize The size of the file before patching.
+ *
+ * @returns int 1 if everything checks out, 0 otherwise.
  */
-int UPSVerifyCRC(struct pStruct *params)
+int UPSVerifyCRC(struct pStruct *params, const struct upsHeader *header,
+                 const struct upsChecksums *actual, size_t sourceSize)
 {
-  long position = ftell(params->patchFile);
-  unsigned int inputChecksum,
-               outputChecksum,
-               patchChecksum;
-
-  fseek(params->patchFile, -12L, SEEK_END);
-  if(fread(&inputChecksum, BYTE, 4, params->patchFile) &&
-     fread(&outputChecksum, BYTE, 4, params->patchFile) &&
-     fread(&patchChecksum, BYTE, 4, params->patchFile))
-    {
-      unsigned int table[256];
-      unsigned int patchFileCRC, romFileCRC;
-
-      fseek(params->patchFile, -4L, SEEK_END);
-
-      /* UPS uses 0xedb88320 as the polynomial value for CRC. */
-      crcTable(&table[0], 0xedb88320);
-
-      patchFileCRC = crcFile(params->patchFile, &table[0]);
-      romFileCRC = crcFile(params->romFile, &table[0]);
-
-      if(params->flags & ARG_VERBOSE) {
-        printf("Patch file read CRC: %#10x, actual: %#10x\n"
-               "ROM file read CRC: %#10x, actual: %#10x\n",
-               patchChecksum, patchFileCRC,
-               inputChecksum, romFileCRC);
-      }
+  const struct upsChecksums *footer = &header->footer;
+  int forward = (sourceSize == header->inputSize &&
+                 actual->input == footer->input),
+      reverse = (sourceSize == header->outputSize &&
+                 actual->input == footer->output);
 
-      if(patchChecksum != patchFileCRC) {
-        return AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
-      }
+  if(params->flags & ARG_VERBOSE) {
+    printf("Patch file read CRC: %#10x, actual: %#10x\n"
+           "ROM file read CRC: %#10x, actual: %#10x\n",
+           footer->patch, actual->patch,
+           forward || !reverse ? footer->input : footer->output,
+           actual->input);
+  }
 
-      if(inputChecksum != romFileCRC) {
-        return AIPSError(ERR_MEDIUM,
-                         "You may have an invalid file."
-                         " (Or this patch isn't for this file.)");
-      }
+  if(footer->patch != actual->patch) {
+    return AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
+  }
+
+  if(!forward && !reverse) {
+    return AIPSError(ERR_MEDIUM,
+                     "You may have an invalid file."
+                     " (Or this patch isn't for this file.)");
+  }
+
+  if(actual->output != (forward ? footer->output : footer->input)) {
+    return AIPSError(ERR_MEDIUM, "The patched file didn't come out right!");
+  }
+
+  if(!forward && (params->flags & ARG_VERBOSE)) {
+    printf("This file was already patched, so it was unpatched instead.\n");
+  }
+
+  return 1;
+}
+
+/**
+ * Checks a UPS patch against a file without patching it.
+ *
+ * The patch's own CRC is checked, then the file's size and CRC are
+ * matched against the input side of the patch, (Or the output side,
+ * to go the other way) and every record is checked to fit. The CRC of
+ * the patched file is taken from the patch, as the patch's CRC covers
+ * it.
+ *
+ * @param const unsigned char *patch The whole patch file.
+ * @param size_t patchSize The size of the patch in bytes.
+ * @param const unsigned char *rom The file the patch is for.
+ * @param size_t romSize The size of the file in bytes.
+ * @param struct patchCheck *check Where to store the size and CRC of
+ * the patched file.
+ *
+ * @returns int 1 if the patch can be applied to the file, 0 otherwise.
+ */
+int UPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check) {
+  struct upsHeader header;
+  struct upsRecord record = {0, 0, NULL};
+  size_t capacity, position, offset = 0;
+  unsigned int crc;
+  int status;
+
+  if(!UPSReadHeader(patch, patchSize, &header)) {
+    return AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  }
+
+  if(crcBuffer(0, patch, header.end + 8) != header.footer.patch) {
+    return AIPSError(ERR_MEDIUM, "Oh no! This patch file looks invalid!");
+  }
+
+  check->wrongFile = 1;
+  if(romSize != header.inputSize && romSize != header.outputSize) {
+    return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  }
+
+  /* Either side of the patch will do */
+  crc = crcBuffer(0, rom, romSize);
+  if(romSize == header.inputSize && crc == header.footer.input) {
+    check->outputSize = header.outputSize;
+    check->outputCRC = header.footer.output;
+  } else if(romSize == header.outputSize && crc == header.footer.output) {
+    check->outputSize = header.inputSize;
+    check->outputCRC = header.footer.input;
+  } else {
+    return AIPSError(ERR_MEDIUM, "You may have an invalid file."
+                     " (Or this patch isn't for this file.)");
+  }
+
+  check->wrongFile = 0;
+  capacity = header.inputSize > header.outputSize ? header.inputSize :
+             header.outputSize;
+  check->records = 0;
+  position = header.start;
+  while((status = UPSReadRecord(patch, header.end, &position, &record)) > 0) {
+    if(offset > capacity || record.skip > capacity - offset) {
+      return AIPSError(ERR_MEDIUM, "Record %lu of this UPS patch starts past"
+                       " the end of the file.", check->records + 1);
     }
+    offset += record.skip + record.length;
+    check->records++;
+  }
 
-  fseek(params->patchFile, position, SEEK_SET);
+  if(status < 0) {
+    return AIPSError(ERR_MEDIUM, "This UPS patch is cut short: record %lu"
+                     " runs into the checksums.", check->records + 1);
+  }
 
+  STATS_ADD(records, check->records);
   return 1;
 }
 
@@ -144,6 +360,14 @@ int UPSVerifyCRC(struct pStruct *params)
  * Patches a UPS file according to the paramaters passed in the
  * pStruct.
  *
+ * The patch and ROM are both mapped, and the patch is applied to the
+ * ROM in one pass that also works out every CRC. If anything doesn't
+ * check out afterwards, the patch is applied a second time to undo
+ * it, leaving the ROM as it was.
+ *
+ * A copier header (See formatHeader) is left where it is, and sizes,
+ * records and CRCs all start after it.
+ *
  * @param pStruct *params A paramater structure complete with the
  * input and output files, as well as any flags wanted during
  * patching.
@@ -151,35 +375,585 @@ int UPSVerifyCRC(struct pStruct *params)
  * @returns int 1 on a sucessful patch, 0 otherwise.
  */
 int UPSPatchFile(struct pStruct *params) {
+  struct mappedFile patch, rom;
+  struct upsHeader header;
+  struct upsChecksums actual;
+  size_t sourceSize, targetSize, skip;
+  unsigned long long start;
+  int result;
+
+  if(!mapBegin(&patch, params->patchFile, 0)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't read the UPS patch.");
+  }
 
-  int inputFileSize, outputFileSize, actualSize;
-  fseek(params->romFile, 0, SEEK_END);
+  if(!mapWait(&patch)) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't read the UPS patch.");
+  }
 
-  inputFileSize = readVLE(params->patchFile);
-  outputFileSize = readVLE(params->patchFile);
-  actualSize = ftell(params->romFile);
+  start = statsClock();
+  result = UPSReadHeader(patch.data, patch.size, &header);
+  statsPhase(STATS_PARSE, start);
+  if(!result) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  }
+
+  if(!mapFile(&rom, params->romFile, MAPPED_WRITE)) {
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't open the file to patch.");
+  }
+
+  /* A copier header stays put, and the patch applies after it */
+  skip = formatHeader(params, rom.size);
 
-  rewind(params->romFile);
   if(params->flags & ARG_VERBOSE){
     printf("The UPS patch says:\n"
-           "Input Filesize: %d bytes\nOutput Filesize: %d bytes\n"
-           "...And the actual filesize is: %d bytes\n",
-           inputFileSize, outputFileSize, actualSize);
+           "Input Filesize: %lu bytes\nOutput Filesize: %lu bytes\n"
+           "...And the actual filesize is: %lu bytes\n",
+           header.inputSize, header.outputSize,
+           (unsigned long)(rom.size - skip));
   }
 
-  if(inputFileSize != actualSize) { /*TODO: Force option. */
+  sourceSize = rom.size - skip;
+  if(sourceSize == header.inputSize) {
+    targetSize = header.outputSize;
+  } else if(sourceSize == header.outputSize) {
+    targetSize = header.inputSize;
+  } else { /*TODO: Force option. */
+    unmapFile(&rom);
+    unmapFile(&patch);
     return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
   }
 
   if(params->flags & ARG_VERBOSE) {
-    printf("Good! They match. Now for the CRC checks..!\n");
+    printf("Good! They match. Now for the patch and CRC checks..!\n");
+  }
+
+  if(!mapResize(&rom, skip + (sourceSize > targetSize ? sourceSize :
+                              targetSize))) {
+    unmapFile(&rom);
+    unmapFile(&patch);
+    return AIPSError(ERR_MEDIUM, "Couldn't resize the file to patch.");
+  }
+
+  start = statsClock();
+  result = UPSApplyBuffer(patch.data, &header, rom.data + skip,
+                          sourceSize, targetSize, &actual);
+  statsPhase(STATS_APPLY, start);
+  if(!result) {
+    AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  }
+
+  if(result && UPSVerifyCRC(params, &header, &actual, sourceSize)) {
+    result = mapResize(&rom, skip + targetSize);
+  } else {
+    UPSApplyBuffer(patch.data, &header, rom.data + skip, sourceSize,
+                   targetSize, NULL);
+    mapResize(&rom, skip + sourceSize);
+    result = 0;
+  }
+
+  start = statsClock();
+  result = unmapFile(&rom) && result;
+  statsPhase(STATS_FLUSH, start);
+  unmapFile(&patch);
+  return result;
+}
+
+/**
+ * Journals bytes of a record before they're XORed into the file, at
+ * the same offset they go in the file.
+ *
+ * @return int 1 on success, 0 if the journal couldn't be written.
+ */
+static int UPSJournalWrite(struct upsJournal *journal, size_t offset,
+                           const unsigned char *data, size_t length) {
+  if(fseeko(journal->file, (off_t)offset, SEEK_SET) != 0 ||
+     fwrite(data, BYTE, length, journal->file) != length) {
+    return 0;
+  }
+
+  if(offset + length > journal->end) {
+    journal->end = offset + length;
+  }
+  return 1;
+}
+
+/**
+ * Undoes everything in a journal, by XORing it all back in. The parts
+ * no record reached read as zeros, so they're left as they are.
+ *
+ * @return int 1 on success, 0 if the journal couldn't be read.
+ */
+static int UPSJournalUndo(struct upsJournal *journal, unsigned char *data) {
+  unsigned char *block = (unsigned char*)malloc(STREAM_BUFFER);
+  size_t offset, length, i;
+
+  if(!block) {
+    return 0;
   }
 
-  if(UPSVerifyCRC(params)) {
-    printf("Yay!");
+  rewind(journal->file);
+  for(offset = 0; offset < journal->end; offset += length) {
+    length = journal->end - offset < STREAM_BUFFER ?
+             journal->end - offset : STREAM_BUFFER;
+    if(fread(block, BYTE, length, journal->file) != length) {
+      free(block);
+      return 0;
+    }
+    for(i = 0; i < length; i++) {
+      data[offset + i] ^= block[i];
+    }
+  }
+
+  free(block);
+  return 1;
+}
+
+/**
+ * Applies the records of a UPS patch as they're read from a stream.
+ *
+ * This works the same way as UPSApplyBuffer, but never needs more of
+ * the patch than the stream buffers; record data is XORed in as it
+ * arrives. As the records' end can only be told by the footer being
+ * all that's left, the last footer bytes of the stream are never
+ * treated as records.
+ *
+ * Like UPSApplyBuffer, reading the same bytes through again undoes
+ * everything, even if the first pass stopped part way through.
+ *
+ * @param struct patchStream *in The patch, just after its header.
+ * @param unsigned char *data The data to patch. (Zeroed past the end,
+ * as for UPSApplyBuffer)
+ * @param size_t sourceSize The size of the data before patching.
+ * @param size_t targetSize The size of the data after patching.
+ * @param size_t footer How many bytes at the end of the stream follow
+ * the records.
+ * @param struct upsChecksums *actual Where to work out the input and
+ * output CRCs, or NULL to skip them.
+ * @param struct upsJournal *journal Where to keep what's XORed in so
+ * it can be undone, or NULL.
+ *
+ * @returns int 1 if the records ended exactly at the footer, -1 if the
+ * journal couldn't be written, (And nothing more was XORed in) and 0
+ * otherwise.
+ */
+static int UPSStreamRecords(struct patchStream *in, unsigned char *data,
+                            size_t sourceSize, size_t targetSize,
+                            size_t footer, struct upsChecksums *actual,
+                            struct upsJournal *journal) {
+  size_t capacity = sourceSize > targetSize ? sourceSize : targetSize;
+  size_t offset = 0;
+
+  if(actual) {
+    actual->input = actual->output = 0;
+  }
+
+  while(1) {
+    size_t available = streamFill(in, footer + 16), position;
+    unsigned long skip;
+
+    if(in->eof && available <= footer) {
+      if(available < footer) {
+        return 0;
+      }
+      break;
+    }
+
+    if(!streamVLE(in, footer, &skip) ||
+       offset > capacity || skip > capacity - offset) {
+      return 0;
+    }
+
+    position = offset + skip;
+    if(actual) {
+      STATS_ADD(records, 1);
+      actual->input = crcRange(actual->input, data, offset, position,
+                               sourceSize);
+      actual->output = crcRange(actual->output, data, offset, position,
+                                targetSize);
+    }
+
+    /* XOR in whatever's buffered up to the terminator, then refill. */
+    while(1) {
+      const unsigned char *chunk, *terminator;
+      size_t usable, length, from, to, i;
+
+      available = streamFill(in, footer + 1);
+      if(available <= footer) {
+        return 0; /* The record ran into the footer */
+      }
+
+      usable = available - footer;
+      chunk = in->buffer + in->start;
+      terminator = (const unsigned char*)memchr(chunk, 0, usable);
+      length = terminator ? (size_t)(terminator - chunk) + 1 : usable;
+
+      from = position < capacity ? position : capacity;
+      to = position + length < capacity ? position + length : capacity;
+      if(journal && to > from &&
+         !UPSJournalWrite(journal, from, chunk + (from - position),
+                          to - from)) {
+        return -1;
+      }
+      if(actual) {
+        actual->input = crcRange(actual->input, data, from, to, sourceSize);
+      }
+      for(i = from; i < to; i++) {
+        data[i] ^= chunk[i - position];
+      }
+      if(actual) {
+        actual->output = crcRange(actual->output, data, from, to, targetSize);
+        STATS_ADD(bytesWritten, to - from);
+      }
+
+      streamTake(in, length);
+      position += length;
+      if(terminator) {
+        break;
+      }
+    }
+
+    offset = position;
+  }
+
+  if(actual) {
+    actual->input = crcRange(actual->input, data, offset, capacity,
+                             sourceSize);
+    actual->output = crcRange(actual->output, data, offset, capacity,
+                              targetSize);
+  }
+
+  return 1;
+}
+
+/**
+ * Reads the magic number and sizes at the start of a streamed UPS
+ * patch.
+ */
+static int UPSStreamHeader(struct patchStream *in, size_t footer,
+                           struct upsHeader *header) {
+  if(streamFill(in, 4) < 4 || memcmp(in->buffer + in->start, "UPS1", 4) != 0) {
+    return 0;
+  }
+
+  streamTake(in, 4);
+  return streamVLE(in, footer, &header->inputSize) &&
+         streamVLE(in, footer, &header->outputSize);
+}
+
+/**
+ * Undoes a compressed patch read out of a file, by unpacking it again
+ * and reading the same bytes back through. (See UPSStreamRecords)
+ *
+ * @param struct patchStream *in The stream the patch was applied from.
+ * @param unsigned char *data The patched data.
+ * @param size_t sourceSize The size of the data before patching.
+ * @param size_t targetSize The size of the data after patching.
+ *
+ * @return int 1 if everything that was applied was undone, 0
+ * otherwise.
+ */
+static int UPSDecodeUndo(const struct patchStream *in, unsigned char *data,
+                         size_t sourceSize, size_t targetSize) {
+  struct decoder *decoder = decodeOpen(in->file, 1, NULL);
+  struct patchStream *undo;
+  struct upsHeader header;
+  int result = 0;
+
+  if(decoder && (undo = streamOpen(in->file, decoder))) {
+    streamLimit(undo, in->taken);
+    if(UPSStreamHeader(undo, 0, &header)) {
+      UPSStreamRecords(undo, data, sourceSize, targetSize, 0, NULL, NULL);
+      result = undo->taken == in->taken;
+    }
+    streamClose(undo);
+  }
+
+  return result;
+}
+
+/**
+ * Patches a file with a UPS patch read from a pipe, or out of a
+ * compressed file.
+ *
+ * The patch is applied as it's read, and the checksums in its footer
+ * are only checked once the whole thing has gone through. If they
+ * don't check out, (Or the patch is cut short) it's undone. A
+ * compressed file can just be unpacked again for that, but a pipe
+ * can't be read twice, and what a record XORs in can't be told from
+ * the file afterwards. So for pipes, each record's bytes are journaled
+ * at their offset (See struct upsJournal) to be XORed back out.
+ *
+ * @param pStruct *params A paramater structure with the file to
+ * patch, and the stream to read the patch from.
+ *
+ * @returns int 1 on a sucessful patch, 0 otherwise.
+ */
+int UPSPatchPipe(struct pStruct *params) {
+  struct patchStream *in = params->stream;
+  struct upsJournal journal = {NULL, 0};
+  struct mappedFile rom;
+  struct upsHeader header;
+  struct upsChecksums actual;
+  size_t sourceSize, targetSize, skip;
+  unsigned long long start;
+  struct stat info;
+  int result;
+
+  start = statsClock();
+  result = UPSStreamHeader(in, 12, &header);
+  statsPhase(STATS_PARSE, start);
+  if(!result) {
+    return AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
   }
 
-  /* TODO: The actual patch */
+  if(!mapFile(&rom, params->romFile, MAPPED_WRITE)) {
+    return AIPSError(ERR_MEDIUM, "Couldn't open the file to patch.");
+  }
+
+  /* A copier header stays put, and the patch applies after it */
+  skip = formatHeader(params, rom.size);
+
+  if(params->flags & ARG_VERBOSE){
+    printf("The UPS patch says:\n"
+           "Input Filesize: %lu bytes\nOutput Filesize: %lu bytes\n"
+           "...And the actual filesize is: %lu bytes\n",
+           header.inputSize, header.outputSize,
+           (unsigned long)(rom.size - skip));
+  }
+
+  sourceSize = rom.size - skip;
+  if(sourceSize == header.inputSize) {
+    targetSize = header.outputSize;
+  } else if(sourceSize == header.outputSize) {
+    targetSize = header.inputSize;
+  } else {
+    unmapFile(&rom);
+    return AIPSError(ERR_MEDIUM, "The file seems to be the wrong size, yo~!");
+  }
+
+  if(!(in->decoder && fstat(fileno(in->file), &info) == 0 &&
+       S_ISREG(info.st_mode)) && !(journal.file = tmpfile())) {
+    unmapFile(&rom);
+    return AIPSError(ERR_MEDIUM, "Couldn't make a journal to roll back with.");
+  }
+
+  if(!mapResize(&rom, skip + (sourceSize > targetSize ? sourceSize :
+                              targetSize))) {
+    if(journal.file) {
+      fclose(journal.file);
+    }
+    unmapFile(&rom);
+    return AIPSError(ERR_MEDIUM, "Couldn't resize the file to patch.");
+  }
+
+  start = statsClock();
+  result = UPSStreamRecords(in, rom.data + skip, sourceSize, targetSize, 12,
+                            &actual, journal.file ? &journal : NULL);
+  statsPhase(STATS_APPLY, start);
+  if(result < 0) {
+    result = AIPSError(ERR_MEDIUM, "Couldn't write the journal to roll back"
+                       " with.");
+  } else if(!result) {
+    AIPSError(ERR_MEDIUM, "This UPS patch seems to be damaged.");
+  } else {
+    const unsigned char *footer = in->buffer + in->start;
+
+    header.footer.input = BYTE4_TO_UINT_LE(footer);
+    header.footer.output = BYTE4_TO_UINT_LE(footer + 4);
+    header.footer.patch = BYTE4_TO_UINT_LE(footer + 8);
+    actual.patch = crcBuffer(in->crc, footer, 8);
+    result = UPSVerifyCRC(params, &header, &actual, sourceSize);
+  }
+
+  if(result) {
+    result = mapResize(&rom, skip + targetSize);
+  } else if(journal.file ? !UPSJournalUndo(&journal, rom.data + skip) :
+            !UPSDecodeUndo(in, rom.data + skip, sourceSize, targetSize)) {
+    AIPSError(ERR_MEDIUM, "The patch couldn't be read back through, so the"
+              " file couldn't be put back the way it was!");
+  } else {
+    mapResize(&rom, skip + sourceSize);
+  }
+  if(journal.file) {
+    fclose(journal.file);
+  }
+
+  start = statsClock();
+  result = unmapFile(&rom) && result;
+  statsPhase(STATS_FLUSH, start);
+  return result;
+}
+
+/**
+ * Writes a variable-length encoded integer to a checksummed stream.
+ *
+ * @param struct crcStream *stream The stream to write to.
+ * @param unsigned long value The integer to write.
+ */
+void writeVLE(struct crcStream *stream, unsigned long value) {
+  while(1) {
+    unsigned char octet = value & 0x7f;
+
+    value >>= 7;
+    if(value == 0) {
+      crcStreamByte(stream, octet | 0x80);
+      return;
+    }
+
+    crcStreamByte(stream, octet);
+    value--;
+  }
+}
+
+/**
+ * Reads the next block of a file, padding it out with zeros past the
+ * end of the file.
+ *
+ * @returns size_t The number of bytes that actually came from the file.
+ */
+static size_t UPSReadBlock(FILE *file, unsigned char *buffer, size_t length) {
+  size_t read = fread(buffer, BYTE, length, file);
 
-  return UPSReadRecord(params->patchFile);
+  memset(buffer + read, 0, length - read);
+  return read;
+}
+
+/**
+ * Writes the XOR of two runs of bytes straight into the stream
+ * buffer, a buffer's worth at a time.
+ */
+static void UPSWriteXOR(struct crcStream *out, const unsigned char *source,
+                        const unsigned char *target, size_t length) {
+  while(length) {
+    size_t room = CRC_STREAM_SIZE - out->used;
+    size_t chunk = length < room ? length : room;
+    unsigned char *buffer = out->buffer + out->used;
+    size_t i;
+
+    for(i = 0; i < chunk; i++) {
+      buffer[i] = source[i] ^ target[i];
+    }
+
+    out->used += chunk;
+    source += chunk;
+    target += chunk;
+    length -= chunk;
+
+    if(out->used == CRC_STREAM_SIZE) {
+      crcStreamFlush(out);
+    }
+  }
+}
+
+/**
+ * Creates a UPS patch from an original and a modified file.
+ *
+ * Both files are streamed through in blocks, so memory use stays the
+ * same no matter how big they are. Changed runs are found with the
+ * same wide compares the IPS creator uses, their XOR is written out
+ * as a record, and the CRCs of both files and the patch are worked
+ * out along the way.
+ *
+ * @param pStruct *params A paramater structure with the original
+ * (romFile), modified (targetFile) and patch files.
+ *
+ * @returns int 1 on a sucessful patch, 0 otherwise.
+ */
+int UPSCreatePatch(struct pStruct *params) {
+  struct crcStream *out = (struct crcStream*)malloc(sizeof(struct crcStream));
+  unsigned char *source = (unsigned char*)malloc(UPS_BLOCK * 2);
+  unsigned char *target = source + UPS_BLOCK;
+  unsigned char footer[4];
+  unsigned int inputCRC = 0, outputCRC = 0;
+  unsigned long sourceSize, targetSize, length, done, relative = 0;
+  int running = 0, result;
+
+  if(!out || !source) {
+    free(out);
+    free(source);
+    return AIPSError(ERR_MEDIUM, "Out of memory!");
+  }
+
+  fseek(params->romFile, 0L, SEEK_END);
+  sourceSize = ftell(params->romFile);
+  rewind(params->romFile);
+  fseek(params->targetFile, 0L, SEEK_END);
+  targetSize = ftell(params->targetFile);
+  rewind(params->targetFile);
+  length = sourceSize > targetSize ? sourceSize : targetSize;
+
+  rewind(params->patchFile);
+  crcStreamOpen(out, params->patchFile);
+  crcStreamWrite(out, (const unsigned char*)"UPS1", 4);
+  writeVLE(out, sourceSize);
+  writeVLE(out, targetSize);
+
+  for(done = 0; done < length; done += UPS_BLOCK) {
+    size_t block = length - done < UPS_BLOCK ? length - done : UPS_BLOCK;
+    size_t i = 0;
+
+    inputCRC = crcBuffer(inputCRC, source,
+                         UPSReadBlock(params->romFile, source, block));
+    outputCRC = crcBuffer(outputCRC, target,
+                          UPSReadBlock(params->targetFile, target, block));
+
+    while(i < block) {
+      size_t run;
+
+      if(!running) {
+        size_t same = diffEqual(source + i, target + i, block - i);
+
+        relative += same;
+        i += same;
+        if(i == block) {
+          break;
+        }
+
+        writeVLE(out, relative);
+        running = 1;
+      }
+
+      run = diffUnequal(source + i, target + i, block - i);
+      UPSWriteXOR(out, source + i, target + i, run);
+      i += run;
+
+      if(i == block) {
+        break; /* The run carries on into the next block */
+      }
+
+      /* The first matching byte terminates the record */
+      crcStreamByte(out, 0);
+      running = 0;
+      relative = 0;
+      i++;
+    }
+  }
+
+  if(running) {
+    crcStreamByte(out, 0);
+  }
+
+  UINT_TO_BYTE4_LE(footer, inputCRC);
+  crcStreamWrite(out, footer, 4);
+  UINT_TO_BYTE4_LE(footer, outputCRC);
+  crcStreamWrite(out, footer, 4);
+  crcStreamFlush(out);
+  UINT_TO_BYTE4_LE(footer, out->crc);
+  crcStreamWrite(out, footer, 4);
+
+  result = crcStreamFlush(out) && fflush(params->patchFile) == 0;
+  if(!result) {
+    AIPSError(ERR_MEDIUM, "Couldn't write the UPS patch.");
+  } else if(params->flags & ARG_VERBOSE) {
+    printf("Created a %ld byte UPS patch.\n"
+           "Input CRC: %#10x\nOutput CRC: %#10x\n",
+           ftell(params->patchFile), inputCRC, outputCRC);
+  }
+
+  free(source);
+  free(out);
+  return result;
 }
@@ -1,4 +1,52 @@
-int UPSReadRecord(FILE *filePointer);
-int UPSCheckPatch(FILE *filePointer, int verbose);
+/* Block size for streaming patch creation */
+#define UPS_BLOCK (1 << 20)
+
+struct upsChecksums {
+  unsigned int input;
+  unsigned int output;
+  unsigned int patch;
+};
+
+struct upsHeader {
+  unsigned long inputSize;
+  unsigned long outputSize;
+  size_t start;
+  size_t end;
+  struct upsChecksums footer;
+};
+
+struct upsRecord {
+  unsigned long skip;
+  size_t length;
+  const unsigned char *data;
+};
+
+/*
+ * What a streamed patch has XORed into the file so far, so it can be
+ * undone. Each record's bytes go at their own offset in a sparse
+ * temporary file, so it never gets bigger than the file being
+ * patched, no matter how long the patch is.
+ */
+struct upsJournal {
+  FILE *file;
+  size_t end;
+};
+
+int UPSReadHeader(const unsigned char *patch, size_t patchSize,
+                  struct upsHeader *header);
+int UPSReadRecord(const unsigned char *patch, size_t end,
+                  size_t *position, struct upsRecord *record);
+int UPSApplyBuffer(const unsigned char *patch, const struct upsHeader *header,
+                   unsigned char *data, size_t sourceSize, size_t targetSize,
+                   struct upsChecksums *actual);
+int UPSVerifyCRC(struct pStruct *params, const struct upsHeader *header,
+                 const struct upsChecksums *actual, size_t sourceSize);
 int UPSPatchFile(struct pStruct *params);
-int readVLE(FILE* file);
+int UPSPatchPipe(struct pStruct *params);
+int UPSVerify(const unsigned char *patch, size_t patchSize,
+              const unsigned char *rom, size_t romSize,
+              struct patchCheck *check);
+int UPSCreatePatch(struct pStruct *params);
+void writeVLE(struct crcStream *stream, unsigned long value);
+int readVLEBuffer(const unsigned char *buffer, size_t end,
+                  size_t *position, unsigned long *value);